@@ -0,0 +1,53 @@
+use criterion::{criterion_group, criterion_main, Criterion, Throughput};
+
+const PAGE_SIZE: usize = 8192;
+
+#[repr(C, align(64))]
+struct PageImage([u8; PAGE_SIZE]);
+
+extern "C" {
+    fn page_checksum(page: *const PageImage, page_id: u32) -> u32;
+    fn page_checksum_set(page: *mut PageImage);
+    fn page_checksum_verify(page: *const PageImage, page_id: u32) -> bool;
+}
+
+// A page with its header page_id set and the rest filled with a pattern
+// that does not compress to a few repeated words.
+fn sample_page(page_id: u32) -> Box<PageImage> {
+    let mut page = Box::new(PageImage([0; PAGE_SIZE]));
+    let mut x: u32 = 0x9e37_79b9;
+    for (i, byte) in page.0.iter_mut().enumerate().skip(32) {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        *byte = (x as usize ^ i) as u8;
+    }
+    page.0[..4].copy_from_slice(&page_id.to_le_bytes());
+    page
+}
+
+fn bench_page_checksum(c: &mut Criterion) {
+    let mut group = c.benchmark_group("page_checksum");
+    group.throughput(Throughput::Bytes(PAGE_SIZE as u64));
+
+    let mut page = sample_page(7);
+    group.bench_function("compute", |b| {
+        b.iter(|| unsafe { page_checksum(&*page, 7) })
+    });
+
+    unsafe { page_checksum_set(&mut *page) };
+    group.bench_function("verify", |b| {
+        b.iter(|| unsafe { assert!(page_checksum_verify(&*page, 7)) })
+    });
+
+    // A zero checksum is only accepted on an all-zero page, which costs a
+    // scan of the page instead of a checksum.
+    let zero = Box::new(PageImage([0; PAGE_SIZE]));
+    group.bench_function("verify_zeroed", |b| {
+        b.iter(|| unsafe { assert!(page_checksum_verify(&*zero, 7)) })
+    });
+    group.finish();
+}
+
+criterion_group!(benches, bench_page_checksum);
+criterion_main!(benches);
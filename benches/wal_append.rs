@@ -0,0 +1,68 @@
+use criterion::{criterion_group, criterion_main, BenchmarkId, Criterion, Throughput};
+use std::ffi::{c_void, CString};
+use std::os::raw::c_char;
+
+const WAL_INSERT: u16 = 1;
+const MAX_PAYLOAD: usize = 4096;
+
+#[repr(C)]
+struct WalRecord {
+    lsn: u64,
+    transaction_id: u32,
+    logical_time: u64,
+    entry_type: u16,
+    length: u16,
+    crc: u32,
+    data: [u8; MAX_PAYLOAD],
+}
+
+extern "C" {
+    fn storage_init(data_dir: *const c_char) -> *mut c_void;
+    fn storage_shutdown(handle: *mut c_void);
+    fn storage_wal_append(handle: *mut c_void, entry: *const WalRecord) -> u64;
+    fn storage_crc32c(crc: u32, data: *const u8, len: usize) -> u32;
+}
+
+const PAYLOAD_SIZES: [usize; 3] = [64, 256, 4096];
+
+fn bench_crc32c(c: &mut Criterion) {
+    let mut group = c.benchmark_group("crc32c");
+    let data = vec![0xa5u8; MAX_PAYLOAD];
+    for &size in &PAYLOAD_SIZES {
+        group.throughput(Throughput::Bytes(size as u64));
+        group.bench_with_input(BenchmarkId::from_parameter(size), &size, |b, &size| {
+            b.iter(|| unsafe { storage_crc32c(0, data.as_ptr(), size) })
+        });
+    }
+    group.finish();
+}
+
+fn bench_wal_append(c: &mut Criterion) {
+    let dir = tempfile::tempdir().unwrap();
+    let path = CString::new(dir.path().to_str().unwrap()).unwrap();
+    let handle = unsafe { storage_init(path.as_ptr()) };
+    assert!(!handle.is_null());
+
+    let mut group = c.benchmark_group("wal_append");
+    for &size in &PAYLOAD_SIZES {
+        let record = WalRecord {
+            lsn: 0,
+            transaction_id: 1,
+            logical_time: 0,
+            entry_type: WAL_INSERT,
+            length: size as u16,
+            crc: 0,
+            data: [0x5a; MAX_PAYLOAD],
+        };
+        group.throughput(Throughput::Bytes(size as u64));
+        group.bench_with_input(BenchmarkId::from_parameter(size), &record, |b, record| {
+            b.iter(|| unsafe { storage_wal_append(handle, record) })
+        });
+    }
+    group.finish();
+
+    unsafe { storage_shutdown(handle) };
+}
+
+criterion_group!(benches, bench_crc32c, bench_wal_append);
+criterion_main!(benches);
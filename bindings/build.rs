@@ -8,7 +8,15 @@ fn main() {
     cc::Build::new()
         .file(storage_dir.join("entry.c"))
         .file(storage_dir.join("wal/wal.c"))
+        .file(storage_dir.join("wal/crc32c.c"))
+        .file(storage_dir.join("wal/redo.c"))
+        .file(storage_dir.join("wal/control.c"))
+        .file(storage_dir.join("compression/lz.c"))
         .file(storage_dir.join("pages/page_manager.c"))
+        .file(storage_dir.join("pages/page_io.c"))
+        .file(storage_dir.join("pages/fsm.c"))
+        .file(storage_dir.join("pages/checksum.c"))
+        .file(storage_dir.join("heap/heap.c"))
         .file(storage_dir.join("buffer/buffer_pool.c"))
         .file(storage_dir.join("memory/arena.c"))
         .include(storage_dir.join("include"))
@@ -6,7 +6,15 @@ fn main() {
         .file("storage/entry.c")
         .file("storage/buffer/buffer_pool.c")
         .file("storage/pages/page_manager.c")
+        .file("storage/pages/page_io.c")
+        .file("storage/pages/fsm.c")
+        .file("storage/pages/checksum.c")
+        .file("storage/heap/heap.c")
         .file("storage/wal/wal.c")
+        .file("storage/wal/crc32c.c")
+        .file("storage/wal/redo.c")
+        .file("storage/wal/control.c")
+        .file("storage/compression/lz.c")
         .file("storage/memory/arena.c")
         .warnings(false)
         .flag_if_supported("-g")
@@ -16,7 +24,15 @@ fn main() {
     println!("cargo:rerun-if-changed=storage/entry.c");
     println!("cargo:rerun-if-changed=storage/buffer/buffer_pool.c");
     println!("cargo:rerun-if-changed=storage/pages/page_manager.c");
+    println!("cargo:rerun-if-changed=storage/pages/page_io.c");
+    println!("cargo:rerun-if-changed=storage/pages/fsm.c");
+    println!("cargo:rerun-if-changed=storage/pages/checksum.c");
+    println!("cargo:rerun-if-changed=storage/heap/heap.c");
     println!("cargo:rerun-if-changed=storage/wal/wal.c");
+    println!("cargo:rerun-if-changed=storage/wal/crc32c.c");
+    println!("cargo:rerun-if-changed=storage/wal/redo.c");
+    println!("cargo:rerun-if-changed=storage/wal/control.c");
+    println!("cargo:rerun-if-changed=storage/compression/lz.c");
     println!("cargo:rerun-if-changed=storage/memory/arena.c");
     println!("cargo:rerun-if-changed=storage/include/minsql_storage.h");
 
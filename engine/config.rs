@@ -1,3 +1,4 @@
+use crate::ffi::storage::{ReplacementPolicy, StorageOptions};
 use anyhow::{Context, Result};
 use serde::{Deserialize, Serialize};
 use std::env;
@@ -10,7 +11,18 @@ pub struct Config {
     pub port: u16,
     pub peers: Vec<String>,
     pub buffer_pool_size: usize,
+    pub buffer_pool_bytes: usize,
+    pub buffer_pool_partitions: usize,
+    pub replacement_policy: ReplacementPolicy,
+    pub huge_pages: bool,
+    pub arena_size: usize,
+    pub io_queue_depth: usize,
+    pub direct_io: bool,
     pub wal_buffer_size: usize,
+    pub wal_writer_delay_ms: usize,
+    pub recovery_workers: usize,
+    pub wal_compression_threshold: usize,
+    pub page_compression: bool,
     pub deterministic: bool,
     pub num_shards: usize,
 }
@@ -23,6 +35,20 @@ impl Config {
         let mut data_dir = "./data".to_string();
         let mut port = 5433;
         let mut peers = Vec::new();
+        let defaults = StorageOptions::default();
+        let mut buffer_pool_size = defaults.buffer_pool_frames;
+        let mut buffer_pool_bytes = 0;
+        let mut buffer_pool_partitions = defaults.buffer_pool_partitions;
+        let mut replacement_policy = defaults.replacement_policy;
+        let mut huge_pages = defaults.huge_pages;
+        let mut arena_size = defaults.arena_bytes;
+        let mut io_queue_depth = defaults.io_queue_depth;
+        let mut direct_io = defaults.direct_io;
+        let mut wal_buffer_size = defaults.wal_buffer_bytes;
+        let mut wal_writer_delay_ms = defaults.wal_writer_interval_ms;
+        let mut recovery_workers = defaults.recovery_workers;
+        let mut wal_compression_threshold = defaults.wal_compression_threshold;
+        let mut page_compression = defaults.page_compression;
 
         let mut i = 1;
         while i < args.len() {
@@ -43,6 +69,64 @@ impl Config {
                     peers = args[i + 1].split(',').map(|s| s.to_string()).collect();
                     i += 2;
                 }
+                "--buffer-pool-size" => {
+                    buffer_pool_size = args[i + 1].parse().context("Invalid buffer-pool-size")?;
+                    i += 2;
+                }
+                "--buffer-pool-bytes" => {
+                    buffer_pool_bytes =
+                        parse_size(&args[i + 1]).context("Invalid buffer-pool-bytes")?;
+                    i += 2;
+                }
+                "--buffer-pool-partitions" => {
+                    buffer_pool_partitions = args[i + 1]
+                        .parse()
+                        .context("Invalid buffer-pool-partitions")?;
+                    i += 2;
+                }
+                "--replacement-policy" => {
+                    replacement_policy = args[i + 1].parse()?;
+                    i += 2;
+                }
+                "--huge-pages" => {
+                    huge_pages = true;
+                    i += 1;
+                }
+                "--arena-size" => {
+                    arena_size = parse_size(&args[i + 1]).context("Invalid arena-size")?;
+                    i += 2;
+                }
+                "--io-queue-depth" => {
+                    io_queue_depth = args[i + 1].parse().context("Invalid io-queue-depth")?;
+                    i += 2;
+                }
+                "--direct-io" => {
+                    direct_io = true;
+                    i += 1;
+                }
+                "--wal-buffer-size" => {
+                    wal_buffer_size =
+                        parse_size(&args[i + 1]).context("Invalid wal-buffer-size")?;
+                    i += 2;
+                }
+                "--wal-writer-delay" => {
+                    wal_writer_delay_ms =
+                        args[i + 1].parse().context("Invalid wal-writer-delay")?;
+                    i += 2;
+                }
+                "--recovery-workers" => {
+                    recovery_workers = args[i + 1].parse().context("Invalid recovery-workers")?;
+                    i += 2;
+                }
+                "--wal-compression-threshold" => {
+                    wal_compression_threshold = parse_size(&args[i + 1])
+                        .context("Invalid wal-compression-threshold")?;
+                    i += 2;
+                }
+                "--page-compression" => {
+                    page_compression = true;
+                    i += 1;
+                }
                 _ => {
                     i += 1;
                 }
@@ -54,8 +138,19 @@ impl Config {
             data_dir,
             port,
             peers,
-            buffer_pool_size: 1024,
-            wal_buffer_size: 65536,
+            buffer_pool_size,
+            buffer_pool_bytes,
+            buffer_pool_partitions,
+            replacement_policy,
+            huge_pages,
+            arena_size,
+            io_queue_depth,
+            direct_io,
+            wal_buffer_size,
+            wal_writer_delay_ms,
+            recovery_workers,
+            wal_compression_threshold,
+            page_compression,
             deterministic: false,
             num_shards: 16,
         })
@@ -64,4 +159,44 @@ impl Config {
     pub fn data_path(&self) -> PathBuf {
         PathBuf::from(&self.data_dir)
     }
+
+    pub fn storage_options(&self) -> StorageOptions {
+        StorageOptions {
+            buffer_pool_bytes: self.buffer_pool_bytes,
+            buffer_pool_frames: self.buffer_pool_size,
+            buffer_pool_partitions: self.buffer_pool_partitions,
+            replacement_policy: self.replacement_policy,
+            huge_pages: self.huge_pages,
+            arena_bytes: self.arena_size,
+            io_queue_depth: self.io_queue_depth,
+            direct_io: self.direct_io,
+            wal_buffer_bytes: self.wal_buffer_size,
+            wal_writer_interval_ms: self.wal_writer_delay_ms,
+            recovery_workers: self.recovery_workers,
+            wal_compression_threshold: self.wal_compression_threshold,
+            page_compression: self.page_compression,
+        }
+    }
+}
+
+// Accepts plain byte counts or a K/M/G suffix, e.g. "512M" or "64GiB".
+fn parse_size(value: &str) -> Result<usize> {
+    let value = value.trim();
+    let split = value
+        .find(|c: char| !c.is_ascii_digit())
+        .unwrap_or(value.len());
+    let (digits, suffix) = value.split_at(split);
+    let number: usize = digits.parse()?;
+
+    let multiplier = match suffix.to_ascii_uppercase().as_str() {
+        "" | "B" => 1,
+        "K" | "KB" | "KIB" => 1 << 10,
+        "M" | "MB" | "MIB" => 1 << 20,
+        "G" | "GB" | "GIB" => 1 << 30,
+        _ => anyhow::bail!("Unknown size suffix '{}'", suffix),
+    };
+
+    number
+        .checked_mul(multiplier)
+        .context("Size does not fit in usize")
 }
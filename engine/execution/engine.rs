@@ -104,9 +104,8 @@ impl<'a> ExecutionEngine<'a> {
                 } => {
                     tracing::info!("INSERT into {} with {} rows", table, values.len());
 
-                    self.storage.wal_flush()?;
-
-                    let mut inserted_count = 0;
+                    let mut tuples = Vec::with_capacity(values.len());
+                    let mut rows = Vec::with_capacity(values.len());
                     for row in &values {
                         let mut tuple = Tuple::new();
                         for (i, col_name) in columns.iter().enumerate() {
@@ -131,14 +130,16 @@ impl<'a> ExecutionEngine<'a> {
                                 tuple.insert(col_name.clone(), val);
                             }
                         }
-                        inserted_count += 1;
-                        let tuple_json = serde_json::to_string(&tuple)?;
-                        let tuple_bytes = tuple_json.as_bytes();
-                        let row_id = self.storage.insert_row(&table, tuple_bytes)?;
+                        rows.push(serde_json::to_vec(&tuple)?);
+                        tuples.push(tuple);
+                    }
 
+                    let row_ids = self.storage.insert_rows(&table, &rows)?;
+                    let inserted_count = row_ids.len();
+                    for (i, (row_id, tuple)) in row_ids.iter().zip(&tuples).enumerate() {
                         tracing::debug!(
                             "Inserted row {} (rowid={}) into {}: {:?}",
-                            inserted_count,
+                            i + 1,
                             row_id,
                             table,
                             tuple
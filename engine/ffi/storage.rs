@@ -1,4 +1,5 @@
 use anyhow::Result;
+use serde::{Deserialize, Serialize};
 use std::ffi::CString;
 use std::os::raw::c_char;
 
@@ -7,10 +8,85 @@ pub struct StorageHandle {
     ptr: *mut std::ffi::c_void,
 }
 
+// Layouts below must match storage/include/minsql_storage.h.
+#[repr(C)]
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Serialize, Deserialize)]
+pub enum ReplacementPolicy {
+    Clock = 0,
+    TwoQ = 1,
+}
+
+impl std::str::FromStr for ReplacementPolicy {
+    type Err = anyhow::Error;
+
+    fn from_str(s: &str) -> Result<Self> {
+        match s.to_ascii_lowercase().as_str() {
+            "clock" => Ok(ReplacementPolicy::Clock),
+            "2q" | "twoq" => Ok(ReplacementPolicy::TwoQ),
+            _ => anyhow::bail!("Unknown replacement policy '{}'", s),
+        }
+    }
+}
+
+#[repr(C)]
+#[derive(Debug, Clone, Copy)]
+pub struct StorageOptions {
+    pub buffer_pool_bytes: usize,
+    pub buffer_pool_frames: usize,
+    pub buffer_pool_partitions: usize,
+    pub replacement_policy: ReplacementPolicy,
+    pub huge_pages: bool,
+    pub arena_bytes: usize,
+    pub io_queue_depth: usize,
+    pub direct_io: bool,
+    pub wal_buffer_bytes: usize,
+    pub wal_writer_interval_ms: usize,
+    pub recovery_workers: usize,
+    pub wal_compression_threshold: usize,
+    pub page_compression: bool,
+}
+
+#[repr(C)]
+#[derive(Debug, Clone, Copy, Default, Serialize)]
+pub struct StorageMetrics {
+    pub buffer_hits: u64,
+    pub buffer_misses: u64,
+    pub prefetch_issued: u64,
+    pub prefetch_hits: u64,
+    pub prefetch_unused: u64,
+    pub wal_compressed_records: u64,
+    pub wal_compress_input_bytes: u64,
+    pub wal_compress_output_bytes: u64,
+    pub wal_compress_ns: u64,
+    pub wal_decompress_ns: u64,
+    pub page_compressed_writes: u64,
+    pub page_compress_input_bytes: u64,
+    pub page_compress_output_bytes: u64,
+    pub page_compress_ns: u64,
+    pub page_decompress_ns: u64,
+}
+
+impl Default for StorageOptions {
+    fn default() -> Self {
+        let mut options = std::mem::MaybeUninit::<StorageOptions>::uninit();
+        unsafe {
+            storage_default_options(options.as_mut_ptr());
+            options.assume_init()
+        }
+    }
+}
+
 extern "C" {
-    fn storage_init(data_dir: *const c_char) -> *mut std::ffi::c_void;
+    fn storage_default_options(options: *mut StorageOptions);
+    fn storage_init_ex(
+        data_dir: *const c_char,
+        options: *const StorageOptions,
+    ) -> *mut std::ffi::c_void;
     fn storage_shutdown(handle: *mut std::ffi::c_void);
     fn storage_checkpoint(handle: *mut std::ffi::c_void) -> i32;
+    fn storage_prefetch_pages(handle: *mut std::ffi::c_void, first_page: u32, count: usize)
+        -> usize;
+    fn storage_get_metrics(handle: *mut std::ffi::c_void, metrics: *mut StorageMetrics);
     fn storage_recover(handle: *mut std::ffi::c_void) -> i32;
     fn storage_wal_flush(handle: *mut std::ffi::c_void) -> i32;
     fn storage_create_table(
@@ -25,6 +101,14 @@ extern "C" {
         data_len: usize,
         row_id_out: *mut u64,
     ) -> i32;
+    fn storage_insert_rows_batch(
+        handle: *mut std::ffi::c_void,
+        table_name: *const c_char,
+        data: *const u8,
+        row_lens: *const usize,
+        count: usize,
+        row_ids_out: *mut u64,
+    ) -> i32;
     fn storage_update_rows(
         handle: *mut std::ffi::c_void,
         table_name: *const c_char,
@@ -50,8 +134,12 @@ unsafe impl Sync for StorageEngine {}
 
 impl StorageEngine {
     pub fn new(data_dir: &str) -> Result<Self> {
+        Self::with_options(data_dir, &StorageOptions::default())
+    }
+
+    pub fn with_options(data_dir: &str, options: &StorageOptions) -> Result<Self> {
         let c_dir = CString::new(data_dir)?;
-        let handle = unsafe { storage_init(c_dir.as_ptr()) };
+        let handle = unsafe { storage_init_ex(c_dir.as_ptr(), options) };
 
         if handle.is_null() {
             anyhow::bail!("Failed to initialize storage engine");
@@ -68,6 +156,16 @@ impl StorageEngine {
         Ok(())
     }
 
+    pub fn prefetch_pages(&self, first_page: u32, count: usize) -> usize {
+        unsafe { storage_prefetch_pages(self.handle, first_page, count) }
+    }
+
+    pub fn metrics(&self) -> StorageMetrics {
+        let mut metrics = StorageMetrics::default();
+        unsafe { storage_get_metrics(self.handle, &mut metrics) };
+        metrics
+    }
+
     pub fn recover(&self) -> Result<()> {
         let result = unsafe { storage_recover(self.handle) };
         if result != 0 {
@@ -140,8 +238,6 @@ impl StorageEngine {
                 result
             );
         }
-        self.wal_flush()?;
-
         tracing::debug!(
             "Successfully inserted row with ID {} into '{}'",
             row_id,
@@ -150,6 +246,36 @@ impl StorageEngine {
         Ok(row_id)
     }
 
+    pub fn insert_rows(&self, table_name: &str, rows: &[Vec<u8>]) -> Result<Vec<u64>> {
+        tracing::debug!("Inserting {} rows into table '{}'", rows.len(), table_name);
+
+        let c_table_name = CString::new(table_name)?;
+        let data: Vec<u8> = rows.concat();
+        let row_lens: Vec<usize> = rows.iter().map(|row| row.len()).collect();
+        let mut row_ids = vec![0u64; rows.len()];
+
+        let result = unsafe {
+            storage_insert_rows_batch(
+                self.handle,
+                c_table_name.as_ptr(),
+                data.as_ptr(),
+                row_lens.as_ptr(),
+                rows.len(),
+                row_ids.as_mut_ptr(),
+            )
+        };
+
+        if result != 0 {
+            anyhow::bail!(
+                "Failed to insert {} rows into '{}': error code {}",
+                rows.len(),
+                table_name,
+                result
+            );
+        }
+        Ok(row_ids)
+    }
+
     pub fn update_rows(&self, table_name: &str, predicate: &str, data: &[u8]) -> Result<usize> {
         tracing::debug!(
             "Updating rows in table '{}' matching: {}",
@@ -179,8 +305,6 @@ impl StorageEngine {
                 result
             );
         }
-        self.wal_flush()?;
-
         tracing::info!("Successfully updated {} rows in '{}'", count, table_name);
         Ok(count)
     }
@@ -213,8 +337,6 @@ impl StorageEngine {
             );
         }
 
-        self.wal_flush()?;
-
         tracing::info!("Successfully deleted {} rows from '{}'", count, table_name);
         Ok(count)
     }
@@ -17,7 +17,10 @@ pub struct Lifecycle {
 
 impl Lifecycle {
     pub async fn new(config: Config) -> Result<Self> {
-        let storage = Arc::new(StorageEngine::new(&config.data_dir)?);
+        let storage = Arc::new(StorageEngine::with_options(
+            &config.data_dir,
+            &config.storage_options(),
+        )?);
 
         storage.recover()?;
 
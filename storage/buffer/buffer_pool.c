@@ -4,43 +4,383 @@
 #include <stdlib.h>
 #include <string.h>
 
+extern StorageResult page_manager_read(PageManager* pm, uint32_t page_id, Page* page);
+extern StorageResult page_manager_write(PageManager* pm, Page* page);
+extern StorageResult page_manager_write_batch(PageManager* pm, Page** pages, size_t count);
+extern StorageResult page_manager_sync(PageManager* pm);
+
+typedef void (*PageLatchFn)(void* ctx, Page* page);
+extern void page_manager_attach_latch(PageManager* pm, PageLatchFn latch, PageLatchFn unlatch,
+                                      void* ctx);
+
+typedef void (*PageIOCallback)(void* ctx, Page* page, StorageResult result);
+extern StorageResult page_manager_read_async(PageManager* pm, uint32_t page_id, Page* frame,
+                                             PageIOCallback callback, void* ctx);
+extern void page_manager_poll(PageManager* pm);
+extern uint32_t page_manager_num_pages(PageManager* pm);
+
+extern uint64_t wal_flushed_lsn(WAL* wal);
+extern StorageResult wal_flush_to(WAL* wal, uint64_t lsn);
+
+extern Arena* arena_create_ex(size_t capacity, bool huge_pages);
+extern void arena_destroy(Arena* arena);
+extern void* arena_alloc_aligned(Arena* arena, size_t size, size_t alignment);
+
 #define DEFAULT_BUFFER_POOL_SIZE 1024
+#define DEFAULT_BUFFER_POOL_PARTITIONS 16
+#define MIN_PARTITION_FRAMES 32
+#define PAGE_TABLE_EMPTY UINT32_MAX
+#define REC_LSN_CLEAN UINT64_MAX
+
+/* Sequential read-ahead: after READAHEAD_TRIGGER consecutive first
+ * touches the pool starts reading ahead of the cursor, doubling the
+ * window from READAHEAD_MIN up to READAHEAD_MAX pages (or an eighth of
+ * the pool, whichever is smaller). Up to READAHEAD_STREAMS scans are
+ * followed at once. */
+#define READAHEAD_TRIGGER 4
+#define READAHEAD_MIN 8
+#define READAHEAD_MAX 128
+#define READAHEAD_STREAMS 8
+
+/* 2Q tuning from Johnson & Shasha: the probationary FIFO holds a quarter
+ * of the frames and the ghost queue remembers half a pool's worth of
+ * page ids evicted from probation. */
+#define TWOQ_A1IN_DIVISOR 4
+#define TWOQ_A1OUT_DIVISOR 2
+
+typedef enum {
+    QUEUE_NONE = 0,
+    QUEUE_A1IN = 1,
+    QUEUE_AM = 2
+} BufferQueue;
+
+/* A frame is LOADING while its read runs outside the partition latch.
+ * The page table already maps page_id to it, so concurrent requests for
+ * the same page wait for the read instead of issuing their own. */
+typedef enum {
+    FRAME_FREE = 0,
+    FRAME_LOADING = 1,
+    FRAME_VALID = 2
+} FrameState;
 
 typedef struct BufferEntry {
     Page* page;
     uint32_t page_id;
-    uint64_t last_access;
-    bool valid;
+    uint8_t referenced;
+    uint8_t queue;
+    uint8_t state;
+    uint8_t prefetched;     /* loaded ahead of use and not yet requested */
+    /* Writes of the page under way, counted under the partition latch.
+     * A write marks the page clean before it is issued; until it ends,
+     * the page stays in the dirty page table. */
+    uint8_t writing;
+    /* recLSN: WAL insert position when the page was first dirtied since
+     * it was last written, or REC_LSN_CLEAN. Every record that the page
+     * does not yet reflect on disk starts at or after it. */
+    volatile uint64_t rec_lsn;
+    /* Content latch: held by whoever changes the page's bytes, and by a
+     * write while it copies them, so no write sees half a change. The
+     * pin keeps the frame; this keeps the bytes consistent. */
+    pthread_mutex_t content;
+    /* Held from copying the page until its write, and any hole punched
+     * after it, is done, so two writes of one page never overlap and a
+     * punch cannot cut into a newer image. Flushes and eviction take
+     * it. */
+    pthread_mutex_t write;
 } BufferEntry;
 
-struct BufferPool {
+/* Open-addressed page_id -> value map, sized to twice its population so
+ * probe sequences stay short. Deletion uses backward shifting, so there
+ * are no tombstones to sweep. */
+typedef struct PageTableSlot {
+    uint32_t page_id;
+    uint32_t value;
+} PageTableSlot;
+
+typedef struct PageTable {
+    PageTableSlot* slots;
+    size_t mask;
+} PageTable;
+
+/* Ring of frame ids (the 2Q A1in FIFO) or page ids (the A1out ghosts). */
+typedef struct IdRing {
+    uint32_t* ids;
+    size_t capacity;
+    size_t head;
+    size_t count;
+} IdRing;
+
+/* One independently latched slice of the pool. Pages hash to a partition
+ * by page_id; frames are numbered locally within the partition and
+ * offset by base to form the frame_id recorded on the Page. */
+typedef struct BufferPartition {
+    pthread_mutex_t lock;
     BufferEntry* entries;
+    size_t base;
     size_t capacity;
     size_t num_entries;
+    PageTable page_table;
+
+    uint32_t* free_frames;
+    size_t num_free;
+    size_t clock_hand;
+
+    IdRing a1in;
+    IdRing a1out;
+    PageTable ghosts;
+
+    /* Counters, updated under the latch and summed by buffer_pool_stats. */
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t prefetch_issued;
+    uint64_t prefetch_hits;
+    uint64_t prefetch_unused;
+
+    /* Keep neighbouring partition latches off each other's cache line. */
+    uint8_t padding[64];
+} BufferPartition;
+
+/* One sequential stream of first touches (misses and first uses of
+ * prefetched pages). expect is the page that continues the run, next the
+ * first page not yet requested. A run of 0 marks an unused slot. */
+typedef struct ReadAheadStream {
+    uint32_t expect;
+    uint32_t run;
+    uint32_t next;
+    uint32_t window;
+    uint64_t used;
+} ReadAheadStream;
+
+/* The streams seen most recently, found by the page each expects next,
+ * so interleaved scans each keep their own run. The lock covers only
+ * the lookup and bookkeeping; reads are issued after it is dropped. */
+typedef struct ReadAhead {
     pthread_mutex_t lock;
-    uint64_t access_counter;
+    ReadAheadStream streams[READAHEAD_STREAMS];
+    uint64_t clock;
+} ReadAhead;
+
+/* Frames live in one page-aligned region reserved up front, so a miss
+ * reads directly into its frame and eviction frees nothing. */
+struct BufferPool {
+    Arena* frame_arena;
+    Page* frames;
+    BufferEntry* entries;
+    BufferPartition* partitions;
+    size_t num_partitions;
+    size_t capacity;
+    BufferReplacementPolicy policy;
+    WAL* wal;
+    ReadAhead readahead;
+    uint32_t readahead_max;
 };
 
-BufferPool* buffer_pool_create(size_t capacity) {
-    BufferPool* pool = malloc(sizeof(BufferPool));
+static bool page_table_init(PageTable* table, size_t population) {
+    size_t size = 16;
+    while (size < population * 2) {
+        size <<= 1;
+    }
+
+    table->slots = malloc(sizeof(PageTableSlot) * size);
+    if (!table->slots) return false;
+
+    for (size_t i = 0; i < size; i++) {
+        table->slots[i].value = PAGE_TABLE_EMPTY;
+    }
+    table->mask = size - 1;
+    return true;
+}
+
+static inline size_t page_table_hash(const PageTable* table, uint32_t page_id) {
+    return ((uint64_t)page_id * 0x9E3779B97F4A7C15ULL >> 32) & table->mask;
+}
+
+static int page_table_lookup(const PageTable* table, uint32_t page_id) {
+    size_t idx = page_table_hash(table, page_id);
+
+    while (table->slots[idx].value != PAGE_TABLE_EMPTY) {
+        if (table->slots[idx].page_id == page_id) {
+            return table->slots[idx].value;
+        }
+        idx = (idx + 1) & table->mask;
+    }
+    return -1;
+}
+
+static void page_table_insert(PageTable* table, uint32_t page_id, uint32_t value) {
+    size_t idx = page_table_hash(table, page_id);
+
+    while (table->slots[idx].value != PAGE_TABLE_EMPTY) {
+        idx = (idx + 1) & table->mask;
+    }
+    table->slots[idx].page_id = page_id;
+    table->slots[idx].value = value;
+}
+
+static void page_table_remove(PageTable* table, uint32_t page_id) {
+    size_t mask = table->mask;
+    size_t idx = page_table_hash(table, page_id);
+
+    while (table->slots[idx].value != PAGE_TABLE_EMPTY) {
+        if (table->slots[idx].page_id == page_id) {
+            break;
+        }
+        idx = (idx + 1) & mask;
+    }
+    if (table->slots[idx].value == PAGE_TABLE_EMPTY) {
+        return;
+    }
+
+    /* Shift later members of the probe run back into the hole so lookups
+     * never stop early at an empty slot. */
+    size_t hole = idx;
+    size_t next = (idx + 1) & mask;
+    while (table->slots[next].value != PAGE_TABLE_EMPTY) {
+        size_t home = page_table_hash(table, table->slots[next].page_id);
+        if (((next - home) & mask) >= ((next - hole) & mask)) {
+            table->slots[hole] = table->slots[next];
+            hole = next;
+        }
+        next = (next + 1) & mask;
+    }
+    table->slots[hole].value = PAGE_TABLE_EMPTY;
+}
+
+static bool id_ring_init(IdRing* ring, size_t capacity) {
+    ring->ids = malloc(sizeof(uint32_t) * (capacity ? capacity : 1));
+    ring->capacity = capacity ? capacity : 1;
+    ring->head = 0;
+    ring->count = 0;
+    return ring->ids != NULL;
+}
+
+static void id_ring_push(IdRing* ring, uint32_t id) {
+    ring->ids[(ring->head + ring->count) % ring->capacity] = id;
+    ring->count++;
+}
+
+static uint32_t id_ring_pop(IdRing* ring) {
+    uint32_t id = ring->ids[ring->head];
+    ring->head = (ring->head + 1) % ring->capacity;
+    ring->count--;
+    return id;
+}
+
+static bool buffer_partition_init(BufferPartition* part, BufferEntry* entries,
+                                  size_t base, size_t capacity,
+                                  BufferReplacementPolicy policy) {
+    part->entries = entries + base;
+    part->base = base;
+    part->capacity = capacity;
+    part->num_entries = 0;
+    part->num_free = capacity;
+    part->clock_hand = 0;
+
+    part->free_frames = malloc(sizeof(uint32_t) * capacity);
+    if (!part->free_frames || !page_table_init(&part->page_table, capacity)) {
+        return false;
+    }
+
+    if (policy == BUFFER_POLICY_2Q) {
+        size_t ghosts = capacity / TWOQ_A1OUT_DIVISOR;
+        if (!id_ring_init(&part->a1in, capacity) ||
+            !id_ring_init(&part->a1out, ghosts) ||
+            !page_table_init(&part->ghosts, ghosts)) {
+            return false;
+        }
+    }
+
+    /* Hand out low frame numbers first. */
+    for (size_t i = 0; i < capacity; i++) {
+        part->free_frames[i] = capacity - 1 - i;
+    }
+
+    pthread_mutex_init(&part->lock, NULL);
+    return true;
+}
+
+static void buffer_partition_release(BufferPartition* part) {
+    free(part->ghosts.slots);
+    free(part->a1out.ids);
+    free(part->a1in.ids);
+    free(part->page_table.slots);
+    free(part->free_frames);
+}
+
+BufferPool* buffer_pool_create(size_t capacity, BufferReplacementPolicy policy,
+                               size_t num_partitions, bool huge_pages) {
+    if (capacity == 0) {
+        capacity = DEFAULT_BUFFER_POOL_SIZE;
+    }
+    if (num_partitions == 0) {
+        num_partitions = DEFAULT_BUFFER_POOL_PARTITIONS;
+    }
+    /* Tiny partitions make CLOCK and 2Q degenerate; shrink the fan-out
+     * rather than the partitions. */
+    while (num_partitions > 1 && capacity / num_partitions < MIN_PARTITION_FRAMES) {
+        num_partitions /= 2;
+    }
+
+    BufferPool* pool = calloc(1, sizeof(BufferPool));
     if (!pool) return NULL;
 
-    pool->entries = malloc(sizeof(BufferEntry) * capacity);
-    if (!pool->entries) {
+    pool->frame_arena = arena_create_ex(capacity * PAGE_SIZE + PAGE_SIZE, huge_pages);
+    if (!pool->frame_arena) {
+        free(pool);
+        return NULL;
+    }
+    pool->frames = arena_alloc_aligned(pool->frame_arena, capacity * PAGE_SIZE, PAGE_SIZE);
+
+    pool->entries = calloc(capacity, sizeof(BufferEntry));
+    pool->partitions = calloc(num_partitions, sizeof(BufferPartition));
+    if (!pool->frames || !pool->entries || !pool->partitions) {
+        free(pool->partitions);
+        free(pool->entries);
+        arena_destroy(pool->frame_arena);
         free(pool);
         return NULL;
     }
 
     for (size_t i = 0; i < capacity; i++) {
-        pool->entries[i].page = NULL;
-        pool->entries[i].valid = false;
-        pool->entries[i].last_access = 0;
+        pool->entries[i].page = &pool->frames[i];
+        pool->entries[i].rec_lsn = REC_LSN_CLEAN;
+        pthread_mutex_init(&pool->entries[i].content, NULL);
+        pthread_mutex_init(&pool->entries[i].write, NULL);
     }
 
     pool->capacity = capacity;
-    pool->num_entries = 0;
-    pool->access_counter = 0;
-    pthread_mutex_init(&pool->lock, NULL);
+    pool->policy = policy;
+    pool->num_partitions = num_partitions;
+
+    pthread_mutex_init(&pool->readahead.lock, NULL);
+    pool->readahead_max = capacity / 8 < READAHEAD_MAX ? (uint32_t)(capacity / 8) : READAHEAD_MAX;
+
+    size_t base = 0;
+    for (size_t i = 0; i < num_partitions; i++) {
+        size_t part_capacity = capacity / num_partitions +
+                               (i < capacity % num_partitions ? 1 : 0);
+
+        if (!buffer_partition_init(&pool->partitions[i], pool->entries,
+                                   base, part_capacity, policy)) {
+            for (size_t j = 0; j <= i; j++) {
+                buffer_partition_release(&pool->partitions[j]);
+                if (j < i) {
+                    pthread_mutex_destroy(&pool->partitions[j].lock);
+                }
+            }
+            pthread_mutex_destroy(&pool->readahead.lock);
+            for (size_t j = 0; j < capacity; j++) {
+                pthread_mutex_destroy(&pool->entries[j].content);
+                pthread_mutex_destroy(&pool->entries[j].write);
+            }
+            free(pool->partitions);
+            free(pool->entries);
+            arena_destroy(pool->frame_arena);
+            free(pool);
+            return NULL;
+        }
+        base += part_capacity;
+    }
 
     return pool;
 }
@@ -48,139 +388,693 @@ BufferPool* buffer_pool_create(size_t capacity) {
 void buffer_pool_destroy(BufferPool* pool) {
     if (!pool) return;
 
+    for (size_t i = 0; i < pool->num_partitions; i++) {
+        buffer_partition_release(&pool->partitions[i]);
+        pthread_mutex_destroy(&pool->partitions[i].lock);
+    }
+    pthread_mutex_destroy(&pool->readahead.lock);
     for (size_t i = 0; i < pool->capacity; i++) {
-        if (pool->entries[i].valid && pool->entries[i].page) {
-            free(pool->entries[i].page);
-        }
+        pthread_mutex_destroy(&pool->entries[i].content);
+        pthread_mutex_destroy(&pool->entries[i].write);
     }
 
+    free(pool->partitions);
     free(pool->entries);
-    pthread_mutex_destroy(&pool->lock);
+    arena_destroy(pool->frame_arena);
     free(pool);
 }
 
-static int buffer_pool_find_slot(BufferPool* pool, uint32_t page_id) {
-    for (size_t i = 0; i < pool->capacity; i++) {
-        if (pool->entries[i].valid && pool->entries[i].page_id == page_id) {
-            return i;
+/* Page write-back consults the WAL so a page never reaches disk ahead of
+ * the log records that describe it. */
+void buffer_pool_attach_wal(BufferPool* pool, WAL* wal) {
+    pool->wal = wal;
+}
+
+/* The entry owning page, or NULL if page is not one of the pool's frames. */
+static BufferEntry* buffer_pool_entry_of(BufferPool* pool, Page* page) {
+    if (page->frame_id >= pool->capacity || &pool->frames[page->frame_id] != page) {
+        return NULL;
+    }
+    return &pool->entries[page->frame_id];
+}
+
+/* Ends a write of entry's page, forgetting its recLSN if the write
+ * succeeded and nothing changed the page since. Called with the
+ * partition latch held. */
+static void buffer_entry_end_write(BufferEntry* entry, bool written) {
+    entry->writing--;
+    if (written && !entry->page->dirty) {
+        atomic_store_u64(&entry->rec_lsn, REC_LSN_CLEAN);
+    }
+}
+
+/* A page's header.lsn is the end of the last record applied to it, so
+ * the log must be durable up to, not including, that point. */
+static StorageResult buffer_pool_wal_before_data(BufferPool* pool, uint64_t page_lsn) {
+    if (!pool->wal || page_lsn <= wal_flushed_lsn(pool->wal)) {
+        return STORAGE_OK;
+    }
+    return wal_flush_to(pool->wal, page_lsn - 1);
+}
+
+static inline BufferPartition* buffer_pool_partition(BufferPool* pool, uint32_t page_id) {
+    /* murmur3 finaliser: independent of the page table's multiplicative
+     * hash, and spreads consecutive page ids across partitions. */
+    uint32_t h = page_id;
+    h ^= h >> 16;
+    h *= 0x85EBCA6BU;
+    h ^= h >> 13;
+    h *= 0xC2B2AE35U;
+    h ^= h >> 16;
+    return &pool->partitions[h % pool->num_partitions];
+}
+
+static inline bool frame_evictable(BufferPartition* part, size_t frame) {
+    BufferEntry* entry = &part->entries[frame];
+    return entry->state == FRAME_VALID && atomic_load_u16(&entry->page->pin_count) == 0;
+}
+
+/* CLOCK: sweep the hand, giving referenced frames a second chance. Two
+ * full revolutions clear every reference bit, so if nothing turns up by
+ * then every frame (of the requested queue) is pinned. */
+static int clock_sweep(BufferPartition* part, uint8_t queue) {
+    for (size_t step = 0; step < part->capacity * 2; step++) {
+        size_t frame = part->clock_hand;
+        part->clock_hand = (part->clock_hand + 1) % part->capacity;
+
+        BufferEntry* entry = &part->entries[frame];
+        if (queue != QUEUE_NONE && entry->queue != queue) {
+            continue;
+        }
+        if (!frame_evictable(part, frame)) {
+            continue;
+        }
+        if (entry->referenced) {
+            entry->referenced = 0;
+            continue;
         }
+        return frame;
     }
     return -1;
 }
 
-static int buffer_pool_find_victim(BufferPool* pool) {
-    uint64_t min_access = UINT64_MAX;
-    int victim_idx = -1;
+/* Pop unpinned frames off the A1in FIFO, recycling pinned ones to the
+ * tail. Returns -1 after one full rotation without a candidate. */
+static int twoq_evict_a1in(BufferPartition* part) {
+    for (size_t tries = part->a1in.count; tries > 0; tries--) {
+        uint32_t frame = id_ring_pop(&part->a1in);
+        if (frame_evictable(part, frame)) {
+            return frame;
+        }
+        id_ring_push(&part->a1in, frame);
+    }
+    return -1;
+}
 
-    for (size_t i = 0; i < pool->capacity; i++) {
-        if (!pool->entries[i].valid) {
-            return i;
+static void twoq_remember_ghost(BufferPartition* part, uint32_t page_id) {
+    if (part->a1out.count == part->a1out.capacity) {
+        page_table_remove(&part->ghosts, id_ring_pop(&part->a1out));
+    }
+    id_ring_push(&part->a1out, page_id);
+    page_table_insert(&part->ghosts, page_id, 0);
+}
+
+static int buffer_partition_find_victim(BufferPartition* part, BufferReplacementPolicy policy) {
+    if (policy != BUFFER_POLICY_2Q) {
+        return clock_sweep(part, QUEUE_NONE);
+    }
+
+    /* Pages seen once drain out of A1in first, so a large scan cannot
+     * flush the hot set in Am. */
+    int victim = -1;
+    if (part->a1in.count > part->capacity / TWOQ_A1IN_DIVISOR) {
+        victim = twoq_evict_a1in(part);
+    }
+    if (victim < 0) {
+        victim = clock_sweep(part, QUEUE_AM);
+    }
+    if (victim < 0) {
+        victim = twoq_evict_a1in(part);
+    }
+    return victim;
+}
+
+static void buffer_partition_admit(BufferPartition* part, BufferReplacementPolicy policy,
+                                   uint32_t frame, uint32_t page_id) {
+    BufferEntry* entry = &part->entries[frame];
+
+    if (policy != BUFFER_POLICY_2Q) {
+        entry->queue = QUEUE_NONE;
+        entry->referenced = 1;
+        return;
+    }
+
+    /* A miss on a page recently evicted from probation means it is
+     * re-referenced beyond the correlation window: promote it to Am. */
+    if (page_table_lookup(&part->ghosts, page_id) >= 0) {
+        page_table_remove(&part->ghosts, page_id);
+        entry->queue = QUEUE_AM;
+        entry->referenced = 1;
+    } else {
+        entry->queue = QUEUE_A1IN;
+        entry->referenced = 0;
+        id_ring_push(&part->a1in, frame);
+    }
+}
+
+void buffer_pool_unpin_page(BufferPool* pool, Page* page);
+
+/* Writes back a dirty victim with the partition latch released, so
+ * lookups in the partition do not wait on the WAL flush or the write.
+ * The pin keeps the frame from being chosen again and the write lock
+ * keeps flushes of the page out; both are dropped before the latch is
+ * retaken. Dirty victims go to the OS without a sync; the next
+ * checkpoint's batch sync covers them. */
+static StorageResult buffer_partition_write_victim(BufferPool* pool, BufferPartition* part,
+                                                   PageManager* pm, BufferEntry* entry) {
+    Page* page = entry->page;
+    atomic_fetch_add_u16(&page->pin_count, 1);
+    entry->writing++;
+    pthread_mutex_unlock(&part->lock);
+
+    StorageResult result = buffer_pool_wal_before_data(pool, page->header.lsn);
+    if (result == STORAGE_OK) {
+        result = page_manager_write(pm, page);
+    }
+    pthread_mutex_unlock(&entry->write);
+
+    pthread_mutex_lock(&part->lock);
+    buffer_entry_end_write(entry, result == STORAGE_OK);
+    buffer_pool_unpin_page(pool, page);
+    return result;
+}
+
+/* Unmaps an unpinned, clean victim and returns its frame. Called with
+ * the partition latch held. */
+static int buffer_partition_evict(BufferPartition* part, int frame) {
+    BufferEntry* entry = &part->entries[frame];
+
+    if (entry->queue == QUEUE_A1IN) {
+        twoq_remember_ghost(part, entry->page_id);
+    }
+    atomic_store_u64(&entry->rec_lsn, REC_LSN_CLEAN);
+
+    if (entry->prefetched) {
+        entry->prefetched = 0;
+        part->prefetch_unused++;
+    }
+
+    page_table_remove(&part->page_table, entry->page_id);
+    entry->state = FRAME_FREE;
+    part->num_entries--;
+    return frame;
+}
+
+/* Finds a frame for a new page: a free one if available, otherwise a
+ * victim chosen by the replacement policy, written back first if dirty.
+ * Called with the partition latch held, but drops it while writing a
+ * victim back, so callers must look the page up again afterwards.
+ * Returns -1 if every frame is pinned or a write-back fails. A victim
+ * popped off A1in goes back on it unless it is evicted, and becomes a
+ * ghost only once it is. */
+static int buffer_partition_reserve_frame(BufferPool* pool, BufferPartition* part, PageManager* pm) {
+    for (;;) {
+        if (part->num_free > 0) {
+            return part->free_frames[--part->num_free];
+        }
+
+        int frame = buffer_partition_find_victim(part, pool->policy);
+        if (frame < 0) {
+            return -1;
+        }
+
+        BufferEntry* entry = &part->entries[frame];
+        if (!entry->page->dirty) {
+            return buffer_partition_evict(part, frame);
+        }
+
+        /* Flushes pin a page before taking its write lock, and the latch
+         * keeps new pins out, so an unpinned frame's lock is free. */
+        StorageResult result = STORAGE_ERROR;
+        if (pthread_mutex_trylock(&entry->write) == 0) {
+            result = buffer_partition_write_victim(pool, part, pm, entry);
         }
 
-        if (pool->entries[i].page->pin_count == 0 && 
-            pool->entries[i].last_access < min_access) {
-            min_access = pool->entries[i].last_access;
-            victim_idx = i;
+        /* While the latch was released the page may have been pinned or
+         * changed again; if so, leave it and pick another victim. */
+        bool evictable = result == STORAGE_OK && frame_evictable(part, frame) &&
+                         !entry->page->dirty;
+        if (evictable) {
+            return buffer_partition_evict(part, frame);
+        }
+        if (entry->queue == QUEUE_A1IN) {
+            id_ring_push(&part->a1in, frame);
+        }
+        if (result != STORAGE_OK) {
+            return -1;
         }
     }
+}
 
-    return victim_idx;
+/* Maps page_id to frame in the LOADING state so the read can run with
+ * the latch released. Called with the partition latch held. */
+static void buffer_partition_begin_load(BufferPartition* part, int frame, uint32_t page_id) {
+    BufferEntry* entry = &part->entries[frame];
+    entry->page_id = page_id;
+    atomic_store_u8(&entry->state, FRAME_LOADING);
+    page_table_insert(&part->page_table, page_id, frame);
 }
 
+/* Publishes (or, on failure, unmaps) a frame once its read has finished.
+ * pins is the pin count the page starts with: 1 for a synchronous fetch,
+ * 0 for a page loaded ahead of use. */
+static void buffer_partition_finish_load(BufferPool* pool, BufferPartition* part, int frame,
+                                         StorageResult result, uint16_t pins) {
+    BufferEntry* entry = &part->entries[frame];
+    Page* page = entry->page;
+
+    pthread_mutex_lock(&part->lock);
+
+    if (result != STORAGE_OK) {
+        page_table_remove(&part->page_table, entry->page_id);
+        part->free_frames[part->num_free++] = frame;
+        atomic_store_u8(&entry->state, FRAME_FREE);
+        pthread_mutex_unlock(&part->lock);
+        return;
+    }
+
+    page->dirty = false;
+    page->pin_count = pins;
+    page->frame_id = part->base + frame;
+
+    part->num_entries++;
+    buffer_partition_admit(part, pool->policy, frame, entry->page_id);
+    entry->prefetched = pins == 0;
+    atomic_store_u8(&entry->state, FRAME_VALID);
+
+    pthread_mutex_unlock(&part->lock);
+}
+
+static void buffer_pool_readahead(BufferPool* pool, PageManager* pm, uint32_t page_id);
+
 Page* buffer_pool_get_page(BufferPool* pool, PageManager* pm, uint32_t page_id) {
-    pthread_mutex_lock(&pool->lock);
+    BufferPartition* part = buffer_pool_partition(pool, page_id);
+
+retry:
+    pthread_mutex_lock(&part->lock);
+
+    int slot = page_table_lookup(&part->page_table, page_id);
 
-    int slot = buffer_pool_find_slot(pool, page_id);
-    
     if (slot >= 0) {
-        pool->entries[slot].last_access = pool->access_counter++;
-        pool->entries[slot].page->pin_count++;
-        pthread_mutex_unlock(&pool->lock);
-        return pool->entries[slot].page;
-    }
+        BufferEntry* entry = &part->entries[slot];
 
-    if (pool->num_entries >= pool->capacity) {
-        int victim = buffer_pool_find_victim(pool);
-        
-        if (victim < 0) {
-            pthread_mutex_unlock(&pool->lock);
-            return NULL;
+        /* Someone else's read is in flight. Keep reaping completions while
+         * waiting, since an async load only finishes when reaped. */
+        if (atomic_load_u8(&entry->state) == FRAME_LOADING) {
+            pthread_mutex_unlock(&part->lock);
+            while (atomic_load_u8(&entry->state) == FRAME_LOADING) {
+                page_manager_poll(pm);
+                sched_yield();
+            }
+            goto retry;
         }
 
-        BufferEntry* entry = &pool->entries[victim];
-        
-        if (entry->page->dirty) {
-            page_manager_write(pm, entry->page);
+        if (entry->queue != QUEUE_A1IN) {
+            entry->referenced = 1;
+        }
+        bool first_use = entry->prefetched;
+        entry->prefetched = 0;
+        part->hits++;
+        if (first_use) {
+            part->prefetch_hits++;
         }
+        atomic_fetch_add_u16(&entry->page->pin_count, 1);
+        pthread_mutex_unlock(&part->lock);
 
-        free(entry->page);
-        entry->valid = false;
-        pool->num_entries--;
+        if (first_use) {
+            buffer_pool_readahead(pool, pm, page_id);
+        }
+        return entry->page;
     }
 
-    Page* page = page_manager_read(pm, page_id);
-    if (!page) {
-        pthread_mutex_unlock(&pool->lock);
+    int frame = buffer_partition_reserve_frame(pool, part, pm);
+    if (frame >= 0 && page_table_lookup(&part->page_table, page_id) >= 0) {
+        /* Someone mapped the page while a victim was written back. */
+        part->free_frames[part->num_free++] = frame;
+        pthread_mutex_unlock(&part->lock);
+        goto retry;
+    }
+    part->misses++;
+    if (frame < 0) {
+        pthread_mutex_unlock(&part->lock);
         return NULL;
     }
 
-    int free_slot = buffer_pool_find_victim(pool);
-    if (free_slot < 0) {
-        free(page);
-        pthread_mutex_unlock(&pool->lock);
+    buffer_partition_begin_load(part, frame, page_id);
+    pthread_mutex_unlock(&part->lock);
+
+    Page* page = part->entries[frame].page;
+    StorageResult result = page_manager_read(pm, page_id, page);
+    buffer_partition_finish_load(pool, part, frame, result, 1);
+
+    if (result != STORAGE_OK) {
         return NULL;
     }
+    buffer_pool_readahead(pool, pm, page_id);
+    return page;
+}
 
-    pool->entries[free_slot].page = page;
-    pool->entries[free_slot].page_id = page_id;
-    pool->entries[free_slot].valid = true;
-    pool->entries[free_slot].last_access = pool->access_counter++;
-    pool->num_entries++;
+static void buffer_pool_load_done(void* ctx, Page* page, StorageResult result) {
+    BufferPool* pool = ctx;
+    size_t global = page - pool->frames;
+    BufferPartition* part = buffer_pool_partition(pool, pool->entries[global].page_id);
 
-    page->pin_count = 1;
+    buffer_partition_finish_load(pool, part, global - part->base, result, 0);
+}
 
-    pthread_mutex_unlock(&pool->lock);
-    return page;
+/* Starts asynchronous reads for every page in page_ids that is not already
+ * cached or loading, and returns how many were issued. Loaded pages start
+ * unpinned; completions are delivered as the page manager reaps them. */
+size_t buffer_pool_load_pages(BufferPool* pool, PageManager* pm, const uint32_t* page_ids, size_t count) {
+    size_t issued = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        BufferPartition* part = buffer_pool_partition(pool, page_ids[i]);
+
+        pthread_mutex_lock(&part->lock);
+
+        if (page_table_lookup(&part->page_table, page_ids[i]) >= 0) {
+            pthread_mutex_unlock(&part->lock);
+            continue;
+        }
+
+        int frame = buffer_partition_reserve_frame(pool, part, pm);
+        if (frame >= 0 && page_table_lookup(&part->page_table, page_ids[i]) >= 0) {
+            part->free_frames[part->num_free++] = frame;
+            frame = -1;
+        }
+        if (frame < 0) {
+            pthread_mutex_unlock(&part->lock);
+            continue;
+        }
+
+        buffer_partition_begin_load(part, frame, page_ids[i]);
+        part->prefetch_issued++;
+        pthread_mutex_unlock(&part->lock);
+
+        Page* page = part->entries[frame].page;
+        if (page_manager_read_async(pm, page_ids[i], page, buffer_pool_load_done, pool) != STORAGE_OK) {
+            buffer_partition_finish_load(pool, part, frame, STORAGE_ERROR, 0);
+            continue;
+        }
+        issued++;
+    }
+
+    return issued;
 }
 
-void buffer_pool_unpin_page(BufferPool* pool, Page* page) {
-    pthread_mutex_lock(&pool->lock);
+/* Loads up to count pages starting at first, stopping at the end of the
+ * file. Returns the number of reads issued. */
+size_t buffer_pool_prefetch(BufferPool* pool, PageManager* pm, uint32_t first, size_t count) {
+    uint32_t num_pages = page_manager_num_pages(pm);
+    if (first >= num_pages) {
+        return 0;
+    }
+    if (count > num_pages - first) {
+        count = num_pages - first;
+    }
 
-    for (size_t i = 0; i < pool->capacity; i++) {
-        if (pool->entries[i].valid && pool->entries[i].page == page) {
-            if (page->pin_count > 0) {
-                page->pin_count--;
-            }
-            break;
+    uint32_t ids[READAHEAD_MAX];
+    size_t issued = 0;
+    while (count > 0) {
+        size_t chunk = count < READAHEAD_MAX ? count : READAHEAD_MAX;
+        for (size_t i = 0; i < chunk; i++) {
+            ids[i] = first + (uint32_t)i;
+        }
+        issued += buffer_pool_load_pages(pool, pm, ids, chunk);
+        first += (uint32_t)chunk;
+        count -= chunk;
+    }
+    return issued;
+}
+
+/* The stream page_id continues, or else a fresh one starting with the
+ * given window in place of the least recently used. Called with the
+ * read-ahead lock held. */
+static ReadAheadStream* readahead_stream(ReadAhead* ra, uint32_t page_id, uint32_t window) {
+    ReadAheadStream* oldest = &ra->streams[0];
+    for (size_t i = 0; i < READAHEAD_STREAMS; i++) {
+        ReadAheadStream* stream = &ra->streams[i];
+        if (stream->run > 0 && stream->expect == page_id) {
+            stream->run++;
+            return stream;
+        }
+        if (stream->used < oldest->used) {
+            oldest = stream;
         }
     }
 
-    pthread_mutex_unlock(&pool->lock);
+    oldest->run = 1;
+    oldest->next = page_id + 1;
+    oldest->window = window;
+    return oldest;
 }
 
+/* Called after every first touch of a page. Once the touches form a
+ * run, keeps a window of pages in flight ahead of the cursor, topping it
+ * up when the cursor is halfway through. */
+static void buffer_pool_readahead(BufferPool* pool, PageManager* pm, uint32_t page_id) {
+    ReadAhead* ra = &pool->readahead;
+    if (pool->readahead_max == 0) {
+        return;
+    }
+
+    uint32_t window = READAHEAD_MIN < pool->readahead_max ? READAHEAD_MIN : pool->readahead_max;
+    pthread_mutex_lock(&ra->lock);
+    ReadAheadStream* stream = readahead_stream(ra, page_id, window);
+    stream->expect = page_id + 1;
+    stream->used = ++ra->clock;
+
+    if (stream->run < READAHEAD_TRIGGER) {
+        pthread_mutex_unlock(&ra->lock);
+        return;
+    }
+    if (stream->next <= page_id) {
+        stream->next = page_id + 1;
+    }
+    if (stream->next - page_id > stream->window / 2) {
+        pthread_mutex_unlock(&ra->lock);
+        return;
+    }
+
+    uint32_t first = stream->next;
+    size_t count = page_id + 1 + stream->window - first;
+    stream->next = first + (uint32_t)count;
+    if (stream->window < pool->readahead_max) {
+        stream->window = stream->window * 2 < pool->readahead_max ? stream->window * 2
+                                                                   : pool->readahead_max;
+    }
+    pthread_mutex_unlock(&ra->lock);
+
+    buffer_pool_prefetch(pool, pm, first, count);
+}
+
+void buffer_pool_stats(BufferPool* pool, StorageMetrics* metrics) {
+    memset(metrics, 0, sizeof(StorageMetrics));
+
+    for (size_t p = 0; p < pool->num_partitions; p++) {
+        BufferPartition* part = &pool->partitions[p];
+
+        pthread_mutex_lock(&part->lock);
+        metrics->buffer_hits += part->hits;
+        metrics->buffer_misses += part->misses;
+        metrics->prefetch_issued += part->prefetch_issued;
+        metrics->prefetch_hits += part->prefetch_hits;
+        metrics->prefetch_unused += part->prefetch_unused;
+        pthread_mutex_unlock(&part->lock);
+    }
+}
+
+/* Unpinning never takes a latch: the caller's pin keeps the frame from
+ * being reassigned, and eviction only ever observes pin_count falling. */
+void buffer_pool_unpin_page(BufferPool* pool, Page* page) {
+    if (!buffer_pool_entry_of(pool, page)) {
+        return;
+    }
+
+    uint16_t pins = atomic_load_u16(&page->pin_count);
+    while (pins > 0 && !atomic_cas_u16(&page->pin_count, pins, pins - 1)) {
+        pins = atomic_load_u16(&page->pin_count);
+    }
+}
+
+/* Writes a pinned page and syncs it. The WAL flush, write and sync run
+ * without the partition latch; the caller's pin keeps the frame and the
+ * write lock keeps other writes of the page out. */
 StorageResult buffer_pool_flush_page(BufferPool* pool, PageManager* pm, Page* page) {
-    pthread_mutex_lock(&pool->lock);
+    BufferPartition* part = buffer_pool_partition(pool, page->header.page_id);
+    BufferEntry* entry = buffer_pool_entry_of(pool, page);
 
-    StorageResult result = page_manager_write(pm, page);
-    page->dirty = false;
+    if (entry) {
+        pthread_mutex_lock(&entry->write);
+        pthread_mutex_lock(&part->lock);
+        entry->writing++;
+        pthread_mutex_unlock(&part->lock);
+    }
+
+    StorageResult result = buffer_pool_wal_before_data(pool, page->header.lsn);
+    if (result == STORAGE_OK) {
+        result = page_manager_write(pm, page);
+    }
 
-    pthread_mutex_unlock(&pool->lock);
+    if (entry) {
+        pthread_mutex_lock(&part->lock);
+        buffer_entry_end_write(entry, result == STORAGE_OK);
+        pthread_mutex_unlock(&part->lock);
+        pthread_mutex_unlock(&entry->write);
+    }
+    if (result == STORAGE_OK) {
+        result = page_manager_sync(pm);
+    }
     return result;
 }
 
+/* Collects every dirty page, pinning each so it cannot be evicted while
+ * the latches are released, then writes them as one sorted batch with a
+ * single sync. The WAL is flushed once, up to the newest page LSN.
+ * Write locks are taken in frame order, so concurrent flushes cannot
+ * deadlock on them. */
 StorageResult buffer_pool_flush_all(BufferPool* pool, PageManager* pm) {
-    pthread_mutex_lock(&pool->lock);
+    Page** batch = malloc(sizeof(Page*) * pool->capacity);
+    if (!batch) return STORAGE_OOM;
 
-    for (size_t i = 0; i < pool->capacity; i++) {
-        if (pool->entries[i].valid && pool->entries[i].page->dirty) {
-            StorageResult result = page_manager_write(pm, pool->entries[i].page);
-            if (result != STORAGE_OK) {
-                pthread_mutex_unlock(&pool->lock);
-                return result;
+    size_t count = 0;
+    uint64_t max_lsn = 0;
+
+    for (size_t p = 0; p < pool->num_partitions; p++) {
+        BufferPartition* part = &pool->partitions[p];
+
+        pthread_mutex_lock(&part->lock);
+
+        for (size_t i = 0; i < part->capacity; i++) {
+            Page* page = part->entries[i].page;
+            if (part->entries[i].state == FRAME_VALID && page->dirty) {
+                atomic_fetch_add_u16(&page->pin_count, 1);
+                part->entries[i].writing++;
+                if (page->header.lsn > max_lsn) {
+                    max_lsn = page->header.lsn;
+                }
+                batch[count++] = page;
             }
         }
+
+        pthread_mutex_unlock(&part->lock);
     }
 
-    pthread_mutex_unlock(&pool->lock);
+    for (size_t i = 0; i < count; i++) {
+        pthread_mutex_lock(&buffer_pool_entry_of(pool, batch[i])->write);
+    }
+
+    StorageResult result = STORAGE_OK;
+    if (count > 0) {
+        result = buffer_pool_wal_before_data(pool, max_lsn);
+        if (result == STORAGE_OK) {
+            result = page_manager_write_batch(pm, batch, count);
+        }
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        BufferEntry* entry = buffer_pool_entry_of(pool, batch[i]);
+        BufferPartition* part = buffer_pool_partition(pool, entry->page_id);
+        pthread_mutex_lock(&part->lock);
+        buffer_entry_end_write(entry, result == STORAGE_OK);
+        pthread_mutex_unlock(&part->lock);
+        pthread_mutex_unlock(&entry->write);
+        buffer_pool_unpin_page(pool, batch[i]);
+    }
+
+    free(batch);
+    return result;
+}
+
+/* Marks a pinned page dirty. lsn should be the WAL insert position taken
+ * before the change is logged; the first call since the page was last
+ * written fixes its recLSN. */
+void buffer_pool_mark_dirty(BufferPool* pool, Page* page, uint64_t lsn) {
+    BufferEntry* entry = buffer_pool_entry_of(pool, page);
+    if (entry) {
+        atomic_cas_u64(&entry->rec_lsn, REC_LSN_CLEAN, lsn);
+    }
+    page->dirty = true;
+}
+
+/* Takes a pinned page's content latch. Hold it while changing the page,
+ * from marking it dirty until its LSN is set. */
+void buffer_pool_latch_page(BufferPool* pool, Page* page) {
+    BufferEntry* entry = buffer_pool_entry_of(pool, page);
+    if (entry) {
+        pthread_mutex_lock(&entry->content);
+    }
+}
+
+void buffer_pool_unlatch_page(BufferPool* pool, Page* page) {
+    BufferEntry* entry = buffer_pool_entry_of(pool, page);
+    if (entry) {
+        pthread_mutex_unlock(&entry->content);
+    }
+}
+
+static void buffer_pool_stage_latch(void* ctx, Page* page) {
+    buffer_pool_latch_page(ctx, page);
+}
+
+static void buffer_pool_stage_unlatch(void* ctx, Page* page) {
+    buffer_pool_unlatch_page(ctx, page);
+}
+
+/* Has pm take a frame's content latch while it copies the page for a
+ * write, so checkpoints and evictions never persist a change in
+ * progress. */
+void buffer_pool_attach_page_manager(BufferPool* pool, PageManager* pm) {
+    page_manager_attach_latch(pm, buffer_pool_stage_latch, buffer_pool_stage_unlatch, pool);
+}
+
+/* Snapshots the dirty page table: every dirty page and its recLSN,
+ * counting a page as dirty until a write of it has been issued. Pages
+ * marked dirty without buffer_pool_mark_dirty get default_lsn. Each
+ * partition is latched only while it is scanned. *out is a malloc'd
+ * array, or NULL when nothing is dirty. */
+StorageResult buffer_pool_dirty_pages(BufferPool* pool, uint64_t default_lsn,
+                                      DirtyPageEntry** out, size_t* count) {
+    *out = NULL;
+    *count = 0;
+    DirtyPageEntry* dirty = malloc(sizeof(DirtyPageEntry) * pool->capacity);
+    if (!dirty) return STORAGE_OOM;
+
+    size_t n = 0;
+    for (size_t p = 0; p < pool->num_partitions; p++) {
+        BufferPartition* part = &pool->partitions[p];
+
+        pthread_mutex_lock(&part->lock);
+
+        for (size_t i = 0; i < part->capacity; i++) {
+            BufferEntry* entry = &part->entries[i];
+            if (entry->state == FRAME_VALID && (entry->page->dirty || entry->writing > 0)) {
+                uint64_t rec_lsn = atomic_load_u64(&entry->rec_lsn);
+                dirty[n].page_id = entry->page_id;
+                dirty[n].rec_lsn = rec_lsn == REC_LSN_CLEAN ? default_lsn : rec_lsn;
+                n++;
+            }
+        }
+
+        pthread_mutex_unlock(&part->lock);
+    }
+
+    if (n == 0) {
+        free(dirty);
+        return STORAGE_OK;
+    }
+    *out = dirty;
+    *count = n;
     return STORAGE_OK;
 }
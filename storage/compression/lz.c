@@ -0,0 +1,220 @@
+#include "../include/minsql_storage.h"
+#include "../include/compat.h"
+#include <string.h>
+
+/* A byte-oriented LZ77 codec in the LZ4 block format: a sequence is a
+ * token (literal length in the high nibble, match length - 4 in the low
+ * one, 15 meaning "more bytes follow"), the literals, and a 2-byte
+ * little-endian match offset. The last sequence has literals only. It
+ * trades ratio for speed: one hash probe per position and a skip that
+ * grows over incompressible input. */
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 12
+#define LZ_MAX_OFFSET 65535
+/* The last match must start at least 12 bytes before the end and leave
+ * at least 5 literals, as the LZ4 format requires. */
+#define LZ_MF_LIMIT 12
+#define LZ_LAST_LITERALS 5
+#define LZ_SKIP_SHIFT 6
+
+static uint32_t lz_read32(const uint8_t* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint64_t lz_read64(const uint8_t* p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint32_t lz_hash(uint32_t v) {
+    return (v * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+/* Writes a length continuation: 255s, then the remainder. */
+static uint8_t* lz_put_length(uint8_t* op, size_t len) {
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+/* Worst-case compressed size of len bytes. */
+size_t lz_compress_bound(size_t len) {
+    return len + len / 255 + 16;
+}
+
+/* Emits literals [anchor, ip) followed by a match of match_len at offset
+ * (match_len 0 for the final, literal-only sequence). Returns NULL if the
+ * output would pass out_end. */
+static uint8_t* lz_put_sequence(uint8_t* op, const uint8_t* out_end, const uint8_t* anchor,
+                                size_t literals, size_t offset, size_t match_len) {
+    size_t need = 1 + literals;
+    if (literals >= 15) {
+        need += (literals - 15) / 255 + 1;
+    }
+    if (match_len > 0) {
+        need += 2;
+        if (match_len - LZ_MIN_MATCH >= 15) {
+            need += (match_len - LZ_MIN_MATCH - 15) / 255 + 1;
+        }
+    }
+    if (need > (size_t)(out_end - op)) {
+        return NULL;
+    }
+
+    uint8_t* token = op++;
+    *token = (uint8_t)((literals < 15 ? literals : 15) << 4);
+    if (literals >= 15) {
+        op = lz_put_length(op, literals - 15);
+    }
+    memcpy(op, anchor, literals);
+    op += literals;
+
+    if (match_len > 0) {
+        *op++ = (uint8_t)offset;
+        *op++ = (uint8_t)(offset >> 8);
+        size_t code = match_len - LZ_MIN_MATCH;
+        *token |= (uint8_t)(code < 15 ? code : 15);
+        if (code >= 15) {
+            op = lz_put_length(op, code - 15);
+        }
+    }
+    return op;
+}
+
+/* Compresses len bytes of src into dst (capacity cap). Returns the
+ * compressed size, or 0 if it would not fit in cap. */
+size_t lz_compress(const void* src, size_t len, void* dst, size_t cap) {
+    const uint8_t* base = src;
+    const uint8_t* ip = base;
+    const uint8_t* anchor = base;
+    const uint8_t* in_end = base + len;
+    uint8_t* op = dst;
+    const uint8_t* out_end = op + cap;
+
+    if (len > LZ_MF_LIMIT) {
+        const uint8_t* match_limit = in_end - LZ_MF_LIMIT;
+        const uint8_t* extend_limit = in_end - LZ_LAST_LITERALS;
+        uint32_t table[1 << LZ_HASH_BITS];
+        memset(table, 0, sizeof(table));
+
+        while (ip < match_limit) {
+            uint32_t h = lz_hash(lz_read32(ip));
+            const uint8_t* ref = base + table[h];
+            table[h] = (uint32_t)(ip - base);
+
+            if (ref >= ip || ip - ref > LZ_MAX_OFFSET || lz_read32(ref) != lz_read32(ip)) {
+                ip += 1 + ((size_t)(ip - anchor) >> LZ_SKIP_SHIFT);
+                continue;
+            }
+
+            while (ip > anchor && ref > base && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+            const uint8_t* end = ip + LZ_MIN_MATCH;
+            const uint8_t* mref = ref + LZ_MIN_MATCH;
+            while (end + 8 <= extend_limit && lz_read64(end) == lz_read64(mref)) {
+                end += 8;
+                mref += 8;
+            }
+            while (end < extend_limit && *end == *mref) {
+                end++;
+                mref++;
+            }
+
+            op = lz_put_sequence(op, out_end, anchor, (size_t)(ip - anchor),
+                                 (size_t)(ip - ref), (size_t)(end - ip));
+            if (!op) {
+                return 0;
+            }
+            ip = end;
+            anchor = ip;
+            table[lz_hash(lz_read32(ip - 2))] = (uint32_t)(ip - 2 - base);
+        }
+    }
+
+    op = lz_put_sequence(op, out_end, anchor, (size_t)(in_end - anchor), 0, 0);
+    if (!op) {
+        return 0;
+    }
+    return (size_t)(op - (uint8_t*)dst);
+}
+
+/* Reads a length continuation. Returns false if it runs past in_end. */
+static bool lz_get_length(const uint8_t** ip, const uint8_t* in_end, size_t* len) {
+    uint8_t b;
+    do {
+        if (*ip >= in_end) {
+            return false;
+        }
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return true;
+}
+
+/* Decompresses src into exactly out_len bytes at dst. Returns false if
+ * the input is malformed or does not produce exactly out_len bytes;
+ * never reads or writes out of bounds. */
+bool lz_decompress(const void* src, size_t len, void* dst, size_t out_len) {
+    const uint8_t* ip = src;
+    const uint8_t* in_end = ip + len;
+    uint8_t* op = dst;
+    uint8_t* out_start = op;
+    uint8_t* out_end = op + out_len;
+
+    while (ip < in_end) {
+        uint8_t token = *ip++;
+
+        size_t literals = token >> 4;
+        if (literals == 15 && !lz_get_length(&ip, in_end, &literals)) {
+            return false;
+        }
+        if (literals > (size_t)(in_end - ip) || literals > (size_t)(out_end - op)) {
+            return false;
+        }
+        memcpy(op, ip, literals);
+        ip += literals;
+        op += literals;
+
+        if (ip == in_end) {
+            break;
+        }
+
+        if (in_end - ip < 2) {
+            return false;
+        }
+        size_t offset = (size_t)ip[0] | ((size_t)ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - out_start)) {
+            return false;
+        }
+
+        size_t match_len = token & 15;
+        if (match_len == 15 && !lz_get_length(&ip, in_end, &match_len)) {
+            return false;
+        }
+        match_len += LZ_MIN_MATCH;
+        if (match_len > (size_t)(out_end - op)) {
+            return false;
+        }
+
+        const uint8_t* ref = op - offset;
+        if (offset >= match_len) {
+            memcpy(op, ref, match_len);
+            op += match_len;
+        } else {
+            /* Overlapping match: a run repeating the last offset bytes. */
+            while (match_len-- > 0) {
+                *op++ = *ref++;
+            }
+        }
+    }
+    return op == out_end;
+}
@@ -3,56 +3,129 @@
 #include <stdlib.h>
 #include <string.h>
 
-extern BufferPool* buffer_pool_create(size_t capacity);
+extern BufferPool* buffer_pool_create(size_t capacity, BufferReplacementPolicy policy,
+                                      size_t num_partitions, bool huge_pages);
 extern void buffer_pool_destroy(BufferPool* pool);
 extern Page* buffer_pool_get_page(BufferPool* pool, PageManager* pm, uint32_t page_id);
 extern void buffer_pool_unpin_page(BufferPool* pool, Page* page);
 extern StorageResult buffer_pool_flush_all(BufferPool* pool, PageManager* pm);
 extern StorageResult buffer_pool_flush_page(BufferPool* pool, PageManager* pm, Page* page);
+extern void buffer_pool_attach_wal(BufferPool* pool, WAL* wal);
+extern void buffer_pool_attach_page_manager(BufferPool* pool, PageManager* pm);
+extern size_t buffer_pool_prefetch(BufferPool* pool, PageManager* pm, uint32_t first, size_t count);
+extern void buffer_pool_mark_dirty(BufferPool* pool, Page* page, uint64_t lsn);
+extern StorageResult buffer_pool_dirty_pages(BufferPool* pool, uint64_t default_lsn,
+                                             DirtyPageEntry** out, size_t* count);
+extern void buffer_pool_stats(BufferPool* pool, StorageMetrics* metrics);
 
-extern PageManager* page_manager_create(const char* data_dir);
+extern PageManager* page_manager_create(const char* data_dir, unsigned io_queue_depth,
+                                        bool direct_io, bool compress);
 extern void page_manager_destroy(PageManager* pm);
-extern Page* page_manager_read(PageManager* pm, uint32_t page_id);
+extern StorageResult page_manager_read(PageManager* pm, uint32_t page_id, Page* page);
 extern StorageResult page_manager_write(PageManager* pm, Page* page);
 extern Page* page_manager_alloc(PageManager* pm);
+extern void page_manager_wait(PageManager* pm);
+extern StorageResult page_manager_sync(PageManager* pm);
+extern StorageResult page_manager_flush_fsm(PageManager* pm);
+extern void page_manager_stats(PageManager* pm, StorageMetrics* metrics);
 
-extern WAL* wal_create(const char* data_dir);
+extern WAL* wal_create(const char* data_dir, size_t ring_bytes, unsigned writer_interval_ms,
+                       size_t compression_threshold);
 extern void wal_destroy(WAL* wal);
+extern uint64_t wal_insert_lsn(WAL* wal);
+extern void wal_recycle_segments(WAL* wal, uint64_t keep_lsn);
+extern void wal_stats(WAL* wal, StorageMetrics* metrics);
+
+extern StorageResult control_file_write(const char* data_dir, uint64_t checkpoint_lsn,
+                                        uint64_t redo_lsn, const DirtyPageEntry* dirty,
+                                        size_t num_dirty);
 
 extern Arena* arena_create(size_t capacity);
 extern void arena_destroy(Arena* arena);
 
+extern Heap* heap_create(void);
+extern void heap_destroy(Heap* heap);
+extern StorageResult heap_insert(StorageHandle* handle, const uint8_t* data, const size_t* lens,
+                                 size_t count, uint64_t* row_ids, uint64_t* lsn_out);
+
+#define DEFAULT_BUFFER_POOL_FRAMES 1024
+#define DEFAULT_ARENA_BYTES (16 * 1024 * 1024)
+#define DEFAULT_IO_QUEUE_DEPTH 64
+#define DEFAULT_WAL_BUFFER_BYTES (1024 * 1024)
+#define DEFAULT_WAL_WRITER_INTERVAL_MS 10
+#define DEFAULT_RECOVERY_WORKERS 4
+#define DEFAULT_WAL_COMPRESSION_THRESHOLD 512
+
+void storage_default_options(StorageOptions* options) {
+    memset(options, 0, sizeof(StorageOptions));
+    options->buffer_pool_frames = DEFAULT_BUFFER_POOL_FRAMES;
+    options->replacement_policy = BUFFER_POLICY_CLOCK;
+    options->arena_bytes = DEFAULT_ARENA_BYTES;
+    options->io_queue_depth = DEFAULT_IO_QUEUE_DEPTH;
+    options->wal_buffer_bytes = DEFAULT_WAL_BUFFER_BYTES;
+    options->wal_writer_interval_ms = DEFAULT_WAL_WRITER_INTERVAL_MS;
+    options->recovery_workers = DEFAULT_RECOVERY_WORKERS;
+    options->wal_compression_threshold = DEFAULT_WAL_COMPRESSION_THRESHOLD;
+}
+
 StorageHandle* storage_init(const char* data_dir) {
+    return storage_init_ex(data_dir, NULL);
+}
+
+StorageHandle* storage_init_ex(const char* data_dir, const StorageOptions* options) {
+    StorageOptions defaults;
+    if (!options) {
+        storage_default_options(&defaults);
+        options = &defaults;
+    }
+
+    size_t frames = options->buffer_pool_frames;
+    if (options->buffer_pool_bytes > 0) {
+        frames = options->buffer_pool_bytes / PAGE_SIZE;
+    }
+    if (frames == 0) {
+        frames = DEFAULT_BUFFER_POOL_FRAMES;
+    }
+
     StorageHandle* handle = malloc(sizeof(StorageHandle));
     if (!handle) return NULL;
 
     strncpy(handle->data_dir, data_dir, sizeof(handle->data_dir) - 1);
     handle->data_dir[sizeof(handle->data_dir) - 1] = '\0';
+    handle->recovery_workers = options->recovery_workers;
 
     mkdir(data_dir, 0755);
 
-    handle->page_manager = page_manager_create(data_dir);
+    handle->page_manager = page_manager_create(data_dir, (unsigned)options->io_queue_depth,
+                                                options->direct_io,
+                                                options->page_compression);
     if (!handle->page_manager) {
         free(handle);
         return NULL;
     }
 
-    handle->buffer_pool = buffer_pool_create(1024);
+    handle->buffer_pool = buffer_pool_create(frames, options->replacement_policy,
+                                             options->buffer_pool_partitions,
+                                             options->huge_pages);
     if (!handle->buffer_pool) {
         page_manager_destroy(handle->page_manager);
         free(handle);
         return NULL;
     }
 
-    handle->wal = wal_create(data_dir);
+    handle->wal = wal_create(data_dir, options->wal_buffer_bytes,
+                             (unsigned)options->wal_writer_interval_ms,
+                             options->wal_compression_threshold);
     if (!handle->wal) {
         buffer_pool_destroy(handle->buffer_pool);
         page_manager_destroy(handle->page_manager);
         free(handle);
         return NULL;
     }
+    buffer_pool_attach_wal(handle->buffer_pool, handle->wal);
+    buffer_pool_attach_page_manager(handle->buffer_pool, handle->page_manager);
 
-    handle->arena = arena_create(0);
+    handle->arena = arena_create(options->arena_bytes);
     if (!handle->arena) {
         wal_destroy(handle->wal);
         buffer_pool_destroy(handle->buffer_pool);
@@ -61,15 +134,28 @@ StorageHandle* storage_init(const char* data_dir) {
         return NULL;
     }
 
+    handle->heap = heap_create();
+    if (!handle->heap) {
+        arena_destroy(handle->arena);
+        wal_destroy(handle->wal);
+        buffer_pool_destroy(handle->buffer_pool);
+        page_manager_destroy(handle->page_manager);
+        free(handle);
+        return NULL;
+    }
+
     return handle;
 }
 
 void storage_shutdown(StorageHandle* handle) {
     if (!handle) return;
 
+    /* Let in-flight async reads land before their frames go away. */
+    page_manager_wait(handle->page_manager);
     buffer_pool_flush_all(handle->buffer_pool, handle->page_manager);
     storage_wal_flush(handle);
 
+    heap_destroy(handle->heap);
     arena_destroy(handle->arena);
     wal_destroy(handle->wal);
     buffer_pool_destroy(handle->buffer_pool);
@@ -81,8 +167,10 @@ Page* storage_get_page(StorageHandle* handle, uint32_t page_id) {
     return buffer_pool_get_page(handle->buffer_pool, handle->page_manager, page_id);
 }
 
+/* Marks a pinned page dirty. Call it before logging the change, so the
+ * page's recLSN is no later than the change's record. */
 StorageResult storage_put_page(StorageHandle* handle, Page* page) {
-    page->dirty = true;
+    buffer_pool_mark_dirty(handle->buffer_pool, page, wal_insert_lsn(handle->wal));
     return STORAGE_OK;
 }
 
@@ -94,12 +182,60 @@ void storage_release_page(StorageHandle* handle, Page* page) {
     buffer_pool_unpin_page(handle->buffer_pool, page);
 }
 
+/* Hints that pages first_page..first_page+count-1 are about to be read.
+ * Reads are issued asynchronously; pages land unpinned in the pool. */
+size_t storage_prefetch_pages(StorageHandle* handle, uint32_t first_page, size_t count) {
+    return buffer_pool_prefetch(handle->buffer_pool, handle->page_manager, first_page, count);
+}
+
+void storage_get_metrics(StorageHandle* handle, StorageMetrics* metrics) {
+    buffer_pool_stats(handle->buffer_pool, metrics);
+    wal_stats(handle->wal, metrics);
+    page_manager_stats(handle->page_manager, metrics);
+}
+
+/* Fuzzy checkpoint. Pages dirty when it starts are written back while
+ * the pool keeps serving requests (partitions are latched only while
+ * they are scanned). The dirty page table is then snapshotted: pages
+ * dirtied meanwhile stay dirty with their recLSN, and the redo point is
+ * the oldest of those or the checkpoint start. The control file records
+ * both, so recovery starts at the redo point and skips records whose
+ * pages were already written. Segments before it are then recycled.
+ * Evictions write pages back without a sync and take them out of the
+ * dirty page table; one that lands after the write-back's sync would be
+ * skipped by recovery yet not be durable, so pages.dat is synced again
+ * once the table is snapshotted. */
 StorageResult storage_checkpoint(StorageHandle* handle) {
+    uint64_t begin_lsn = wal_insert_lsn(handle->wal);
+
     StorageResult result = buffer_pool_flush_all(handle->buffer_pool, handle->page_manager);
+    if (result == STORAGE_OK) {
+        result = page_manager_flush_fsm(handle->page_manager);
+    }
+    if (result != STORAGE_OK) {
+        return result;
+    }
+
+    uint64_t checkpoint_lsn = wal_insert_lsn(handle->wal);
+    DirtyPageEntry* dirty;
+    size_t num_dirty;
+    result = buffer_pool_dirty_pages(handle->buffer_pool, begin_lsn, &dirty, &num_dirty);
+    if (result != STORAGE_OK) {
+        return result;
+    }
+    result = page_manager_sync(handle->page_manager);
     if (result != STORAGE_OK) {
+        free(dirty);
         return result;
     }
 
+    uint64_t redo_lsn = begin_lsn;
+    for (size_t i = 0; i < num_dirty; i++) {
+        if (dirty[i].rec_lsn < redo_lsn) {
+            redo_lsn = dirty[i].rec_lsn;
+        }
+    }
+
     WALEntry checkpoint_entry;
     checkpoint_entry.type = WAL_CHECKPOINT;
     checkpoint_entry.transaction_id = 0;
@@ -107,51 +243,106 @@ StorageResult storage_checkpoint(StorageHandle* handle) {
     checkpoint_entry.length = 0;
 
     storage_wal_append(handle, &checkpoint_entry);
-    return storage_wal_flush(handle);
+    result = storage_wal_flush(handle);
+    if (result == STORAGE_OK) {
+        result = control_file_write(handle->data_dir, checkpoint_lsn, redo_lsn, dirty, num_dirty);
+    }
+    free(dirty);
+    if (result != STORAGE_OK) {
+        return result;
+    }
+
+    wal_recycle_segments(handle->wal, redo_lsn);
+    return STORAGE_OK;
 }
 
 StorageResult storage_recover(StorageHandle* handle) {
     return storage_wal_replay(handle);
 }
 
+/* Logs a row change that is not tied to a page: a WALRedoHeader with
+ * WAL_NO_PAGE followed by the payload fragments, copied straight from
+ * the caller's buffers. Returns 0 if the record could not be logged. */
+static uint64_t storage_log_row_change(StorageHandle* handle, WALEntryType type,
+                                       const WALFragment* payload, size_t count) {
+    WALEntry header;
+    memset(&header, 0, sizeof(WALEntry));
+    header.type = type;
+    header.transaction_id = 1;
+    header.logical_time = 0;
+
+    WALRedoHeader redo_header = { WAL_NO_PAGE, 0, 0 };
+    WALFragment fragments[3];
+    fragments[0].data = &redo_header;
+    fragments[0].len = sizeof(WALRedoHeader);
+    for (size_t i = 0; i < count; i++) {
+        fragments[i + 1] = payload[i];
+    }
+
+    return storage_wal_append_v(handle, &header, fragments, count + 1);
+}
+
+/* A record that cannot be logged (larger than the WAL ring, or the log
+ * has failed) is reported as an I/O error. */
+static int storage_commit_row_change(StorageHandle* handle, uint64_t lsn) {
+    if (lsn == 0) {
+        return STORAGE_IO_ERROR;
+    }
+    return storage_wal_commit(handle, lsn);
+}
+
 int storage_create_table(StorageHandle* handle, const char* table_name, const char* schema_json) {
     if (!handle || !table_name || !schema_json) {
         return STORAGE_ERROR;
     }
 
-    WALEntry schema_entry;
-    schema_entry.type = WAL_INSERT;
-    schema_entry.transaction_id = 1;
-    schema_entry.logical_time = 0;
-    
-    size_t name_len = strlen(table_name);
-    size_t schema_len = strlen(schema_json);
-    schema_entry.length = (uint16_t)((name_len + schema_len + 4) < 65535 ? (name_len + schema_len + 4) : 65535);
-    
-    storage_wal_append(handle, &schema_entry);
-    storage_wal_flush(handle);
-    
-    return STORAGE_OK;
+    /* Payload: table name and schema, each NUL terminated. */
+    WALFragment payload[2];
+    payload[0].data = table_name;
+    payload[0].len = strlen(table_name) + 1;
+    payload[1].data = schema_json;
+    payload[1].len = strlen(schema_json) + 1;
+
+    uint64_t lsn = storage_log_row_change(handle, WAL_INSERT, payload, 2);
+    return storage_commit_row_change(handle, lsn);
 }
 
+/* Stores the row in a heap page and returns its (page, slot) row ID.
+ * There is no catalog yet, so all tables share the heap in pages.dat. */
 int storage_insert_row(StorageHandle* handle, const char* table_name, 
                        const uint8_t* data, size_t data_len, uint64_t* row_id_out) {
     if (!handle || !table_name || !data || !row_id_out) {
         return STORAGE_ERROR;
     }
-    static uint64_t next_row_id = 1;
-    *row_id_out = next_row_id++;
-    
-    WALEntry insert_entry;
-    insert_entry.type = WAL_INSERT;
-    insert_entry.transaction_id = 1;
-    insert_entry.logical_time = 0;
-    insert_entry.length = (uint16_t)(data_len < 65535 ? data_len : 65535);
-    
-    storage_wal_append(handle, &insert_entry);
-    storage_wal_flush(handle);
-    
-    return STORAGE_OK;
+
+    uint64_t lsn;
+    StorageResult result = heap_insert(handle, data, &data_len, 1, row_id_out, &lsn);
+    if (result != STORAGE_OK) {
+        return result;
+    }
+    return storage_commit_row_change(handle, lsn);
+}
+
+/* Inserts count rows stored back to back in data, row i being
+ * row_lens[i] bytes, and writes their row IDs to row_ids_out. Rows fill
+ * a page before the next is used, each page is logged with one WAL
+ * record, and a single commit covers the batch. */
+int storage_insert_rows_batch(StorageHandle* handle, const char* table_name,
+                              const uint8_t* data, const size_t* row_lens, size_t count,
+                              uint64_t* row_ids_out) {
+    if (!handle || !table_name || (count > 0 && (!data || !row_lens || !row_ids_out))) {
+        return STORAGE_ERROR;
+    }
+    if (count == 0) {
+        return STORAGE_OK;
+    }
+
+    uint64_t lsn;
+    StorageResult result = heap_insert(handle, data, row_lens, count, row_ids_out, &lsn);
+    if (result != STORAGE_OK) {
+        return result;
+    }
+    return storage_commit_row_change(handle, lsn);
 }
 
 int storage_update_rows(StorageHandle* handle, const char* table_name,
@@ -162,16 +353,9 @@ int storage_update_rows(StorageHandle* handle, const char* table_name,
     }
     *count_out = 0;
     
-    WALEntry update_entry;
-    update_entry.type = WAL_UPDATE;
-    update_entry.transaction_id = 1;
-    update_entry.logical_time = 0;
-    update_entry.length = (uint16_t)(data_len < 65535 ? data_len : 65535);
-    
-    storage_wal_append(handle, &update_entry);
-    storage_wal_flush(handle);
-    
-    return STORAGE_OK;
+    WALFragment payload = { data, data_len };
+    uint64_t lsn = storage_log_row_change(handle, WAL_UPDATE, &payload, 1);
+    return storage_commit_row_change(handle, lsn);
 }
 
 int storage_delete_rows(StorageHandle* handle, const char* table_name,
@@ -182,14 +366,6 @@ int storage_delete_rows(StorageHandle* handle, const char* table_name,
 
     *count_out = 0;
     
-    WALEntry delete_entry;
-    delete_entry.type = WAL_DELETE;
-    delete_entry.transaction_id = 1;
-    delete_entry.logical_time = 0;
-    delete_entry.length = 0;
-    
-    storage_wal_append(handle, &delete_entry);
-    storage_wal_flush(handle);
-    
-    return STORAGE_OK;
+    uint64_t lsn = storage_log_row_change(handle, WAL_DELETE, NULL, 0);
+    return storage_commit_row_change(handle, lsn);
 }
@@ -0,0 +1,211 @@
+#include "../include/minsql_storage.h"
+#include "../include/compat.h"
+#include <stdlib.h>
+#include <string.h>
+
+extern Page* buffer_pool_get_page(BufferPool* pool, PageManager* pm, uint32_t page_id);
+extern void buffer_pool_unpin_page(BufferPool* pool, Page* page);
+extern void buffer_pool_latch_page(BufferPool* pool, Page* page);
+extern void buffer_pool_unlatch_page(BufferPool* pool, Page* page);
+
+extern uint32_t page_manager_extend(PageManager* pm);
+extern uint32_t page_manager_find_free_page(PageManager* pm, size_t need);
+extern StorageResult page_add_tuple(PageManager* pm, Page* page, const void* tuple_data,
+                                    uint16_t tuple_size, uint16_t* slot_out);
+extern void page_begin_adds(const Page* page, Page* saved);
+extern void page_undo_adds(PageManager* pm, Page* page, const Page* saved);
+
+extern uint64_t wal_append_record(StorageHandle* handle, const WALEntry* header,
+                                  const WALFragment* fragments, size_t count, uint64_t* end_lsn);
+
+/* Rows are tuples in the slotted pages of pages.dat, changed through the
+ * buffer pool. Inserts take a page the free space map says has room, or
+ * extend the file, and fill it with as many rows as fit before logging
+ * them in one record. Changes to a page are serialised by a latch
+ * striped over page ids; the latch is held from reading the page until
+ * its LSN is set, so records for a page enter the log in the order they
+ * are applied. The page's own content latch covers the same span minus
+ * the read, keeping checkpoints and evictions from copying a page that
+ * is half changed. */
+#define HEAP_LATCHES 64
+
+/* Every tuple costs its line pointer as well. */
+#define HEAP_LINE_POINTER_SIZE 6
+#define HEAP_MAX_TUPLE (PAGE_SIZE - PAGE_DATA_OFFSET - HEAP_LINE_POINTER_SIZE)
+#define HEAP_MAX_PAGE_TUPLES ((PAGE_SIZE - PAGE_DATA_OFFSET) / HEAP_LINE_POINTER_SIZE)
+
+typedef struct {
+    pthread_mutex_t lock;
+    /* Keep neighbouring latches off each other's cache line. */
+    uint8_t padding[64];
+} HeapLatch;
+
+struct Heap {
+    HeapLatch latches[HEAP_LATCHES];
+};
+
+Heap* heap_create(void) {
+    Heap* heap = malloc(sizeof(Heap));
+    if (!heap) return NULL;
+
+    for (size_t i = 0; i < HEAP_LATCHES; i++) {
+        pthread_mutex_init(&heap->latches[i].lock, NULL);
+    }
+    return heap;
+}
+
+void heap_destroy(Heap* heap) {
+    if (!heap) return;
+    for (size_t i = 0; i < HEAP_LATCHES; i++) {
+        pthread_mutex_destroy(&heap->latches[i].lock);
+    }
+    free(heap);
+}
+
+static pthread_mutex_t* heap_latch(Heap* heap, uint32_t page_id) {
+    return &heap->latches[page_id % HEAP_LATCHES].lock;
+}
+
+/* Logs the n tuples just added to a page: a plain insert for one tuple,
+ * a MULTI insert otherwise. fragments has room for 1 + 2 * n entries.
+ * Returns 0 if the record could not be logged. */
+static uint64_t heap_log_insert(StorageHandle* handle, uint32_t page_id, bool fresh,
+                                const uint8_t* images, const WALTupleHeader* tuples, size_t n,
+                                WALFragment* fragments, uint64_t* end_lsn) {
+    WALEntry header;
+    memset(&header, 0, sizeof(WALEntry));
+    header.type = WAL_INSERT;
+    header.transaction_id = 1;
+
+    WALRedoHeader redo_header = { page_id, 0, fresh ? WAL_REDO_INIT_PAGE : 0 };
+    fragments[0].data = &redo_header;
+    fragments[0].len = sizeof(WALRedoHeader);
+    size_t count = 1;
+
+    if (n == 1) {
+        redo_header.slot = tuples[0].slot;
+        fragments[count].data = images;
+        fragments[count].len = tuples[0].length;
+        count++;
+    } else {
+        redo_header.flags |= WAL_REDO_MULTI;
+        for (size_t i = 0; i < n; i++) {
+            fragments[count].data = &tuples[i];
+            fragments[count].len = sizeof(WALTupleHeader);
+            count++;
+            fragments[count].data = images;
+            fragments[count].len = tuples[i].length;
+            count++;
+            images += tuples[i].length;
+        }
+    }
+
+    return wal_append_record(handle, &header, fragments, count, end_lsn);
+}
+
+/* Inserts count tuples stored back to back in data (tuple i is lens[i]
+ * bytes) and fills row_ids with their (page, slot) IDs. Each page gets
+ * one WAL record for all the tuples placed on it; *lsn_out receives the
+ * last record's LSN, for the caller to commit. A tuple must fit in an
+ * empty page. If a record cannot be logged, its page is put back the way
+ * it was and the insert fails; rows already placed on earlier pages
+ * stay, but are not committed. */
+StorageResult heap_insert(StorageHandle* handle, const uint8_t* data, const size_t* lens,
+                          size_t count, uint64_t* row_ids, uint64_t* lsn_out) {
+    PageManager* pm = handle->page_manager;
+
+    for (size_t i = 0; i < count; i++) {
+        if (lens[i] > HEAP_MAX_TUPLE) {
+            return STORAGE_ERROR;
+        }
+    }
+
+    size_t max_tuples = count < HEAP_MAX_PAGE_TUPLES ? count : HEAP_MAX_PAGE_TUPLES;
+    WALFragment* fragments = malloc((1 + 2 * max_tuples) * sizeof(WALFragment));
+    WALTupleHeader* tuples = malloc(max_tuples * sizeof(WALTupleHeader));
+    Page* saved = malloc(sizeof(Page));
+    if (!fragments || !tuples || !saved) {
+        free(fragments);
+        free(tuples);
+        free(saved);
+        return STORAGE_OOM;
+    }
+
+    StorageResult result = STORAGE_OK;
+    uint64_t lsn = 0;
+    size_t next = 0;
+    const uint8_t* image = data;
+    while (next < count) {
+        uint32_t page_id = page_manager_find_free_page(pm, lens[next] + HEAP_LINE_POINTER_SIZE);
+        if (page_id == UINT32_MAX) {
+            page_id = page_manager_extend(pm);
+            if (page_id == UINT32_MAX) {
+                result = STORAGE_IO_ERROR;
+                break;
+            }
+        }
+
+        pthread_mutex_t* latch = heap_latch(handle->heap, page_id);
+        pthread_mutex_lock(latch);
+        Page* page = buffer_pool_get_page(handle->buffer_pool, pm, page_id);
+        if (!page) {
+            pthread_mutex_unlock(latch);
+            result = STORAGE_IO_ERROR;
+            break;
+        }
+        buffer_pool_latch_page(handle->buffer_pool, page);
+        storage_put_page(handle, page);
+        page_begin_adds(page, saved);
+
+        /* A page without line pointers holds nothing redo could lose, so
+         * its record formats it: the page may exist only as an unsynced
+         * extension, also when its first record could not be logged. */
+        bool fresh = page->header.lower == PAGE_DATA_OFFSET;
+
+        /* A stale map entry can leave this at 0; the failed add has
+         * corrected the entry, so the next search looks elsewhere. */
+        size_t n = 0;
+        const uint8_t* images = image;
+        while (next + n < count && n < max_tuples) {
+            uint16_t length = (uint16_t)lens[next + n];
+            uint16_t slot;
+            if (page_add_tuple(pm, page, image, length, &slot) != STORAGE_OK) {
+                break;
+            }
+            tuples[n].slot = slot;
+            tuples[n].length = length;
+            image += length;
+            n++;
+        }
+
+        if (n > 0) {
+            uint64_t end_lsn;
+            uint64_t page_lsn = heap_log_insert(handle, page_id, fresh, images, tuples, n,
+                                                fragments, &end_lsn);
+            if (page_lsn == 0) {
+                page_undo_adds(pm, page, saved);
+                result = STORAGE_IO_ERROR;
+            } else {
+                page->header.lsn = end_lsn;
+                lsn = page_lsn;
+                for (size_t i = 0; i < n; i++) {
+                    row_ids[next + i] = STORAGE_ROW_ID(page_id, tuples[i].slot);
+                }
+                next += n;
+            }
+        }
+
+        buffer_pool_unlatch_page(handle->buffer_pool, page);
+        buffer_pool_unpin_page(handle->buffer_pool, page);
+        pthread_mutex_unlock(latch);
+        if (result != STORAGE_OK) {
+            break;
+        }
+    }
+
+    free(fragments);
+    free(tuples);
+    free(saved);
+    *lsn_out = lsn;
+    return result;
+}
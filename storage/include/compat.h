@@ -2,6 +2,9 @@
 #ifndef MINSQL_COMPAT_H
 #define MINSQL_COMPAT_H
 
+#include <stdint.h>
+#include <stdbool.h>
+
 #ifdef _WIN32
 
 #include <windows.h>
@@ -10,11 +13,16 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <direct.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 /* File operations */
 #define O_RDWR _O_RDWR
 #define O_CREAT _O_CREAT
 #define O_APPEND _O_APPEND
+#define O_RDONLY _O_RDONLY
+#define O_TRUNC _O_TRUNC
 
 #ifndef S_IRWXU
 #define S_IRWXU 0700
@@ -24,21 +32,133 @@
 #define close(fd) _close(fd)
 #define read(fd, buf, count) _read(fd, buf, (unsigned int)(count))
 #define write(fd, buf, count) _write(fd, buf, (unsigned int)(count))
-#define lseek(fd, offset, whence) _lseek(fd, (long)(offset), whence)
+#define lseek(fd, offset, whence) _lseeki64(fd, (__int64)(offset), whence)
 #define fsync(fd) _commit(fd)
+#define fdatasync(fd) _commit(fd)
 #define mkdir(path, mode) _mkdir(path)
+#define unlink(path) _unlink(path)
 
-typedef long off_t;
+/* The CRT's off_t is a 32-bit long, which would cap pages.dat at 2 GiB.
+ * A macro rather than a typedef, so the system headers above keep their
+ * own definition. */
+typedef int64_t minsql_off_t;
+#define off_t minsql_off_t
 typedef int ssize_t;
 
+/* Positional I/O through OVERLAPPED offsets; unlike lseek+read these do
+ * not touch a shared file position, so concurrent calls are safe. */
+static inline ssize_t pread(int fd, void* buf, size_t count, off_t offset) {
+    OVERLAPPED ov = {0};
+    DWORD done = 0;
+    ov.Offset = (DWORD)offset;
+    ov.OffsetHigh = (DWORD)((uint64_t)offset >> 32);
+    if (!ReadFile((HANDLE)_get_osfhandle(fd), buf, (DWORD)count, &done, &ov)) {
+        return GetLastError() == ERROR_HANDLE_EOF ? 0 : -1;
+    }
+    return (ssize_t)done;
+}
+
+static inline ssize_t pwrite(int fd, const void* buf, size_t count, off_t offset) {
+    OVERLAPPED ov = {0};
+    DWORD done = 0;
+    ov.Offset = (DWORD)offset;
+    ov.OffsetHigh = (DWORD)((uint64_t)offset >> 32);
+    if (!WriteFile((HANDLE)_get_osfhandle(fd), buf, (DWORD)count, &done, &ov)) {
+        return -1;
+    }
+    return (ssize_t)done;
+}
+
+#define sched_yield() SwitchToThread()
+
+/* Monotonic clock in nanoseconds, for cost accounting. */
+static inline uint64_t monotonic_ns(void) {
+    LARGE_INTEGER counter;
+    LARGE_INTEGER frequency;
+    QueryPerformanceCounter(&counter);
+    QueryPerformanceFrequency(&frequency);
+    return (uint64_t)((double)counter.QuadPart * 1e9 / (double)frequency.QuadPart);
+}
+
+/* Minimal dirent over FindFirstFile/FindNextFile. */
+struct dirent {
+    char d_name[MAX_PATH];
+};
+
+typedef struct {
+    HANDLE handle;
+    WIN32_FIND_DATAA data;
+    struct dirent entry;
+    bool first;
+} DIR;
+
+static inline DIR* opendir(const char* path) {
+    char pattern[MAX_PATH];
+    snprintf(pattern, sizeof(pattern), "%s\\*", path);
+    DIR* dir = malloc(sizeof(DIR));
+    if (!dir) return NULL;
+    dir->handle = FindFirstFileA(pattern, &dir->data);
+    if (dir->handle == INVALID_HANDLE_VALUE) {
+        free(dir);
+        return NULL;
+    }
+    dir->first = true;
+    return dir;
+}
+
+static inline struct dirent* readdir(DIR* dir) {
+    if (!dir->first && !FindNextFileA(dir->handle, &dir->data)) {
+        return NULL;
+    }
+    dir->first = false;
+    strncpy(dir->entry.d_name, dir->data.cFileName, MAX_PATH - 1);
+    dir->entry.d_name[MAX_PATH - 1] = '\0';
+    return &dir->entry;
+}
+
+static inline int closedir(DIR* dir) {
+    FindClose(dir->handle);
+    free(dir);
+    return 0;
+}
+
 /* pthread compatibility using Windows Critical Sections */
 typedef CRITICAL_SECTION pthread_mutex_t;
 
 #define pthread_mutex_init(mutex, attr) (InitializeCriticalSection(mutex), 0)
 #define pthread_mutex_destroy(mutex) DeleteCriticalSection(mutex)
 #define pthread_mutex_lock(mutex) EnterCriticalSection(mutex)
+#define pthread_mutex_trylock(mutex) (TryEnterCriticalSection(mutex) ? 0 : 1)
 #define pthread_mutex_unlock(mutex) LeaveCriticalSection(mutex)
 
+typedef CONDITION_VARIABLE pthread_cond_t;
+
+#define pthread_cond_init(cond, attr) (InitializeConditionVariable(cond), 0)
+#define pthread_cond_destroy(cond) ((void)(cond))
+#define pthread_cond_wait(cond, mutex) SleepConditionVariableCS(cond, mutex, INFINITE)
+#define pthread_cond_signal(cond) WakeConditionVariable(cond)
+#define pthread_cond_broadcast(cond) WakeAllConditionVariable(cond)
+
+static inline void pthread_cond_timedwait_ms(pthread_cond_t* cond, pthread_mutex_t* mutex,
+                                             unsigned ms) {
+    SleepConditionVariableCS(cond, mutex, ms);
+}
+
+typedef HANDLE pthread_t;
+
+static inline int pthread_create(pthread_t* thread, void* attr, void* (*fn)(void*), void* arg) {
+    (void)attr;
+    *thread = CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE)(void*)fn, arg, 0, NULL);
+    return *thread ? 0 : -1;
+}
+
+static inline int pthread_join(pthread_t thread, void** result) {
+    (void)result;
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+    return 0;
+}
+
 /* Memory mapping - use VirtualAlloc instead of mmap */
 #define PROT_READ  0x1
 #define PROT_WRITE 0x2
@@ -65,6 +185,121 @@ static inline int munmap(void* addr, size_t length) {
 #include <pthread.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sched.h>
+#include <dirent.h>
+
+#include <time.h>
+
+#if defined(__APPLE__)
+#define fdatasync(fd) fsync(fd)
+#endif
+
+/* Monotonic clock in nanoseconds, for cost accounting. */
+static inline uint64_t monotonic_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+/* Waits on cond for at most ms milliseconds. */
+static inline void pthread_cond_timedwait_ms(pthread_cond_t* cond, pthread_mutex_t* mutex,
+                                             unsigned ms) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += ms / 1000;
+    deadline.tv_nsec += (long)(ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+    pthread_cond_timedwait(cond, mutex, &deadline);
+}
+#endif
+
+/* Atomics used on lock-free fast paths. GCC and Clang (including MinGW)
+ * provide the __atomic builtins; MSVC gets the Interlocked intrinsics. */
+#if defined(_MSC_VER)
+#include <intrin.h>
+
+static inline uint8_t atomic_load_u8(volatile uint8_t* p) {
+    return (uint8_t)_InterlockedOr8((volatile char*)p, 0);
+}
+
+static inline void atomic_store_u8(volatile uint8_t* p, uint8_t v) {
+    _InterlockedExchange8((volatile char*)p, (char)v);
+}
+
+static inline uint16_t atomic_load_u16(volatile uint16_t* p) {
+    return (uint16_t)_InterlockedOr16((volatile short*)p, 0);
+}
+
+static inline uint16_t atomic_fetch_add_u16(volatile uint16_t* p, uint16_t v) {
+    return (uint16_t)_InterlockedExchangeAdd16((volatile short*)p, (short)v);
+}
+
+static inline bool atomic_cas_u16(volatile uint16_t* p, uint16_t expected, uint16_t desired) {
+    return _InterlockedCompareExchange16((volatile short*)p, (short)desired, (short)expected) == (short)expected;
+}
+
+static inline uint64_t atomic_load_u64(volatile uint64_t* p) {
+    return (uint64_t)_InterlockedOr64((volatile __int64*)p, 0);
+}
+
+static inline void atomic_store_u64(volatile uint64_t* p, uint64_t v) {
+    _InterlockedExchange64((volatile __int64*)p, (__int64)v);
+}
+
+static inline bool atomic_cas_u64(volatile uint64_t* p, uint64_t expected, uint64_t desired) {
+    return _InterlockedCompareExchange64((volatile __int64*)p, (__int64)desired, (__int64)expected) == (__int64)expected;
+}
+
+static inline uint64_t atomic_fetch_add_u64(volatile uint64_t* p, uint64_t v) {
+    return (uint64_t)_InterlockedExchangeAdd64((volatile __int64*)p, (__int64)v);
+}
+
+#else
+
+static inline uint8_t atomic_load_u8(volatile uint8_t* p) {
+    return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+static inline void atomic_store_u8(volatile uint8_t* p, uint8_t v) {
+    __atomic_store_n(p, v, __ATOMIC_RELEASE);
+}
+
+static inline uint16_t atomic_load_u16(volatile uint16_t* p) {
+    return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+static inline uint16_t atomic_fetch_add_u16(volatile uint16_t* p, uint16_t v) {
+    return __atomic_fetch_add(p, v, __ATOMIC_ACQ_REL);
+}
+
+static inline bool atomic_cas_u16(volatile uint16_t* p, uint16_t expected, uint16_t desired) {
+    return __atomic_compare_exchange_n(p, &expected, desired, false,
+                                       __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+/* The u64 helpers are sequentially consistent: the WAL's reservation
+ * protocol relies on a total order between slot advertisements and
+ * reservations. */
+static inline uint64_t atomic_load_u64(volatile uint64_t* p) {
+    return __atomic_load_n(p, __ATOMIC_SEQ_CST);
+}
+
+static inline void atomic_store_u64(volatile uint64_t* p, uint64_t v) {
+    __atomic_store_n(p, v, __ATOMIC_SEQ_CST);
+}
+
+static inline bool atomic_cas_u64(volatile uint64_t* p, uint64_t expected, uint64_t desired) {
+    return __atomic_compare_exchange_n(p, &expected, desired, false,
+                                       __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+static inline uint64_t atomic_fetch_add_u64(volatile uint64_t* p, uint64_t v) {
+    return __atomic_fetch_add(p, v, __ATOMIC_SEQ_CST);
+}
+
 #endif
 
 #endif /* MINSQL_COMPAT_H */
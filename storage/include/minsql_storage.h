@@ -22,6 +22,7 @@ typedef struct HashIndex HashIndex;
 typedef struct BloomFilter BloomFilter;
 typedef struct PageManager PageManager;
 typedef struct Arena Arena;
+typedef struct Heap Heap;
 
 typedef enum {
     WAL_INSERT = 1,
@@ -29,9 +30,21 @@ typedef enum {
     WAL_DELETE = 3,
     WAL_COMMIT = 4,
     WAL_ABORT = 5,
-    WAL_CHECKPOINT = 6
+    WAL_CHECKPOINT = 6,
+    WAL_SWITCH = 7          /* filler for the unused tail of a WAL segment */
 } WALEntryType;
 
+/* WALEntry.type holds a WALEntryType in its low byte and flags above it.
+ * A payload too large for one record is split across consecutive
+ * records: every one but the last is CONTINUED, every one but the first
+ * is a CONTINUATION. A COMPRESSED payload is the uncompressed length
+ * (uint32_t) followed by an LZ block; in a chain, every record has the
+ * flag and the chain's joined payloads form the compressed payload. */
+#define WAL_TYPE_MASK 0x00FF
+#define WAL_FLAG_CONTINUED 0x8000
+#define WAL_FLAG_CONTINUATION 0x4000
+#define WAL_FLAG_COMPRESSED 0x2000
+
 typedef enum {
     STORAGE_OK = 0,
     STORAGE_ERROR = 1,
@@ -40,6 +53,14 @@ typedef enum {
     STORAGE_CORRUPTION = 4
 } StorageResult;
 
+// Buffer pool replacement policies. CLOCK approximates LRU with a single
+// reference bit per frame; 2Q keeps pages seen once in a probationary FIFO
+// so sequential scans cannot evict the hot set.
+typedef enum {
+    BUFFER_POLICY_CLOCK = 0,
+    BUFFER_POLICY_2Q = 1
+} BufferReplacementPolicy;
+
 // PageHeader must be defined first since Page uses it
 typedef struct {
     uint32_t page_id;
@@ -51,23 +72,119 @@ typedef struct {
     uint64_t lsn;
 } PageHeader;
 
-// Page struct with full definition
+// Page struct with full definition. dirty, pin_count and frame_id are
+// buffer pool bookkeeping; they travel with the on-disk image but are
+// reset whenever a page is loaded into a frame.
 typedef struct Page {
     PageHeader header;
     bool dirty;
+    uint8_t reserved;
     uint16_t pin_count;
-    uint8_t data[PAGE_SIZE - sizeof(PageHeader) - sizeof(bool) - sizeof(uint16_t)];
+    uint32_t frame_id;
+    uint8_t data[PAGE_SIZE - sizeof(PageHeader) - 8];
 } Page;
 
+#define PAGE_DATA_OFFSET offsetof(Page, data)
+
 typedef struct {
     uint64_t lsn;
     uint32_t transaction_id;
     uint64_t logical_time;
     uint16_t type;
     uint16_t length;
+    uint32_t crc;           /* CRC32C of the header (crc zeroed) and payload */
     uint8_t data[];
 } WALEntry;
 
+/* Payload prefix of WAL_INSERT, WAL_UPDATE and WAL_DELETE records,
+ * followed by the tuple image for inserts and updates. Recovery redoes
+ * the change on page_id unless the page already reflects it; logical
+ * records that touch no page use WAL_NO_PAGE. */
+#define WAL_NO_PAGE UINT32_MAX
+
+typedef struct {
+    uint32_t page_id;
+    uint16_t slot;
+    uint16_t flags;
+} WALRedoHeader;
+
+/* WALRedoHeader.flags. INIT_PAGE marks the first insert into a page just
+ * added to the file: redo formats the page before applying it, as the
+ * extension may not have reached the disk. A MULTI insert carries
+ * several tuples for one page, each a WALTupleHeader and its image;
+ * WALRedoHeader.slot is then unused. */
+#define WAL_REDO_INIT_PAGE 0x0001
+#define WAL_REDO_MULTI 0x0002
+
+typedef struct {
+    uint16_t slot;
+    uint16_t length;
+} WALTupleHeader;
+
+/* Row IDs returned by storage_insert_row locate the row in the heap:
+ * the page in the high bits, the line pointer slot in the low 16. */
+#define STORAGE_ROW_ID(page_id, slot) (((uint64_t)(page_id) << 16) | (uint16_t)(slot))
+#define STORAGE_ROW_PAGE(row_id) ((uint32_t)((row_id) >> 16))
+#define STORAGE_ROW_SLOT(row_id) ((uint16_t)(row_id))
+
+/* One piece of a record payload for storage_wal_append_v. */
+typedef struct {
+    const void* data;
+    size_t len;
+} WALFragment;
+
+/* A dirty page table entry: the page and the LSN from which the log may
+ * hold changes that are not yet on disk (its recLSN). */
+typedef struct {
+    uint32_t page_id;
+    uint64_t rec_lsn;
+} DirtyPageEntry;
+
+/* Tunables for storage_init_ex. Start from storage_default_options and
+ * override what you need. Zero sizes fall back to the defaults; where
+ * zero means "off" instead, the field says so. */
+typedef struct {
+    size_t buffer_pool_bytes;       /* cache size in bytes; takes precedence over frames */
+    size_t buffer_pool_frames;      /* cache size in PAGE_SIZE frames */
+    size_t buffer_pool_partitions;  /* independently latched pool partitions */
+    BufferReplacementPolicy replacement_policy;
+    bool huge_pages;                /* back buffer frames with huge pages when available */
+    size_t arena_bytes;             /* scratch arena behind storage_arena_alloc */
+    size_t io_queue_depth;          /* io_uring depth for page I/O; 0 forces synchronous pread */
+    bool direct_io;                 /* open pages.dat with O_DIRECT, bypassing the OS page cache */
+    size_t wal_buffer_bytes;        /* WAL ring size, rounded up to a power of two */
+    size_t wal_writer_interval_ms;  /* background WAL flush period; 0 disables the writer */
+    size_t recovery_workers;        /* parallel redo threads; 1 redoes on the calling thread */
+    size_t wal_compression_threshold; /* compress WAL payloads at least this large; 0 disables */
+    bool page_compression;          /* store compressible pages compressed, punching holes in pages.dat */
+} StorageOptions;
+
+/* Cumulative counters since storage_init. A prefetched page counts as a
+ * prefetch hit on its first request and as unused if it is evicted
+ * before anyone asked for it. WAL compression ratio is
+ * wal_compress_input_bytes / wal_compress_output_bytes over the records
+ * logged compressed; wal_compress_ns also covers attempts that did not
+ * shrink the payload (those records are logged as is). The page_*
+ * counters do the same for page compression: output bytes are as
+ * written, rounded up to a filesystem block. */
+typedef struct {
+    uint64_t buffer_hits;
+    uint64_t buffer_misses;
+    uint64_t prefetch_issued;
+    uint64_t prefetch_hits;
+    uint64_t prefetch_unused;
+    uint64_t wal_compressed_records;
+    uint64_t wal_compress_input_bytes;
+    uint64_t wal_compress_output_bytes;
+    uint64_t wal_compress_ns;
+    uint64_t wal_decompress_ns;
+    uint64_t page_compressed_writes;
+    uint64_t page_compress_input_bytes;
+    uint64_t page_compress_output_bytes;
+    uint64_t page_compress_ns;
+    uint64_t page_decompress_ns;
+} StorageMetrics;
+
 /* StorageHandle struct - full definition for cross-file access */
 struct StorageHandle {
     char data_dir[256];
@@ -75,18 +192,28 @@ struct StorageHandle {
     PageManager* page_manager;
     WAL* wal;
     Arena* arena;
+    Heap* heap;
+    size_t recovery_workers;
 };
 
+void storage_default_options(StorageOptions* options);
 StorageHandle* storage_init(const char* data_dir);
+StorageHandle* storage_init_ex(const char* data_dir, const StorageOptions* options);
 void storage_shutdown(StorageHandle* handle);
 
 Page* storage_get_page(StorageHandle* handle, uint32_t page_id);
 StorageResult storage_put_page(StorageHandle* handle, Page* page);
 StorageResult storage_flush_page(StorageHandle* handle, Page* page);
 void storage_release_page(StorageHandle* handle, Page* page);
+size_t storage_prefetch_pages(StorageHandle* handle, uint32_t first_page, size_t count);
+void storage_get_metrics(StorageHandle* handle, StorageMetrics* metrics);
 
 uint64_t storage_wal_append(StorageHandle* handle, const WALEntry* entry);
+uint64_t storage_wal_append_v(StorageHandle* handle, const WALEntry* header,
+                              const WALFragment* fragments, size_t count);
 StorageResult storage_wal_flush(StorageHandle* handle);
+StorageResult storage_wal_commit(StorageHandle* handle, uint64_t lsn);
+uint32_t storage_crc32c(uint32_t crc, const void* data, size_t len);
 StorageResult storage_wal_replay(StorageHandle* handle);
 
 BTreeIndex* storage_create_btree(StorageHandle* handle, const char* name);
@@ -108,6 +235,7 @@ bool storage_bloom_might_contain(BloomFilter* filter, const void* key, size_t ke
 
 int storage_create_table(StorageHandle* handle, const char* table_name, const char* schema_json);
 int storage_insert_row(StorageHandle* handle, const char* table_name, const uint8_t* data, size_t data_len, uint64_t* row_id_out);
+int storage_insert_rows_batch(StorageHandle* handle, const char* table_name, const uint8_t* data, const size_t* row_lens, size_t count, uint64_t* row_ids_out);
 int storage_update_rows(StorageHandle* handle, const char* table_name, const char* predicate, const uint8_t* data, size_t data_len, size_t* count_out);
 int storage_delete_rows(StorageHandle* handle, const char* table_name, const char* predicate, size_t* count_out);
 
@@ -4,6 +4,7 @@
 #include <string.h>
 
 #define ARENA_CAPACITY (16 * 1024 * 1024)
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
 
 typedef struct Arena {
     uint8_t* base;
@@ -11,7 +12,10 @@ typedef struct Arena {
     size_t offset;
 } Arena;
 
-Arena* arena_create(size_t capacity) {
+/* huge_pages asks for an explicit hugetlb mapping first and falls back to
+ * ordinary pages (with a transparent huge page hint) when none are
+ * reserved. Either way the base is aligned to the OS page size. */
+Arena* arena_create_ex(size_t capacity, bool huge_pages) {
     Arena* arena = malloc(sizeof(Arena));
     if (!arena) return NULL;
 
@@ -19,10 +23,29 @@ Arena* arena_create(size_t capacity) {
         capacity = ARENA_CAPACITY;
     }
 
-    arena->base = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    arena->base = MAP_FAILED;
+#if defined(MAP_HUGETLB)
+    if (huge_pages) {
+        size_t huge_capacity = (capacity + HUGE_PAGE_SIZE - 1) & ~((size_t)HUGE_PAGE_SIZE - 1);
+        arena->base = mmap(NULL, huge_capacity, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (arena->base != MAP_FAILED) {
+            capacity = huge_capacity;
+        }
+    }
+#endif
+
     if (arena->base == MAP_FAILED) {
-        free(arena);
-        return NULL;
+        arena->base = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (arena->base == MAP_FAILED) {
+            free(arena);
+            return NULL;
+        }
+#if defined(MADV_HUGEPAGE)
+        if (huge_pages) {
+            madvise(arena->base, capacity, MADV_HUGEPAGE);
+        }
+#endif
     }
 
     arena->capacity = capacity;
@@ -31,6 +54,10 @@ Arena* arena_create(size_t capacity) {
     return arena;
 }
 
+Arena* arena_create(size_t capacity) {
+    return arena_create_ex(capacity, false);
+}
+
 void arena_destroy(Arena* arena) {
     if (!arena) return;
     munmap(arena->base, arena->capacity);
@@ -50,6 +77,21 @@ void* arena_alloc(Arena* arena, size_t size) {
     return ptr;
 }
 
+void* arena_alloc_aligned(Arena* arena, size_t size, size_t alignment) {
+    uintptr_t start = (uintptr_t)(arena->base + arena->offset);
+    size_t padding = (alignment - (start & (alignment - 1))) & (alignment - 1);
+
+    if (arena->offset + padding + size > arena->capacity) {
+        return NULL;
+    }
+
+    arena->offset += padding;
+    void* ptr = arena->base + arena->offset;
+    arena->offset += size;
+
+    return ptr;
+}
+
 void arena_reset(Arena* arena) {
     arena->offset = 0;
 }
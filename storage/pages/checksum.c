@@ -0,0 +1,189 @@
+#include "../include/minsql_storage.h"
+#include "../include/compat.h"
+#include <string.h>
+
+/* Page checksums. The page is read as rows of 64 words, and each of 64
+ * lanes folds in its column with an FNV-1a style step (xor, multiply,
+ * xor with a shift to pull high bits down). The lanes are independent,
+ * so the loop maps onto SIMD registers: x86-64 CPUs with AVX2 use a
+ * hand-vectorised version, chosen once on first use; elsewhere the
+ * plain loop is left to the compiler's vectoriser. Two rounds over zero
+ * words finish the mixing, the lanes are folded together and the page
+ * number is mixed in, so a page written to the wrong place fails too. */
+#define CHECKSUM_LANES 64
+#define CHECKSUM_ROWS (PAGE_SIZE / (CHECKSUM_LANES * sizeof(uint32_t)))
+#define CHECKSUM_FNV_PRIME 16777619U
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define CHECKSUM_HAVE_AVX2 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define CHECKSUM_TARGET_AVX2
+#else
+#define CHECKSUM_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+typedef void (*ChecksumRowsFn)(uint32_t* sums, const uint32_t* rows, size_t num_rows);
+
+static const uint32_t checksum_seeds[CHECKSUM_LANES] = {
+    0xA1B965F4, 0x8009454F, 0x724C81EC, 0x51A8749B,
+    0x747EA2EA, 0x1F4532E1, 0xC916AB3C, 0x41C98AC3,
+    0x368CB0A6, 0x3CB13D09, 0x055BDEF6, 0xE0BBDB7B,
+    0x983AA92F, 0x00CC4D19, 0x971D80AB, 0x75521255,
+    0x2B7F7F86, 0x83914F64, 0x5A4485AC, 0x100B9ED7,
+    0x1825F10D, 0x0DCA2F6A, 0x7BD2634C, 0xF5407269,
+    0xDB4C4F7B, 0x92233300, 0x7DE1D510, 0xB45C6316,
+    0x0F4D3872, 0x72F3454F, 0xA8E40225, 0x4963BAB0,
+    0x111AC529, 0x599DC6F7, 0x93D108C3, 0x81DAA383,
+    0xB43343A1, 0xCBE531DF, 0x24851729, 0xA792922A,
+    0x918175CE, 0x302278A8, 0x7019E937, 0x52EBF438,
+    0x0A691E37, 0x763E79AD, 0x743AAE49, 0xB1A1F2E1,
+    0x4F4F52DA, 0xA71A5EB1, 0xB6513356, 0xD4367D77,
+    0x23CE3C71, 0x0043C714, 0x844F1705, 0xDD9E0EC1,
+    0x82BB9698, 0xCBC87656, 0xA17B3C8F, 0x1D5C5D7B,
+    0x1CBBF170, 0x29A88F1D, 0xB8BB18FB, 0x6C6AD50E,
+};
+
+static void checksum_rows_generic(uint32_t* sums, const uint32_t* rows, size_t num_rows) {
+    for (size_t i = 0; i < num_rows; i++) {
+        for (size_t j = 0; j < CHECKSUM_LANES; j++) {
+            uint32_t tmp = sums[j] ^ rows[i * CHECKSUM_LANES + j];
+            sums[j] = (tmp * CHECKSUM_FNV_PRIME) ^ (tmp >> 17);
+        }
+    }
+}
+
+#if defined(CHECKSUM_HAVE_AVX2)
+#define CHECKSUM_STEP_AVX2(sum, row, k)                                                \
+    do {                                                                                \
+        __m256i tmp_ = _mm256_xor_si256(sum, _mm256_loadu_si256((row) + (k)));          \
+        sum = _mm256_xor_si256(_mm256_mullo_epi32(tmp_, prime), _mm256_srli_epi32(tmp_, 17)); \
+    } while (0)
+
+/* Eight registers of eight lanes, kept in named variables so they stay
+ * in registers; independent chains hide the multiply latency. */
+CHECKSUM_TARGET_AVX2
+static void checksum_rows_avx2(uint32_t* sums, const uint32_t* rows, size_t num_rows) {
+    const __m256i prime = _mm256_set1_epi32((int)CHECKSUM_FNV_PRIME);
+    const __m256i* in = (const __m256i*)sums;
+    __m256i s0 = _mm256_loadu_si256(in + 0);
+    __m256i s1 = _mm256_loadu_si256(in + 1);
+    __m256i s2 = _mm256_loadu_si256(in + 2);
+    __m256i s3 = _mm256_loadu_si256(in + 3);
+    __m256i s4 = _mm256_loadu_si256(in + 4);
+    __m256i s5 = _mm256_loadu_si256(in + 5);
+    __m256i s6 = _mm256_loadu_si256(in + 6);
+    __m256i s7 = _mm256_loadu_si256(in + 7);
+
+    for (size_t i = 0; i < num_rows; i++) {
+        const __m256i* row = (const __m256i*)(rows + i * CHECKSUM_LANES);
+        CHECKSUM_STEP_AVX2(s0, row, 0);
+        CHECKSUM_STEP_AVX2(s1, row, 1);
+        CHECKSUM_STEP_AVX2(s2, row, 2);
+        CHECKSUM_STEP_AVX2(s3, row, 3);
+        CHECKSUM_STEP_AVX2(s4, row, 4);
+        CHECKSUM_STEP_AVX2(s5, row, 5);
+        CHECKSUM_STEP_AVX2(s6, row, 6);
+        CHECKSUM_STEP_AVX2(s7, row, 7);
+    }
+
+    __m256i* out = (__m256i*)sums;
+    _mm256_storeu_si256(out + 0, s0);
+    _mm256_storeu_si256(out + 1, s1);
+    _mm256_storeu_si256(out + 2, s2);
+    _mm256_storeu_si256(out + 3, s3);
+    _mm256_storeu_si256(out + 4, s4);
+    _mm256_storeu_si256(out + 5, s5);
+    _mm256_storeu_si256(out + 6, s6);
+    _mm256_storeu_si256(out + 7, s7);
+}
+
+/* AVX2 needs the CPU feature and the OS saving YMM state. */
+static bool checksum_cpu_has_avx2(void) {
+#if defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 1);
+    if (!(info[2] & (1 << 27)) || (_xgetbv(0) & 6) != 6) {
+        return false;
+    }
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+#endif
+
+static void checksum_rows_resolve(uint32_t* sums, const uint32_t* rows, size_t num_rows);
+
+/* Racing first calls may both resolve; they pick the same function. */
+static volatile ChecksumRowsFn checksum_rows_impl = checksum_rows_resolve;
+
+static void checksum_rows_resolve(uint32_t* sums, const uint32_t* rows, size_t num_rows) {
+    ChecksumRowsFn fn = checksum_rows_generic;
+#if defined(CHECKSUM_HAVE_AVX2)
+    if (checksum_cpu_has_avx2()) {
+        fn = checksum_rows_avx2;
+    }
+#endif
+    checksum_rows_impl = fn;
+    fn(sums, rows, num_rows);
+}
+
+/* Checksum of the page image as stored at page_id. The checksum field
+ * and the buffer pool bookkeeping (dirty, pin_count, frame_id) change
+ * without the page's contents changing, so they hash as zero. Never 0,
+ * which marks a page written without a checksum. */
+uint32_t page_checksum(const Page* page, uint32_t page_id) {
+    uint32_t sums[CHECKSUM_LANES];
+    uint32_t first[CHECKSUM_LANES];
+    memcpy(sums, checksum_seeds, sizeof(sums));
+
+    memcpy(first, page, sizeof(first));
+    first[offsetof(PageHeader, checksum) / sizeof(uint32_t)] = 0;
+    first[offsetof(Page, dirty) / sizeof(uint32_t)] = 0;
+    first[offsetof(Page, frame_id) / sizeof(uint32_t)] = 0;
+
+    checksum_rows_impl(sums, first, 1);
+    checksum_rows_impl(sums, (const uint32_t*)page + CHECKSUM_LANES, CHECKSUM_ROWS - 1);
+
+    memset(first, 0, sizeof(first));
+    checksum_rows_impl(sums, first, 1);
+    checksum_rows_impl(sums, first, 1);
+
+    uint32_t result = page_id;
+    for (size_t j = 0; j < CHECKSUM_LANES; j++) {
+        result ^= sums[j];
+    }
+    return result != 0 ? result : 1;
+}
+
+/* Stamps the checksum on a page image about to be written. */
+void page_checksum_set(Page* page) {
+    page->header.checksum = page_checksum(page, page->header.page_id);
+}
+
+/* Folds the whole page rather than stopping at the first set word, so
+ * the loop vectorises. */
+static bool page_is_zero(const Page* page) {
+    const uint64_t* words = (const uint64_t*)page;
+    uint64_t bits = 0;
+    for (size_t i = 0; i < PAGE_SIZE / sizeof(uint64_t); i++) {
+        bits |= words[i];
+    }
+    return bits == 0;
+}
+
+/* Checks a page image just read from page_id. page_checksum never
+ * yields 0, so a 0 checksum passes only on a never-written page, which
+ * reads back as all zeros; anything else with it is damage that happens
+ * to have cleared the field. */
+bool page_checksum_verify(const Page* page, uint32_t page_id) {
+    if (page->header.checksum == 0) {
+        return page_is_zero(page);
+    }
+    return page->header.checksum == page_checksum(page, page_id);
+}
@@ -0,0 +1,302 @@
+#include "../include/minsql_storage.h"
+#include "../include/compat.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Free space map. Every heap page has a 4-bit category, its available
+ * space in FSM_CATEGORY_BYTES units rounded down, so category c promises
+ * at least c * FSM_CATEGORY_BYTES free bytes. Sixteen categories pack
+ * into a uint64_t, updated with CAS, and 1024 words form a chunk that is
+ * stored as one page of <data_dir>/fsm.dat.
+ *
+ * A summary level keeps, per block of FSM_BLOCK_PAGES pages, an upper
+ * bound on the block's highest category, so searches skip full blocks
+ * without reading them. Bounds are raised on update and lowered lazily
+ * by searches that find less than advertised.
+ *
+ * The map is a hint: it is not WAL-logged, pages it does not cover read
+ * as full, and staleness only costs space. Callers re-check the page,
+ * and the page operations record what they find. */
+#define FSM_FILE_NAME "fsm.dat"
+#define FSM_CATEGORY_BYTES (PAGE_SIZE / 16)
+#define FSM_MAX_CATEGORY 15
+#define FSM_PAGES_PER_WORD 16
+#define FSM_WORDS_PER_CHUNK (PAGE_SIZE / sizeof(uint64_t))
+#define FSM_PAGES_PER_CHUNK (FSM_WORDS_PER_CHUNK * FSM_PAGES_PER_WORD)
+#define FSM_BLOCK_PAGES 256
+#define FSM_BLOCK_WORDS (FSM_BLOCK_PAGES / FSM_PAGES_PER_WORD)
+#define FSM_BLOCKS_PER_CHUNK (FSM_PAGES_PER_CHUNK / FSM_BLOCK_PAGES)
+#define FSM_MAX_CHUNKS (((uint64_t)UINT32_MAX + 1) / FSM_PAGES_PER_CHUNK)
+#define FSM_NO_PAGE UINT32_MAX
+
+/* Inserters start from one of FSM_HINTS cursors, picked per thread, so
+ * concurrent inserters work on different pages instead of piling onto
+ * the first one with room. */
+#define FSM_HINTS 16
+
+#define FSM_NIBBLES_LOW 0x0F0F0F0F0F0F0F0FULL
+#define FSM_BYTES_ONE 0x0101010101010101ULL
+#define FSM_BYTES_HIGH 0x1010101010101010ULL
+
+typedef struct {
+    volatile uint64_t words[FSM_WORDS_PER_CHUNK];
+    volatile uint16_t summary[FSM_BLOCKS_PER_CHUNK];
+    volatile uint8_t dirty;
+} FSMChunk;
+
+typedef struct FreeSpaceMap FreeSpaceMap;
+
+struct FreeSpaceMap {
+    int fd;
+    /* Chunk addresses, allocated on first use and never moved. */
+    volatile uint64_t* chunks;
+    volatile uint64_t hints[FSM_HINTS];     /* last page found + 1; 0 unset */
+    pthread_mutex_t lock;                   /* chunk allocation and flushing */
+};
+
+static FSMChunk* fsm_chunk(FreeSpaceMap* fsm, uint64_t index, bool create) {
+    FSMChunk* chunk = (FSMChunk*)(uintptr_t)atomic_load_u64(&fsm->chunks[index]);
+    if (chunk || !create) {
+        return chunk;
+    }
+
+    pthread_mutex_lock(&fsm->lock);
+    chunk = (FSMChunk*)(uintptr_t)atomic_load_u64(&fsm->chunks[index]);
+    if (!chunk) {
+        chunk = calloc(1, sizeof(FSMChunk));
+        if (chunk) {
+            atomic_store_u64(&fsm->chunks[index], (uint64_t)(uintptr_t)chunk);
+        }
+    }
+    pthread_mutex_unlock(&fsm->lock);
+    return chunk;
+}
+
+static uint16_t fsm_word_max(uint64_t word) {
+    uint16_t max = 0;
+    for (int i = 0; i < FSM_PAGES_PER_WORD; i++) {
+        uint16_t category = (uint16_t)((word >> (i * 4)) & 0xF);
+        if (category > max) {
+            max = category;
+        }
+    }
+    return max;
+}
+
+/* True if any category in word is at least category (1..15): each
+ * nibble is widened to a byte and biased so that reaching category sets
+ * its bit 4. */
+static bool fsm_word_has(uint64_t word, uint16_t category) {
+    uint64_t bias = (uint64_t)(16 - category) * FSM_BYTES_ONE;
+    uint64_t even = word & FSM_NIBBLES_LOW;
+    uint64_t odd = (word >> 4) & FSM_NIBBLES_LOW;
+    return (((even + bias) | (odd + bias)) & FSM_BYTES_HIGH) != 0;
+}
+
+FreeSpaceMap* fsm_open(const char* data_dir) {
+    FreeSpaceMap* fsm = calloc(1, sizeof(FreeSpaceMap));
+    if (!fsm) return NULL;
+
+    fsm->chunks = calloc(FSM_MAX_CHUNKS, sizeof(uint64_t));
+    if (!fsm->chunks) {
+        free(fsm);
+        return NULL;
+    }
+
+    char path[300];
+    snprintf(path, sizeof(path), "%s/%s", data_dir, FSM_FILE_NAME);
+    fsm->fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fsm->fd < 0) {
+        free((void*)fsm->chunks);
+        free(fsm);
+        return NULL;
+    }
+    pthread_mutex_init(&fsm->lock, NULL);
+
+    /* A short or unreadable tail is left out: those pages read as full
+     * until their next change records them. */
+    off_t file_size = lseek(fsm->fd, 0, SEEK_END);
+    uint64_t num_chunks = (uint64_t)file_size / PAGE_SIZE;
+    if (num_chunks > FSM_MAX_CHUNKS) {
+        num_chunks = FSM_MAX_CHUNKS;
+    }
+    for (uint64_t i = 0; i < num_chunks; i++) {
+        FSMChunk* chunk = fsm_chunk(fsm, i, true);
+        if (!chunk) {
+            break;
+        }
+        if (pread(fsm->fd, (void*)chunk->words, PAGE_SIZE, (off_t)(i * PAGE_SIZE)) != PAGE_SIZE) {
+            memset((void*)chunk->words, 0, PAGE_SIZE);
+            break;
+        }
+        for (size_t b = 0; b < FSM_BLOCKS_PER_CHUNK; b++) {
+            uint16_t max = 0;
+            for (size_t w = 0; w < FSM_BLOCK_WORDS; w++) {
+                uint16_t word_max = fsm_word_max(chunk->words[b * FSM_BLOCK_WORDS + w]);
+                if (word_max > max) {
+                    max = word_max;
+                }
+            }
+            chunk->summary[b] = max;
+        }
+    }
+    return fsm;
+}
+
+/* Writes changed chunks to fsm.dat and syncs it. */
+StorageResult fsm_flush(FreeSpaceMap* fsm) {
+    uint64_t buffer[FSM_WORDS_PER_CHUNK];
+    StorageResult result = STORAGE_OK;
+    bool wrote = false;
+
+    pthread_mutex_lock(&fsm->lock);
+    for (uint64_t i = 0; i < FSM_MAX_CHUNKS; i++) {
+        FSMChunk* chunk = (FSMChunk*)(uintptr_t)fsm->chunks[i];
+        if (!chunk || !atomic_load_u8(&chunk->dirty)) {
+            continue;
+        }
+        /* Cleared before the snapshot, so a concurrent update marks the
+         * chunk dirty again for the next flush. */
+        atomic_store_u8(&chunk->dirty, 0);
+        for (size_t w = 0; w < FSM_WORDS_PER_CHUNK; w++) {
+            buffer[w] = atomic_load_u64(&chunk->words[w]);
+        }
+        if (pwrite(fsm->fd, buffer, PAGE_SIZE, (off_t)(i * PAGE_SIZE)) != PAGE_SIZE) {
+            atomic_store_u8(&chunk->dirty, 1);
+            result = STORAGE_IO_ERROR;
+        }
+        wrote = true;
+    }
+    if (wrote && result == STORAGE_OK && fdatasync(fsm->fd) != 0) {
+        result = STORAGE_IO_ERROR;
+    }
+    pthread_mutex_unlock(&fsm->lock);
+    return result;
+}
+
+void fsm_close(FreeSpaceMap* fsm) {
+    if (!fsm) return;
+    fsm_flush(fsm);
+    for (uint64_t i = 0; i < FSM_MAX_CHUNKS; i++) {
+        free((void*)(uintptr_t)fsm->chunks[i]);
+    }
+    free((void*)fsm->chunks);
+    pthread_mutex_destroy(&fsm->lock);
+    close(fsm->fd);
+    free(fsm);
+}
+
+/* Records that page_id has available bytes free. */
+void fsm_record(FreeSpaceMap* fsm, uint32_t page_id, size_t available) {
+    size_t category = available / FSM_CATEGORY_BYTES;
+    if (category > FSM_MAX_CATEGORY) {
+        category = FSM_MAX_CATEGORY;
+    }
+
+    FSMChunk* chunk = fsm_chunk(fsm, page_id / FSM_PAGES_PER_CHUNK, category > 0);
+    if (!chunk) {
+        return;     /* never recorded, so it already reads as full */
+    }
+
+    size_t index = page_id % FSM_PAGES_PER_CHUNK;
+    volatile uint64_t* word = &chunk->words[index / FSM_PAGES_PER_WORD];
+    unsigned shift = (unsigned)(index % FSM_PAGES_PER_WORD) * 4;
+    for (;;) {
+        uint64_t old = atomic_load_u64(word);
+        if (((old >> shift) & 0xF) == category) {
+            return;
+        }
+        uint64_t updated = (old & ~(0xFULL << shift)) | ((uint64_t)category << shift);
+        if (atomic_cas_u64(word, old, updated)) {
+            break;
+        }
+    }
+    atomic_store_u8(&chunk->dirty, 1);
+
+    volatile uint16_t* summary = &chunk->summary[index / FSM_BLOCK_PAGES];
+    for (;;) {
+        uint16_t bound = atomic_load_u16(summary);
+        if (bound >= category || atomic_cas_u16(summary, bound, (uint16_t)category)) {
+            break;
+        }
+    }
+}
+
+/* Scans one block, from page from on, for a page below num_pages of at
+ * least category. Lowers the block's bound if a full scan finds none. */
+static uint32_t fsm_search_block(FSMChunk* chunk, uint64_t block, uint16_t category,
+                                 uint64_t from, uint64_t num_pages) {
+    volatile uint16_t* summary = &chunk->summary[block % FSM_BLOCKS_PER_CHUNK];
+    uint16_t bound = atomic_load_u16(summary);
+    if (bound < category) {
+        return FSM_NO_PAGE;
+    }
+
+    uint64_t first_page = block * FSM_BLOCK_PAGES;
+    size_t first_word = (block % FSM_BLOCKS_PER_CHUNK) * FSM_BLOCK_WORDS;
+    size_t w = from > first_page ? (size_t)(from - first_page) / FSM_PAGES_PER_WORD : 0;
+    for (; w < FSM_BLOCK_WORDS; w++) {
+        uint64_t word = atomic_load_u64(&chunk->words[first_word + w]);
+        if (!fsm_word_has(word, category)) {
+            continue;
+        }
+        for (int i = 0; i < FSM_PAGES_PER_WORD; i++) {
+            uint64_t page = first_page + w * FSM_PAGES_PER_WORD + (uint64_t)i;
+            if (((word >> (i * 4)) & 0xF) >= category && page >= from && page < num_pages) {
+                return (uint32_t)page;
+            }
+        }
+    }
+
+    /* Racing updates may be lost here; that only hides free space until
+     * the page's next change. */
+    if (from <= first_page) {
+        atomic_cas_u16(summary, bound, (uint16_t)(category - 1));
+    }
+    return FSM_NO_PAGE;
+}
+
+/* Finds a page below num_pages with at least need bytes available, or
+ * returns FSM_NO_PAGE. Each thread resumes from its own cursor, so
+ * consecutive inserts by one thread fill one page while concurrent
+ * threads are spread over different ones. */
+uint32_t fsm_search(FreeSpaceMap* fsm, size_t need, uint32_t num_pages) {
+    size_t category = (need + FSM_CATEGORY_BYTES - 1) / FSM_CATEGORY_BYTES;
+    if (category == 0) {
+        category = 1;
+    }
+    if (category > FSM_MAX_CATEGORY || num_pages == 0) {
+        return FSM_NO_PAGE;
+    }
+
+    uint32_t probe = (uint32_t)((uintptr_t)&probe >> 12) * 0x9E3779B1U;
+    volatile uint64_t* hint = &fsm->hints[probe >> 28];
+    uint64_t start = atomic_load_u64(hint);
+    start = start > 0 ? start - 1 : (uint64_t)(probe >> 28) * num_pages / FSM_HINTS;
+    if (start >= num_pages) {
+        start = 0;
+    }
+
+    /* The first block is visited twice: from start on, and at the end
+     * of the wrap-around for the pages before start. */
+    uint64_t num_blocks = ((uint64_t)num_pages + FSM_BLOCK_PAGES - 1) / FSM_BLOCK_PAGES;
+    uint64_t first_block = start / FSM_BLOCK_PAGES;
+    for (uint64_t i = 0; i <= num_blocks; i++) {
+        uint64_t block = (first_block + i) % num_blocks;
+        FSMChunk* chunk = fsm_chunk(fsm, block / FSM_BLOCKS_PER_CHUNK, false);
+        if (!chunk) {
+            /* Skip the rest of a chunk that was never recorded. */
+            uint64_t next = (block / FSM_BLOCKS_PER_CHUNK + 1) * FSM_BLOCKS_PER_CHUNK;
+            i += (next < num_blocks ? next : num_blocks) - block - 1;
+            continue;
+        }
+        uint64_t from = i == 0 ? start : 0;
+        uint32_t page = fsm_search_block(chunk, block, (uint16_t)category, from, num_pages);
+        if (page != FSM_NO_PAGE) {
+            atomic_store_u64(hint, (uint64_t)page + 1);
+            return page;
+        }
+    }
+    return FSM_NO_PAGE;
+}
@@ -0,0 +1,417 @@
+#include "../include/minsql_storage.h"
+#include "../include/compat.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+/* Asynchronous page I/O. On Linux the reads and writes are queued on an
+ * io_uring instance (driven with raw syscalls, so no liburing dependency)
+ * and many can be in flight at once. Everywhere else, or when the kernel
+ * refuses to create a ring or lacks IORING_OP_READ/WRITE (before 5.6),
+ * each request is served synchronously with pread/pwrite and its
+ * callback runs before submission returns. */
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define MINSQL_HAVE_IO_URING 1
+#endif
+#endif
+
+#ifdef MINSQL_HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+
+typedef void (*PageIOCallback)(void* ctx, Page* page, StorageResult result);
+/* Validates (and may rewrite) a frame a read has just filled. */
+typedef StorageResult (*PageIOReadCheck)(void* ctx, Page* page, uint32_t page_id);
+
+typedef struct PageIORequest {
+    Page* page;
+    bool is_write;
+    uint32_t page_id;
+    size_t len;
+    PageIOCallback callback;
+    void* ctx;
+    struct PageIORequest* next_free;
+} PageIORequest;
+
+typedef struct PageIO {
+    int fd;
+    bool async;
+    pthread_mutex_t lock;
+    PageIOReadCheck check;
+    void* check_ctx;
+
+    PageIORequest* requests;
+    PageIORequest* free_requests;
+    unsigned depth;
+    unsigned in_flight;
+    unsigned callbacks_running;
+
+#ifdef MINSQL_HAVE_IO_URING
+    int ring_fd;
+    void* sq_ring;
+    void* cq_ring;
+    size_t sq_ring_size;
+    size_t cq_ring_size;
+    struct io_uring_sqe* sqes;
+    size_t sqes_size;
+
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_cqe* cqes;
+    unsigned pending_submit;
+#endif
+} PageIO;
+
+/* Outcome of a request for len bytes that transferred done. A read also
+ * has to pass the read check; the page id is the one the frame was read
+ * for. */
+static StorageResult page_io_result(PageIO* io, bool is_write, Page* page, uint32_t page_id,
+                                    size_t len, ssize_t done) {
+    if (done < 0 || (size_t)done != len) {
+        return STORAGE_IO_ERROR;
+    }
+    if (!is_write) {
+        return io->check(io->check_ctx, page, page_id);
+    }
+    return STORAGE_OK;
+}
+
+#ifdef MINSQL_HAVE_IO_URING
+
+static int io_uring_setup_raw(unsigned entries, struct io_uring_params* params) {
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int io_uring_enter_raw(int ring_fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int io_uring_register_raw(int ring_fd, unsigned opcode, void* arg, unsigned nr_args) {
+    return (int)syscall(__NR_io_uring_register, ring_fd, opcode, arg, nr_args);
+}
+
+/* Kernels 5.1 to 5.5 create rings but only know the vectored opcodes.
+ * The probe arrived in 5.6 along with IORING_OP_READ and IORING_OP_WRITE,
+ * so a ring that cannot be probed lacks them as well. */
+static bool page_io_ring_supports_rw(int ring_fd) {
+    unsigned num_ops = IORING_OP_WRITE + 1;
+    struct io_uring_probe* probe =
+        calloc(1, sizeof(struct io_uring_probe) + num_ops * sizeof(struct io_uring_probe_op));
+    if (!probe) {
+        return false;
+    }
+
+    bool supported = false;
+    if (io_uring_register_raw(ring_fd, IORING_REGISTER_PROBE, probe, num_ops) == 0 &&
+        probe->last_op >= IORING_OP_WRITE) {
+        supported = (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED) &&
+                    (probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED);
+    }
+    free(probe);
+    return supported;
+}
+
+static bool page_io_ring_init(PageIO* io) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    io->ring_fd = io_uring_setup_raw(io->depth, &params);
+    if (io->ring_fd < 0) {
+        return false;
+    }
+    if (!page_io_ring_supports_rw(io->ring_fd)) {
+        close(io->ring_fd);
+        return false;
+    }
+
+    io->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    io->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (io->cq_ring_size > io->sq_ring_size) {
+            io->sq_ring_size = io->cq_ring_size;
+        }
+        io->cq_ring_size = io->sq_ring_size;
+    }
+
+    io->sq_ring = mmap(NULL, io->sq_ring_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, io->ring_fd, IORING_OFF_SQ_RING);
+    if (io->sq_ring == MAP_FAILED) {
+        close(io->ring_fd);
+        return false;
+    }
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        io->cq_ring = io->sq_ring;
+    } else {
+        io->cq_ring = mmap(NULL, io->cq_ring_size, PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_POPULATE, io->ring_fd, IORING_OFF_CQ_RING);
+        if (io->cq_ring == MAP_FAILED) {
+            munmap(io->sq_ring, io->sq_ring_size);
+            close(io->ring_fd);
+            return false;
+        }
+    }
+
+    io->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    io->sqes = mmap(NULL, io->sqes_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, io->ring_fd, IORING_OFF_SQES);
+    if (io->sqes == MAP_FAILED) {
+        if (io->cq_ring != io->sq_ring) {
+            munmap(io->cq_ring, io->cq_ring_size);
+        }
+        munmap(io->sq_ring, io->sq_ring_size);
+        close(io->ring_fd);
+        return false;
+    }
+
+    uint8_t* sq = io->sq_ring;
+    uint8_t* cq = io->cq_ring;
+    io->sq_head = (unsigned*)(sq + params.sq_off.head);
+    io->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+    io->sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+    io->sq_array = (unsigned*)(sq + params.sq_off.array);
+    io->cq_head = (unsigned*)(cq + params.cq_off.head);
+    io->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+    io->cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+    io->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+    io->pending_submit = 0;
+
+    /* The ring can hold more than we asked for; never queue more requests
+     * than the completion ring is guaranteed to absorb. */
+    if (io->depth > params.sq_entries) {
+        io->depth = params.sq_entries;
+    }
+    return true;
+}
+
+static void page_io_ring_release(PageIO* io) {
+    munmap(io->sqes, io->sqes_size);
+    if (io->cq_ring != io->sq_ring) {
+        munmap(io->cq_ring, io->cq_ring_size);
+    }
+    munmap(io->sq_ring, io->sq_ring_size);
+    close(io->ring_fd);
+}
+
+static void page_io_ring_queue(PageIO* io, uint8_t opcode, PageIORequest* req, off_t offset) {
+    unsigned tail = *io->sq_tail;
+    unsigned idx = tail & *io->sq_mask;
+
+    struct io_uring_sqe* sqe = &io->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = io->fd;
+    sqe->addr = (uint64_t)(uintptr_t)req->page;
+    sqe->len = (uint32_t)req->len;
+    sqe->off = (uint64_t)offset;
+    sqe->user_data = (uint64_t)(uintptr_t)req;
+
+    io->sq_array[idx] = idx;
+    __atomic_store_n(io->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    io->pending_submit++;
+}
+
+/* Submits queued entries and reaps completions, blocking until at least
+ * min_complete have arrived. Callbacks run with io->lock released. */
+static size_t page_io_ring_reap(PageIO* io, unsigned min_complete) {
+    unsigned flags = min_complete > 0 ? IORING_ENTER_GETEVENTS : 0;
+    unsigned to_submit = io->pending_submit;
+
+    if (to_submit > 0 || min_complete > 0) {
+        int ret;
+        do {
+            ret = io_uring_enter_raw(io->ring_fd, to_submit, min_complete, flags);
+        } while (ret < 0 && errno == EINTR);
+        if (ret >= 0) {
+            io->pending_submit -= (unsigned)ret < to_submit ? (unsigned)ret : to_submit;
+        }
+    }
+
+    /* Re-read the head every pass: while a callback runs unlocked another
+     * thread may reap further entries. */
+    size_t reaped = 0;
+    unsigned head;
+    while ((head = *io->cq_head) != __atomic_load_n(io->cq_tail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe* cqe = &io->cqes[head & *io->cq_mask];
+        PageIORequest* req = (PageIORequest*)(uintptr_t)cqe->user_data;
+        ssize_t done = cqe->res;
+        __atomic_store_n(io->cq_head, head + 1, __ATOMIC_RELEASE);
+
+        PageIOCallback callback = req->callback;
+        void* ctx = req->ctx;
+        Page* page = req->page;
+        bool is_write = req->is_write;
+        uint32_t page_id = req->page_id;
+        size_t len = req->len;
+        req->next_free = io->free_requests;
+        io->free_requests = req;
+        io->in_flight--;
+        reaped++;
+
+        /* Only the callback sees the result, so the read is checked
+         * (and decompressed) outside the lock along with it. */
+        if (callback) {
+            io->callbacks_running++;
+            pthread_mutex_unlock(&io->lock);
+            callback(ctx, page, page_io_result(io, is_write, page, page_id, len, done));
+            pthread_mutex_lock(&io->lock);
+            io->callbacks_running--;
+        }
+    }
+    return reaped;
+}
+
+#endif
+
+PageIO* page_io_create(int fd, unsigned depth, PageIOReadCheck check, void* check_ctx) {
+    PageIO* io = calloc(1, sizeof(PageIO));
+    if (!io) return NULL;
+
+    io->fd = fd;
+    io->check = check;
+    io->check_ctx = check_ctx;
+    io->depth = depth;
+    io->async = false;
+
+#ifdef MINSQL_HAVE_IO_URING
+    if (depth > 0 && page_io_ring_init(io)) {
+        io->requests = calloc(io->depth, sizeof(PageIORequest));
+        if (io->requests) {
+            io->async = true;
+        } else {
+            page_io_ring_release(io);
+        }
+    }
+#endif
+
+    for (unsigned i = 0; io->async && i < io->depth; i++) {
+        io->requests[i].next_free = io->free_requests;
+        io->free_requests = &io->requests[i];
+    }
+
+    pthread_mutex_init(&io->lock, NULL);
+    return io;
+}
+
+void page_io_destroy(PageIO* io) {
+    if (!io) return;
+
+#ifdef MINSQL_HAVE_IO_URING
+    if (io->async) {
+        pthread_mutex_lock(&io->lock);
+        while (io->in_flight > 0) {
+            page_io_ring_reap(io, 1);
+        }
+        pthread_mutex_unlock(&io->lock);
+        page_io_ring_release(io);
+    }
+#endif
+
+    pthread_mutex_destroy(&io->lock);
+    free(io->requests);
+    free(io);
+}
+
+bool page_io_is_async(PageIO* io) {
+    return io->async;
+}
+
+static StorageResult page_io_submit(PageIO* io, bool is_write, uint32_t page_id, Page* page,
+                                    size_t len, PageIOCallback callback, void* ctx) {
+    off_t offset = (off_t)page_id * PAGE_SIZE;
+    if (!io->async) {
+        ssize_t done = is_write ? pwrite(io->fd, page, len, offset)
+                                : pread(io->fd, page, len, offset);
+        StorageResult result = page_io_result(io, is_write, page, page_id, len, done);
+        /* A request the callback has seen is accepted, as on the async
+         * path: the callback reports the failure, and returning it as
+         * well would have the caller clean up a second time. */
+        if (callback) {
+            callback(ctx, page, result);
+            return STORAGE_OK;
+        }
+        return result;
+    }
+
+#ifdef MINSQL_HAVE_IO_URING
+    pthread_mutex_lock(&io->lock);
+
+    /* Queue depth exhausted: push what we have and wait for a slot. */
+    while (!io->free_requests) {
+        page_io_ring_reap(io, 1);
+    }
+
+    PageIORequest* req = io->free_requests;
+    io->free_requests = req->next_free;
+    req->page = page;
+    req->is_write = is_write;
+    req->page_id = page_id;
+    req->len = len;
+    req->callback = callback;
+    req->ctx = ctx;
+    io->in_flight++;
+
+    page_io_ring_queue(io, is_write ? IORING_OP_WRITE : IORING_OP_READ, req, offset);
+    if (io->pending_submit >= io->depth / 2) {
+        page_io_ring_reap(io, 0);
+    }
+
+    pthread_mutex_unlock(&io->lock);
+#endif
+    return STORAGE_OK;
+}
+
+/* Queues a read of page_id into frame. The callback fires once the read
+ * completes, possibly on the thread that later calls page_io_wait. */
+StorageResult page_io_read(PageIO* io, uint32_t page_id, Page* frame,
+                           PageIOCallback callback, void* ctx) {
+    return page_io_submit(io, false, page_id, frame, PAGE_SIZE, callback, ctx);
+}
+
+/* Queues a write of the first len bytes of page to page_id's slot; len
+ * is less than PAGE_SIZE for a compressed image. */
+StorageResult page_io_write(PageIO* io, uint32_t page_id, Page* page, size_t len,
+                            PageIOCallback callback, void* ctx) {
+    return page_io_submit(io, true, page_id, page, len, callback, ctx);
+}
+
+/* Pushes queued requests to the kernel and reaps whatever has finished
+ * without blocking. */
+void page_io_poll(PageIO* io) {
+#ifdef MINSQL_HAVE_IO_URING
+    if (io->async) {
+        pthread_mutex_lock(&io->lock);
+        page_io_ring_reap(io, 0);
+        pthread_mutex_unlock(&io->lock);
+    }
+#endif
+}
+
+/* Blocks until every request submitted so far has completed and its
+ * callback has run. */
+void page_io_wait(PageIO* io) {
+#ifdef MINSQL_HAVE_IO_URING
+    if (io->async) {
+        pthread_mutex_lock(&io->lock);
+        while (io->in_flight > 0) {
+            page_io_ring_reap(io, 1);
+        }
+        /* Another thread may still be inside a callback it reaped. */
+        while (io->callbacks_running > 0) {
+            pthread_mutex_unlock(&io->lock);
+            sched_yield();
+            pthread_mutex_lock(&io->lock);
+        }
+        pthread_mutex_unlock(&io->lock);
+    }
+#endif
+}
@@ -1,174 +1,827 @@
+/* O_DIRECT and fallocate's hole punching are GNU extensions in glibc's
+ * <fcntl.h>. */
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
 #include "../include/minsql_storage.h"
 #include "../include/compat.h"
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+/* Upper bound on pages staged and written together. */
+#define PAGE_WRITE_RUN_MAX 64
+
+/* Alignment of the staging buffer for single-page writes, enough for
+ * direct I/O. */
+#define PAGE_IO_ALIGN 4096
+
+typedef struct PageIO PageIO;
+typedef void (*PageIOCallback)(void* ctx, Page* page, StorageResult result);
+typedef void (*PageLatchFn)(void* ctx, Page* page);
+typedef StorageResult (*PageIOReadCheck)(void* ctx, Page* page, uint32_t page_id);
+
+extern PageIO* page_io_create(int fd, unsigned depth, PageIOReadCheck check, void* check_ctx);
+extern void page_io_destroy(PageIO* io);
+extern bool page_io_is_async(PageIO* io);
+extern StorageResult page_io_read(PageIO* io, uint32_t page_id, Page* frame,
+                                  PageIOCallback callback, void* ctx);
+extern StorageResult page_io_write(PageIO* io, uint32_t page_id, Page* page, size_t len,
+                                   PageIOCallback callback, void* ctx);
+extern void page_io_poll(PageIO* io);
+extern void page_io_wait(PageIO* io);
+
+extern void page_checksum_set(Page* page);
+extern bool page_checksum_verify(const Page* page, uint32_t page_id);
+
+extern size_t lz_compress(const void* src, size_t len, void* dst, size_t cap);
+extern bool lz_decompress(const void* src, size_t len, void* dst, size_t out_len);
+
+typedef struct FreeSpaceMap FreeSpaceMap;
+
+extern FreeSpaceMap* fsm_open(const char* data_dir);
+extern void fsm_close(FreeSpaceMap* fsm);
+extern StorageResult fsm_flush(FreeSpaceMap* fsm);
+extern void fsm_record(FreeSpaceMap* fsm, uint32_t page_id, size_t available);
+extern uint32_t fsm_search(FreeSpaceMap* fsm, size_t need, uint32_t num_pages);
+
 typedef struct {
     uint16_t offset;
     uint16_t length;
     uint16_t flags;
 } LinePointer;
 
+/* Line pointer states. A deleted tuple's pointer is DEAD and its bytes
+ * stay put until the page is compacted, which slides live tuples up
+ * against the end of the page and turns DEAD pointers into UNUSED ones
+ * for later inserts to reuse. Slot numbers never change, so a tuple
+ * keeps its slot across compactions. */
+#define LP_NORMAL 0x00
+#define LP_DEAD 0x01
+#define LP_UNUSED 0x02
+
+/* PageHeader.flags hints, so inserts only scan line pointers or compact
+ * when it can pay off. */
+#define PAGE_HAS_GARBAGE 0x0001     /* dead tuples or shrunk images to reclaim */
+#define PAGE_HAS_FREE_LINES 0x0002  /* may hold UNUSED line pointers */
+
+/* A compressed page starts with this header in place of the page id,
+ * which no real page can have, followed by the LZ block. The image is
+ * padded with zeros to a filesystem block and the rest of the page's
+ * slot in pages.dat is a hole. The checksum is stamped on the page
+ * before it is compressed and verified after it is decompressed. */
+#define PAGE_COMPRESSED_MARKER UINT32_MAX
+
+typedef struct {
+    uint32_t marker;
+    uint32_t length;
+} PageCompressedHeader;
+
 /* PageManager struct definition */
 struct PageManager {
     int fd;
     char filepath[256];
     uint32_t num_pages;
+    PageIO* io;
+    /* Set when pages.dat bypasses the OS page cache. Every buffer handed
+     * to the file must then be PAGE_SIZE aligned; buffer pool frames
+     * already are, and extension goes through extend_buf. */
+    bool direct_io;
+    uint8_t* extend_buf;
+    /* Page reads and writes use positional I/O and need no lock; only
+     * extending the file has to be serialised. */
+    pthread_mutex_t extend_lock;
+    /* Free space per page, kept current by the tuple operations. */
+    FreeSpaceMap* fsm;
+    /* Set when page_compression is on and the filesystem can punch
+     * holes; cleared if punching later turns out to be unsupported.
+     * Pages that do not save at least one block_size are stored raw. */
+    volatile bool compress;
+    size_t block_size;
+    volatile uint64_t compressed_writes;
+    volatile uint64_t compress_input_bytes;
+    volatile uint64_t compress_output_bytes;
+    volatile uint64_t compress_ns;
+    volatile uint64_t decompress_ns;
+    /* Take and drop the lock that changes to a page are made under, so
+     * a write never copies half a change. Unset, pages are copied as
+     * they are. */
+    PageLatchFn latch;
+    PageLatchFn unlatch;
+    void* latch_ctx;
 };
 
-PageManager* page_manager_create(const char* data_dir) {
-    PageManager* pm = malloc(sizeof(PageManager));
+/* Opens pages.dat, bypassing the page cache when asked. Filesystems that
+ * reject O_DIRECT (tmpfs, some network mounts) fall back to buffered I/O
+ * rather than failing startup. */
+static int page_manager_open(PageManager* pm, bool direct_io) {
+    pm->direct_io = false;
+#if defined(O_DIRECT)
+    if (direct_io) {
+        int fd = open(pm->filepath, O_RDWR | O_CREAT | O_DIRECT, 0644);
+        if (fd >= 0) {
+            pm->direct_io = true;
+            return fd;
+        }
+        if (errno != EINVAL) {
+            return -1;
+        }
+    }
+#endif
+
+    int fd = open(pm->filepath, O_RDWR | O_CREAT, 0644);
+#if !defined(O_DIRECT) && defined(F_NOCACHE)
+    if (fd >= 0 && direct_io && fcntl(fd, F_NOCACHE, 1) == 0) {
+        pm->direct_io = true;
+    }
+#endif
+    return fd;
+}
+
+static StorageResult page_manager_check_read(void* ctx, Page* page, uint32_t page_id);
+
+/* Compression needs holes of whole filesystem blocks inside a page. */
+static void page_manager_setup_compression(PageManager* pm, bool compress) {
+    pm->compress = false;
+    pm->block_size = PAGE_SIZE;
+#if defined(FALLOC_FL_PUNCH_HOLE)
+    struct stat st;
+    if (compress && fstat(pm->fd, &st) == 0 && st.st_blksize >= 512 &&
+        st.st_blksize < PAGE_SIZE && PAGE_SIZE % st.st_blksize == 0) {
+        pm->block_size = (size_t)st.st_blksize;
+        pm->compress = true;
+    }
+#else
+    (void)compress;
+#endif
+}
+
+PageManager* page_manager_create(const char* data_dir, unsigned io_queue_depth, bool direct_io,
+                                 bool compress) {
+    PageManager* pm = calloc(1, sizeof(PageManager));
     if (!pm) return NULL;
 
     snprintf(pm->filepath, sizeof(pm->filepath), "%s/pages.dat", data_dir);
     
-    pm->fd = open(pm->filepath, O_RDWR | O_CREAT, 0644);
+    pm->fd = page_manager_open(pm, direct_io);
     if (pm->fd < 0) {
         free(pm);
         return NULL;
     }
 
+    pm->extend_buf = NULL;
+    if (pm->direct_io) {
+        void* buf = mmap(NULL, PAGE_SIZE, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (buf == MAP_FAILED) {
+            close(pm->fd);
+            free(pm);
+            return NULL;
+        }
+        pm->extend_buf = buf;
+    }
+
+    page_manager_setup_compression(pm, compress);
+
+    pm->io = page_io_create(pm->fd, io_queue_depth, page_manager_check_read, pm);
+    if (!pm->io) {
+        if (pm->extend_buf) munmap(pm->extend_buf, PAGE_SIZE);
+        close(pm->fd);
+        free(pm);
+        return NULL;
+    }
+
+    pm->fsm = fsm_open(data_dir);
+    if (!pm->fsm) {
+        page_io_destroy(pm->io);
+        if (pm->extend_buf) munmap(pm->extend_buf, PAGE_SIZE);
+        close(pm->fd);
+        free(pm);
+        return NULL;
+    }
+
     off_t file_size = lseek(pm->fd, 0, SEEK_END);
     pm->num_pages = file_size / PAGE_SIZE;
+    pthread_mutex_init(&pm->extend_lock, NULL);
 
     return pm;
 }
 
 void page_manager_destroy(PageManager* pm) {
     if (!pm) return;
+    fsm_close(pm->fsm);
+    page_io_destroy(pm->io);
+    pthread_mutex_destroy(&pm->extend_lock);
+    if (pm->extend_buf) munmap(pm->extend_buf, PAGE_SIZE);
     close(pm->fd);
     free(pm);
 }
 
-Page* page_manager_read(PageManager* pm, uint32_t page_id) {
-    if (page_id >= pm->num_pages) {
-        return NULL;
-    }
-
-    Page* page = malloc(sizeof(Page));
-    if (!page) return NULL;
+/* Installs the latch page writes take while copying a page; the buffer
+ * pool, which owns the frames, provides it. */
+void page_manager_attach_latch(PageManager* pm, PageLatchFn latch, PageLatchFn unlatch,
+                               void* ctx) {
+    pm->latch = latch;
+    pm->unlatch = unlatch;
+    pm->latch_ctx = ctx;
+}
 
-    off_t offset = page_id * PAGE_SIZE;
-    if (lseek(pm->fd, offset, SEEK_SET) != offset) {
-        free(page);
-        return NULL;
+/* Reads page_id straight into a caller-owned frame, so the buffer pool's
+ * miss path does no allocation. */
+StorageResult page_manager_read(PageManager* pm, uint32_t page_id, Page* page) {
+    if (page_id >= pm->num_pages) {
+        return STORAGE_ERROR;
     }
 
-    ssize_t bytes_read = read(pm->fd, page, PAGE_SIZE);
+    off_t offset = (off_t)page_id * PAGE_SIZE;
+    ssize_t bytes_read = pread(pm->fd, page, PAGE_SIZE, offset);
     if (bytes_read != PAGE_SIZE) {
-        free(page);
-        return NULL;
+        return STORAGE_IO_ERROR;
+    }
+    StorageResult result = page_manager_check_read(pm, page, page_id);
+    if (result != STORAGE_OK) {
+        return result;
     }
 
     page->dirty = false;
     page->pin_count = 1;
 
-    return page;
+    return STORAGE_OK;
+}
+
+/* Replaces a staged page with its compressed image when that saves at
+ * least one filesystem block. Returns the number of bytes to write. */
+static size_t page_compress(PageManager* pm, Page* copy) {
+    uint8_t packed[PAGE_SIZE];
+    size_t cap = PAGE_SIZE - pm->block_size - sizeof(PageCompressedHeader);
+
+    uint64_t started = monotonic_ns();
+    size_t len = lz_compress(copy, PAGE_SIZE, packed, cap);
+    atomic_fetch_add_u64(&pm->compress_ns, monotonic_ns() - started);
+    if (len == 0) {
+        return PAGE_SIZE;
+    }
+
+    size_t used = sizeof(PageCompressedHeader) + len;
+    size_t stored = (used + pm->block_size - 1) / pm->block_size * pm->block_size;
+    PageCompressedHeader* header = (PageCompressedHeader*)copy;
+    header->marker = PAGE_COMPRESSED_MARKER;
+    header->length = (uint32_t)len;
+    memcpy(header + 1, packed, len);
+    memset((uint8_t*)copy + used, 0, stored - used);
+
+    atomic_fetch_add_u64(&pm->compressed_writes, 1);
+    atomic_fetch_add_u64(&pm->compress_input_bytes, PAGE_SIZE);
+    atomic_fetch_add_u64(&pm->compress_output_bytes, stored);
+    return stored;
 }
 
+/* Pages are written from a checksummed copy. The page may change while
+ * its write is in flight, and the checksum has to match the bytes that
+ * reach the disk. The copy is taken under the page's latch. Returns the
+ * length of the image, which is shorter than a page if it was
+ * compressed. */
+static size_t page_stage(PageManager* pm, Page* copy, Page* page) {
+    if (pm->latch) {
+        pm->latch(pm->latch_ctx, page);
+    }
+    memcpy(copy, page, PAGE_SIZE);
+    if (pm->unlatch) {
+        pm->unlatch(pm->latch_ctx, page);
+    }
+    page_checksum_set(copy);
+    return pm->compress ? page_compress(pm, copy) : PAGE_SIZE;
+}
+
+/* Frees the part of page_id's slot past a compressed image of len
+ * bytes; it reads back as zeros. Called once the image is written, so a
+ * crash in between leaves a readable page. The write has succeeded, so
+ * a failure only loses the saving; a filesystem that cannot punch holes
+ * turns compression off. Callers must not overlap writes of one page,
+ * or this could cut into a newer image; the buffer pool holds a frame's
+ * write lock across each. */
+static void page_punch(PageManager* pm, uint32_t page_id, size_t len) {
+#if defined(FALLOC_FL_PUNCH_HOLE)
+    if (len == PAGE_SIZE) {
+        return;
+    }
+    off_t offset = (off_t)page_id * PAGE_SIZE + (off_t)len;
+    if (fallocate(pm->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset,
+                  (off_t)(PAGE_SIZE - len)) < 0 && errno == EOPNOTSUPP) {
+        pm->compress = false;
+    }
+#else
+    (void)pm;
+    (void)page_id;
+    (void)len;
+#endif
+}
+
+/* Checks a page image just read from page_id into page, expanding it in
+ * place first if it is stored compressed. The page I/O layer runs it on
+ * every completed read. */
+static StorageResult page_manager_check_read(void* ctx, Page* page, uint32_t page_id) {
+    PageManager* pm = ctx;
+    PageCompressedHeader* header = (PageCompressedHeader*)page;
+
+    if (header->marker == PAGE_COMPRESSED_MARKER) {
+        uint8_t packed[PAGE_SIZE];
+        size_t len = header->length;
+        if (len > PAGE_SIZE - sizeof(PageCompressedHeader)) {
+            return STORAGE_CORRUPTION;
+        }
+        memcpy(packed, header + 1, len);
+
+        uint64_t started = monotonic_ns();
+        bool ok = lz_decompress(packed, len, page, PAGE_SIZE);
+        atomic_fetch_add_u64(&pm->decompress_ns, monotonic_ns() - started);
+        if (!ok) {
+            return STORAGE_CORRUPTION;
+        }
+    }
+
+    if (!page_checksum_verify(page, page_id)) {
+        return STORAGE_CORRUPTION;
+    }
+    return STORAGE_OK;
+}
+
+/* dirty is cleared before the page is copied, so a change made while the
+ * write is in flight marks the page dirty again rather than being
+ * forgotten. */
 StorageResult page_manager_write(PageManager* pm, Page* page) {
+    uint8_t buffer[PAGE_SIZE + PAGE_IO_ALIGN];
+    Page* copy = (Page*)(((uintptr_t)buffer + PAGE_IO_ALIGN - 1) & ~(uintptr_t)(PAGE_IO_ALIGN - 1));
     uint32_t page_id = page->header.page_id;
-    off_t offset = page_id * PAGE_SIZE;
+    off_t offset = (off_t)page_id * PAGE_SIZE;
 
-    if (lseek(pm->fd, offset, SEEK_SET) != offset) {
+    page->dirty = false;
+    size_t len = page_stage(pm, copy, page);
+    ssize_t written = pwrite(pm->fd, copy, len, offset);
+    if (written != (ssize_t)len) {
+        page->dirty = true;
         return STORAGE_IO_ERROR;
     }
+    page_punch(pm, page_id, len);
 
-    ssize_t written = write(pm->fd, page, PAGE_SIZE);
-    if (written != PAGE_SIZE) {
-        return STORAGE_IO_ERROR;
+    return STORAGE_OK;
+}
+
+/* Queues a read of page_id into frame on the async backend. The callback
+ * runs when the read lands, possibly on another thread; it is not invoked
+ * if the request is rejected up front. */
+StorageResult page_manager_read_async(PageManager* pm, uint32_t page_id, Page* frame,
+                                      PageIOCallback callback, void* ctx) {
+    if (page_id >= pm->num_pages) {
+        return STORAGE_ERROR;
     }
+    return page_io_read(pm->io, page_id, frame, callback, ctx);
+}
+
+uint32_t page_manager_num_pages(PageManager* pm) {
+    pthread_mutex_lock(&pm->extend_lock);
+    uint32_t num_pages = pm->num_pages;
+    pthread_mutex_unlock(&pm->extend_lock);
+    return num_pages;
+}
+
+/* Reaps finished async requests without blocking. */
+void page_manager_poll(PageManager* pm) {
+    page_io_poll(pm->io);
+}
+
+/* Waits for every outstanding async request and its callback. */
+void page_manager_wait(PageManager* pm) {
+    page_io_wait(pm->io);
+}
 
-    if (fsync(pm->fd) < 0) {
+/* page_manager_write only hands the page to the OS; durability comes from
+ * a later sync, which callers amortise over many writes. */
+StorageResult page_manager_sync(PageManager* pm) {
+    if (fdatasync(pm->fd) < 0) {
         return STORAGE_IO_ERROR;
     }
+    return STORAGE_OK;
+}
 
-    page->dirty = false;
+/* Adds the page compression counters to metrics. */
+void page_manager_stats(PageManager* pm, StorageMetrics* metrics) {
+    metrics->page_compressed_writes = atomic_load_u64(&pm->compressed_writes);
+    metrics->page_compress_input_bytes = atomic_load_u64(&pm->compress_input_bytes);
+    metrics->page_compress_output_bytes = atomic_load_u64(&pm->compress_output_bytes);
+    metrics->page_compress_ns = atomic_load_u64(&pm->compress_ns);
+    metrics->page_decompress_ns = atomic_load_u64(&pm->decompress_ns);
+}
+
+/* Writes the free space map back to fsm.dat. It is a hint and is not
+ * logged, so this is done at checkpoints and shutdown only. */
+StorageResult page_manager_flush_fsm(PageManager* pm) {
+    return fsm_flush(pm->fsm);
+}
+
+/* Returns a page with at least need bytes available (tuple plus line
+ * pointer), or UINT32_MAX if the map knows of none. The caller must
+ * still check: the map may be stale. */
+uint32_t page_manager_find_free_page(PageManager* pm, size_t need) {
+    return fsm_search(pm->fsm, need, page_manager_num_pages(pm));
+}
+
+static int page_compare_id(const void* a, const void* b) {
+    uint32_t lhs = (*(Page* const*)a)->header.page_id;
+    uint32_t rhs = (*(Page* const*)b)->header.page_id;
+    return (lhs > rhs) - (lhs < rhs);
+}
+
+static void page_write_done(void* ctx, Page* page, StorageResult result) {
+    (void)page;
+    if (result != STORAGE_OK) {
+        *(volatile StorageResult*)ctx = result;
+    }
+}
+
+/* Writes count staged pages, sorted by page_id, without syncing. ids
+ * and lens give each image's page (a compressed image no longer carries
+ * it) and length. */
+static StorageResult page_manager_write_staged(PageManager* pm, Page* staged,
+                                               const uint32_t* ids, const size_t* lens,
+                                               size_t count) {
+    if (page_io_is_async(pm->io)) {
+        volatile StorageResult status = STORAGE_OK;
+        for (size_t i = 0; i < count; i++) {
+            page_io_write(pm->io, ids[i], &staged[i], lens[i], page_write_done, (void*)&status);
+        }
+        page_io_wait(pm->io);
+        for (size_t i = 0; i < count && status == STORAGE_OK; i++) {
+            page_punch(pm, ids[i], lens[i]);
+        }
+        return status;
+    }
+
+    /* Staged pages sit side by side, so a run of consecutive page ids is
+     * one contiguous write. A compressed image leaves a gap behind it and
+     * ends its run. */
+    size_t i = 0;
+    while (i < count) {
+        size_t run = 1;
+        while (i + run < count && lens[i + run - 1] == PAGE_SIZE &&
+               ids[i + run] == ids[i + run - 1] + 1) {
+            run++;
+        }
+
+        size_t len = (run - 1) * PAGE_SIZE + lens[i + run - 1];
+        off_t offset = (off_t)ids[i] * PAGE_SIZE;
+        ssize_t written = pwrite(pm->fd, &staged[i], len, offset);
+        if (written != (ssize_t)len) {
+            return STORAGE_IO_ERROR;
+        }
+        page_punch(pm, ids[i + run - 1], lens[i + run - 1]);
+        i += run;
+    }
     return STORAGE_OK;
 }
 
-Page* page_manager_alloc(PageManager* pm) {
-    Page* page = malloc(sizeof(Page));
-    if (!page) return NULL;
+/* Issues the writes for a sorted batch without syncing, staging up to
+ * PAGE_WRITE_RUN_MAX pages at a time. */
+static StorageResult page_manager_write_pages(PageManager* pm, Page** pages, size_t count) {
+    size_t stage_bytes = (size_t)PAGE_WRITE_RUN_MAX * PAGE_SIZE;
+    Page* staged = mmap(NULL, stage_bytes, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (staged == MAP_FAILED) {
+        return STORAGE_OOM;
+    }
+
+    uint32_t ids[PAGE_WRITE_RUN_MAX];
+    size_t lens[PAGE_WRITE_RUN_MAX];
+    StorageResult result = STORAGE_OK;
+    for (size_t i = 0; i < count && result == STORAGE_OK; i += PAGE_WRITE_RUN_MAX) {
+        size_t n = count - i < PAGE_WRITE_RUN_MAX ? count - i : PAGE_WRITE_RUN_MAX;
+        for (size_t j = 0; j < n; j++) {
+            ids[j] = pages[i + j]->header.page_id;
+            lens[j] = page_stage(pm, &staged[j], pages[i + j]);
+        }
+        result = page_manager_write_staged(pm, staged, ids, lens, n);
+    }
 
+    munmap(staged, stage_bytes);
+    return result;
+}
+
+/* Writes a set of pages in page_id order, then syncs once for the whole
+ * set. Pages are staged PAGE_WRITE_RUN_MAX at a time; with the async
+ * backend a whole stage is in flight at once, otherwise runs of
+ * consecutive pages go out as single writes.
+ * The array is sorted in place. As in page_manager_write, dirty is
+ * cleared up front and restored if the batch fails. */
+StorageResult page_manager_write_batch(PageManager* pm, Page** pages, size_t count) {
+    if (count == 0) return STORAGE_OK;
+
+    qsort(pages, count, sizeof(Page*), page_compare_id);
+    for (size_t j = 0; j < count; j++) {
+        pages[j]->dirty = false;
+    }
+
+    StorageResult result = page_manager_write_pages(pm, pages, count);
+    if (result == STORAGE_OK) {
+        result = page_manager_sync(pm);
+    }
+    if (result != STORAGE_OK) {
+        for (size_t j = 0; j < count; j++) {
+            pages[j]->dirty = true;
+        }
+    }
+    return result;
+}
+
+/* Formats an empty page. */
+void page_init(Page* page, uint32_t page_id) {
     memset(page, 0, sizeof(Page));
-    
-    page->header.page_id = pm->num_pages;
-    page->header.lower = sizeof(PageHeader);
+    page->header.page_id = page_id;
+    page->header.lower = PAGE_DATA_OFFSET;
     page->header.upper = PAGE_SIZE;
-    page->header.flags = 0;
-    page->header.lsn = 0;
-    page->dirty = true;
-    page->pin_count = 1;
+}
 
-    pm->num_pages++;
+/* Appends an empty page to pages.dat, formatting page as its image.
+ * Called with extend_lock held. */
+static bool page_manager_append(PageManager* pm, Page* page) {
+    page_init(page, pm->num_pages);
+    page_checksum_set(page);
+
+    /* page may be heap or stack memory; direct I/O needs an aligned copy. */
+    const void* src = page;
+    if (pm->extend_buf) {
+        memcpy(pm->extend_buf, page, PAGE_SIZE);
+        src = pm->extend_buf;
+    }
 
-    if (lseek(pm->fd, page->header.page_id * PAGE_SIZE, SEEK_SET) < 0) {
-        free(page);
-        return NULL;
+    if (pwrite(pm->fd, src, PAGE_SIZE, (off_t)page->header.page_id * PAGE_SIZE) != PAGE_SIZE) {
+        return false;
     }
+    pm->num_pages++;
+    return true;
+}
+
+Page* page_manager_alloc(PageManager* pm) {
+    Page* page = malloc(sizeof(Page));
+    if (!page) return NULL;
 
-    if (write(pm->fd, page, PAGE_SIZE) != PAGE_SIZE) {
+    pthread_mutex_lock(&pm->extend_lock);
+    bool appended = page_manager_append(pm, page);
+    pthread_mutex_unlock(&pm->extend_lock);
+    if (!appended) {
         free(page);
         return NULL;
     }
 
+    page->dirty = true;
+    page->pin_count = 1;
     return page;
 }
 
+/* Adds an empty page at the end of the file and returns its id, or
+ * UINT32_MAX on failure. Unlike page_manager_alloc it hands back no
+ * copy: the caller reads the page through the buffer pool. */
+uint32_t page_manager_extend(PageManager* pm) {
+    Page page;
+    pthread_mutex_lock(&pm->extend_lock);
+    uint32_t page_id = page_manager_append(pm, &page) ? page.header.page_id : UINT32_MAX;
+    pthread_mutex_unlock(&pm->extend_lock);
+    return page_id;
+}
+
+/* Extends the file with empty pages until page_id exists. Recovery uses
+ * it for pages whose extension never reached the disk. */
+StorageResult page_manager_extend_to(PageManager* pm, uint32_t page_id) {
+    Page page;
+    StorageResult result = STORAGE_OK;
+    pthread_mutex_lock(&pm->extend_lock);
+    while (pm->num_pages <= page_id) {
+        if (!page_manager_append(pm, &page)) {
+            result = STORAGE_IO_ERROR;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&pm->extend_lock);
+    return result;
+}
+
+static uint16_t page_num_slots(const Page* page) {
+    return (uint16_t)((page->header.lower - PAGE_DATA_OFFSET) / sizeof(LinePointer));
+}
+
+static LinePointer* page_line_pointer(Page* page, uint16_t slot) {
+    return (LinePointer*)(((uint8_t*)page) + PAGE_DATA_OFFSET + slot * sizeof(LinePointer));
+}
+
 uint16_t page_get_free_space(Page* page) {
     return page->header.upper - page->header.lower;
 }
 
-StorageResult page_add_tuple(Page* page, const void* tuple_data, uint16_t tuple_size) {
-    uint16_t free_space = page_get_free_space(page);
-    uint16_t required = tuple_size + sizeof(LinePointer);
+/* Defragments the page: live tuples are packed against the end of the
+ * page (in slot order, through a scratch copy), dead line pointers
+ * become UNUSED and trailing unused ones are dropped. Slot numbers of
+ * live tuples are unchanged. */
+void page_compact(Page* page) {
+    uint8_t scratch[PAGE_SIZE];
+    uint8_t* base = (uint8_t*)page;
+    uint16_t num_slots = page_num_slots(page);
+    uint16_t upper = PAGE_SIZE;
+    uint16_t last_used = 0;
+    uint16_t first_unused = num_slots;
+
+    for (uint16_t slot = 0; slot < num_slots; slot++) {
+        LinePointer* lp = page_line_pointer(page, slot);
+        if (lp->flags != LP_NORMAL) {
+            lp->flags = LP_UNUSED;
+            lp->offset = 0;
+            lp->length = 0;
+            if (first_unused == num_slots) {
+                first_unused = slot;
+            }
+            continue;
+        }
+        upper -= lp->length;
+        memcpy(scratch + upper, base + lp->offset, lp->length);
+        lp->offset = upper;
+        last_used = slot + 1;
+    }
+    memcpy(base + upper, scratch + upper, PAGE_SIZE - upper);
 
-    if (free_space < required) {
-        return STORAGE_ERROR;
+    page->header.lower = (uint16_t)(PAGE_DATA_OFFSET + last_used * sizeof(LinePointer));
+    page->header.upper = upper;
+    page->header.flags &= (uint16_t)~(PAGE_HAS_GARBAGE | PAGE_HAS_FREE_LINES);
+    if (first_unused < last_used) {
+        page->header.flags |= PAGE_HAS_FREE_LINES;
+    }
+    page->dirty = true;
+}
+
+/* Space an insert could use once the page is compacted: the free gap
+ * plus dead tuples, shrunk images and trailing dead line pointers. Only
+ * pages with garbage need the scan. */
+static size_t page_available_space(Page* page) {
+    if (!(page->header.flags & PAGE_HAS_GARBAGE)) {
+        return page_get_free_space(page);
+    }
+
+    uint16_t num_slots = page_num_slots(page);
+    uint16_t last_used = 0;
+    size_t live_bytes = 0;
+    for (uint16_t slot = 0; slot < num_slots; slot++) {
+        LinePointer* lp = page_line_pointer(page, slot);
+        if (lp->flags == LP_NORMAL) {
+            live_bytes += lp->length;
+            last_used = slot + 1;
+        }
+    }
+    return PAGE_SIZE - PAGE_DATA_OFFSET - last_used * sizeof(LinePointer) - live_bytes;
+}
+
+/* Keeps the free space map in step with a page the caller changed. */
+static void page_record_free_space(PageManager* pm, Page* page) {
+    if (pm) {
+        fsm_record(pm->fsm, page->header.page_id, page_available_space(page));
     }
+}
 
-    LinePointer* lp = (LinePointer*)(((uint8_t*)page) + page->header.lower);
+/* Finds an UNUSED line pointer to reuse, clearing the hint if there is
+ * none. Returns num_slots when a new pointer is needed. */
+static uint16_t page_find_free_line(Page* page) {
+    uint16_t num_slots = page_num_slots(page);
+    if (page->header.flags & PAGE_HAS_FREE_LINES) {
+        for (uint16_t slot = 0; slot < num_slots; slot++) {
+            if (page_line_pointer(page, slot)->flags == LP_UNUSED) {
+                return slot;
+            }
+        }
+        page->header.flags &= (uint16_t)~PAGE_HAS_FREE_LINES;
+    }
+    return num_slots;
+}
+
+/* Adds a tuple, reusing an UNUSED line pointer when there is one, and
+ * stores its slot in *slot_out (if not NULL). If the page is too full
+ * but holds garbage, it is compacted first, so the common case costs one
+ * flag test. pm (may be NULL for pages outside the heap) gets the page's
+ * new free space, also on failure, which corrects a stale free space map
+ * entry. */
+StorageResult page_add_tuple(PageManager* pm, Page* page, const void* tuple_data,
+                             uint16_t tuple_size, uint16_t* slot_out) {
+    uint16_t slot = page_find_free_line(page);
+    size_t required = tuple_size + (slot == page_num_slots(page) ? sizeof(LinePointer) : 0);
+
+    if (page_get_free_space(page) < required) {
+        if (page->header.flags & PAGE_HAS_GARBAGE) {
+            page_compact(page);
+            slot = page_find_free_line(page);
+            required = tuple_size + (slot == page_num_slots(page) ? sizeof(LinePointer) : 0);
+        }
+        if (page_get_free_space(page) < required) {
+            page_record_free_space(pm, page);
+            return STORAGE_ERROR;
+        }
+    }
+
+    if (slot == page_num_slots(page)) {
+        page->header.lower += sizeof(LinePointer);
+    }
+    LinePointer* lp = page_line_pointer(page, slot);
     lp->offset = page->header.upper - tuple_size;
     lp->length = tuple_size;
-    lp->flags = 0;
+    lp->flags = LP_NORMAL;
 
     memcpy(((uint8_t*)page) + lp->offset, tuple_data, tuple_size);
 
-    page->header.lower += sizeof(LinePointer);
     page->header.upper -= tuple_size;
     page->dirty = true;
+    page_record_free_space(pm, page);
 
+    if (slot_out) {
+        *slot_out = slot;
+    }
     return STORAGE_OK;
 }
 
 void* page_get_tuple(Page* page, uint16_t slot) {
-    uint16_t num_slots = (page->header.lower - sizeof(PageHeader)) / sizeof(LinePointer);
-    
-    if (slot >= num_slots) {
+    if (slot >= page_num_slots(page)) {
         return NULL;
     }
 
-    LinePointer* lp = (LinePointer*)(((uint8_t*)page) + sizeof(PageHeader) + slot * sizeof(LinePointer));
-    
-    if (lp->flags & 0x01) {
+    LinePointer* lp = page_line_pointer(page, slot);
+    if (lp->flags != LP_NORMAL) {
         return NULL;
     }
 
     return ((uint8_t*)page) + lp->offset;
 }
 
-StorageResult page_delete_tuple(Page* page, uint16_t slot) {
-    uint16_t num_slots = (page->header.lower - sizeof(PageHeader)) / sizeof(LinePointer);
-    
-    if (slot >= num_slots) {
+/* Overwrites the tuple in slot in place. The new image must not be
+ * larger than the one it replaces. */
+StorageResult page_update_tuple(PageManager* pm, Page* page, uint16_t slot,
+                                const void* tuple_data, uint16_t tuple_size) {
+    if (slot >= page_num_slots(page)) {
         return STORAGE_ERROR;
     }
 
-    LinePointer* lp = (LinePointer*)(((uint8_t*)page) + sizeof(PageHeader) + slot * sizeof(LinePointer));
-    lp->flags |= 0x01;
+    LinePointer* lp = page_line_pointer(page, slot);
+    if (lp->flags != LP_NORMAL || tuple_size > lp->length) {
+        return STORAGE_ERROR;
+    }
+
+    memcpy(((uint8_t*)page) + lp->offset, tuple_data, tuple_size);
+    bool shrunk = tuple_size < lp->length;
+    if (shrunk) {
+        page->header.flags |= PAGE_HAS_GARBAGE;
+    }
+    lp->length = tuple_size;
+    page->dirty = true;
+    if (shrunk) {
+        page_record_free_space(pm, page);
+    }
+
+    return STORAGE_OK;
+}
+
+/* Marks the tuple DEAD; its space is reclaimed by the next compaction. */
+StorageResult page_delete_tuple(PageManager* pm, Page* page, uint16_t slot) {
+    if (slot >= page_num_slots(page)) {
+        return STORAGE_ERROR;
+    }
+
+    LinePointer* lp = page_line_pointer(page, slot);
+    if (lp->flags != LP_NORMAL && lp->flags != LP_DEAD) {
+        return STORAGE_ERROR;
+    }
+    lp->flags = LP_DEAD;
+    page->header.flags |= PAGE_HAS_GARBAGE;
     page->dirty = true;
+    page_record_free_space(pm, page);
 
     return STORAGE_OK;
 }
+
+/* Saves into saved what page_undo_adds needs to take back tuples added
+ * to page from here on. Adds to a page without garbage or free line
+ * pointers only grow the pointer array and fill the gap, so the header
+ * is enough; otherwise an add may compact the page or reuse a pointer,
+ * and the whole image is kept. */
+void page_begin_adds(const Page* page, Page* saved) {
+    saved->header = page->header;
+    if (page->header.flags & (PAGE_HAS_GARBAGE | PAGE_HAS_FREE_LINES)) {
+        memcpy(saved->data, page->data, sizeof(page->data));
+    }
+}
+
+/* Returns page to the state page_begin_adds saved, as if the adds since
+ * had never happened. Used when they could not be logged: redo places
+ * later tuples by replaying page_add_tuple, so the page must match the
+ * log exactly, compaction included. */
+void page_undo_adds(PageManager* pm, Page* page, const Page* saved) {
+    if (saved->header.flags & (PAGE_HAS_GARBAGE | PAGE_HAS_FREE_LINES)) {
+        memcpy(page->data, saved->data, sizeof(page->data));
+    }
+    page->header = saved->header;
+    page->dirty = true;
+    page_record_free_space(pm, page);
+}
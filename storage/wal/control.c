@@ -0,0 +1,153 @@
+#include "../include/minsql_storage.h"
+#include "../include/compat.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* <data_dir>/control records the last completed checkpoint: its LSN, the
+ * redo start point and the dirty page table at that moment. It is
+ * replaced atomically (write to a temporary file, sync, rename), so a
+ * reader sees either the previous checkpoint or the new one. */
+#define CONTROL_FILE_NAME "control"
+#define CONTROL_MAGIC 0x4C51534DU     /* "MSQL" */
+#define CONTROL_VERSION 1
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t checkpoint_lsn;
+    uint64_t redo_lsn;
+    uint64_t num_dirty;
+    uint32_t crc;           /* CRC32C of the file with this field zeroed */
+    uint32_t reserved;
+} ControlFileHeader;
+
+static void control_file_path(const char* data_dir, const char* suffix, char* path, size_t size) {
+    snprintf(path, size, "%s/%s%s", data_dir, CONTROL_FILE_NAME, suffix);
+}
+
+static bool control_file_write_all(int fd, const uint8_t* buf, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = pwrite(fd, buf + done, len - done, (off_t)done);
+        if (n <= 0) {
+            return false;
+        }
+        done += (size_t)n;
+    }
+    return true;
+}
+
+static bool control_file_read_all(int fd, uint8_t* buf, size_t len, off_t offset) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = pread(fd, buf + done, len - done, offset + (off_t)done);
+        if (n <= 0) {
+            return false;
+        }
+        done += (size_t)n;
+    }
+    return true;
+}
+
+StorageResult control_file_write(const char* data_dir, uint64_t checkpoint_lsn, uint64_t redo_lsn,
+                                 const DirtyPageEntry* dirty, size_t num_dirty) {
+    size_t size = sizeof(ControlFileHeader) + num_dirty * sizeof(DirtyPageEntry);
+    uint8_t* buf = calloc(1, size);
+    if (!buf) return STORAGE_OOM;
+
+    ControlFileHeader* header = (ControlFileHeader*)buf;
+    header->magic = CONTROL_MAGIC;
+    header->version = CONTROL_VERSION;
+    header->checkpoint_lsn = checkpoint_lsn;
+    header->redo_lsn = redo_lsn;
+    header->num_dirty = num_dirty;
+
+    /* Field by field, so struct padding stays zero for the CRC. */
+    DirtyPageEntry* entries = (DirtyPageEntry*)(buf + sizeof(ControlFileHeader));
+    for (size_t i = 0; i < num_dirty; i++) {
+        entries[i].page_id = dirty[i].page_id;
+        entries[i].rec_lsn = dirty[i].rec_lsn;
+    }
+    header->crc = storage_crc32c(0, buf, size);
+
+    char path[300];
+    char tmp_path[310];
+    control_file_path(data_dir, "", path, sizeof(path));
+    control_file_path(data_dir, ".tmp", tmp_path, sizeof(tmp_path));
+
+    int fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        free(buf);
+        return STORAGE_IO_ERROR;
+    }
+    bool ok = control_file_write_all(fd, buf, size) && fsync(fd) == 0;
+    close(fd);
+    free(buf);
+
+    if (!ok || rename(tmp_path, path) != 0) {
+        unlink(tmp_path);
+        return STORAGE_IO_ERROR;
+    }
+
+#ifndef _WIN32
+    int dir_fd = open(data_dir, O_RDONLY);
+    if (dir_fd >= 0) {
+        fsync(dir_fd);
+        close(dir_fd);
+    }
+#endif
+    return STORAGE_OK;
+}
+
+/* Loads the last checkpoint. Returns false if there is none or the file
+ * is damaged; recovery then starts from the oldest retained segment.
+ * On success *dirty is a malloc'd array (NULL when it is empty). */
+bool control_file_read(const char* data_dir, uint64_t* checkpoint_lsn, uint64_t* redo_lsn,
+                       DirtyPageEntry** dirty, size_t* num_dirty) {
+    char path[300];
+    control_file_path(data_dir, "", path, sizeof(path));
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+
+    ControlFileHeader header;
+    struct stat st;
+    if (fstat(fd, &st) != 0 ||
+        !control_file_read_all(fd, (uint8_t*)&header, sizeof(header), 0) ||
+        header.magic != CONTROL_MAGIC || header.version != CONTROL_VERSION ||
+        header.num_dirty > ((uint64_t)st.st_size - sizeof(header)) / sizeof(DirtyPageEntry)) {
+        close(fd);
+        return false;
+    }
+
+    size_t entries_size = (size_t)header.num_dirty * sizeof(DirtyPageEntry);
+    DirtyPageEntry* entries = NULL;
+    if (entries_size > 0) {
+        entries = malloc(entries_size);
+        if (!entries ||
+            !control_file_read_all(fd, (uint8_t*)entries, entries_size, sizeof(header))) {
+            free(entries);
+            close(fd);
+            return false;
+        }
+    }
+    close(fd);
+
+    uint32_t expected = header.crc;
+    header.crc = 0;
+    uint32_t crc = storage_crc32c(0, &header, sizeof(header));
+    crc = storage_crc32c(crc, entries, entries_size);
+    if (crc != expected) {
+        free(entries);
+        return false;
+    }
+
+    *checkpoint_lsn = header.checkpoint_lsn;
+    *redo_lsn = header.redo_lsn;
+    *dirty = entries;
+    *num_dirty = (size_t)header.num_dirty;
+    return true;
+}
@@ -0,0 +1,285 @@
+#include "../include/minsql_storage.h"
+#include "../include/compat.h"
+#include <string.h>
+
+/* CRC32C (Castagnoli, reflected polynomial 0x82F63B78). x86-64 with
+ * SSE4.2 and AArch64 with the CRC extension use the dedicated
+ * instructions; everything else uses slicing-by-8 tables. The
+ * implementation is picked once, on first use. */
+#define CRC32C_POLY 0x82F63B78U
+
+/* The crc32 instruction has a latency of three cycles but issues every
+ * cycle, so the hardware paths run three independent streams over
+ * adjacent blocks and fold them together with shift tables. Long blocks
+ * suit big payloads; short ones keep records of a few KiB interleaved. */
+#define CRC32C_LONG 8192
+#define CRC32C_SHORT 256
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define CRC32C_HAVE_SSE42 1
+#if defined(_MSC_VER)
+#include <intrin.h>
+#include <nmmintrin.h>
+#define CRC32C_TARGET_SSE42
+#else
+#include <nmmintrin.h>
+#include <cpuid.h>
+#define CRC32C_TARGET_SSE42 __attribute__((target("sse4.2")))
+#endif
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#define CRC32C_HAVE_ARMV8 1
+#include <arm_acle.h>
+#endif
+
+typedef uint32_t (*Crc32cFn)(uint32_t crc, const uint8_t* data, size_t len);
+
+static uint32_t crc32c_table[8][256];
+
+#if defined(CRC32C_HAVE_SSE42) || defined(CRC32C_HAVE_ARMV8)
+/* crc32c_long[k][b] is the CRC register b << 8k becomes after
+ * CRC32C_LONG zero bytes; likewise crc32c_short. */
+static uint32_t crc32c_long[4][256];
+static uint32_t crc32c_short[4][256];
+
+/* Product of two polynomials modulo the CRC polynomial, both reflected
+ * (bit 31 is x^0). */
+static uint32_t crc32c_multmodp(uint32_t a, uint32_t b) {
+    uint32_t m = 1U << 31;
+    uint32_t p = 0;
+    for (;;) {
+        if (a & m) {
+            p ^= b;
+            if ((a & (m - 1)) == 0) {
+                break;
+            }
+        }
+        m >>= 1;
+        b = (b >> 1) ^ (CRC32C_POLY & (0U - (b & 1)));
+    }
+    return p;
+}
+
+/* x^(8 * len) modulo the CRC polynomial: the operator that appends len
+ * zero bytes to a CRC register. */
+static uint32_t crc32c_zeros_op(size_t len) {
+    uint32_t square = 1U << 30;
+    uint32_t op = 1U << 31;
+    for (size_t n = len * 8; n > 0; n >>= 1) {
+        if (n & 1) {
+            op = crc32c_multmodp(square, op);
+        }
+        square = crc32c_multmodp(square, square);
+    }
+    return op;
+}
+
+static void crc32c_init_shift(uint32_t table[4][256], size_t len) {
+    uint32_t op = crc32c_zeros_op(len);
+    for (uint32_t i = 0; i < 256; i++) {
+        for (int k = 0; k < 4; k++) {
+            table[k][i] = crc32c_multmodp(op, i << (8 * k));
+        }
+    }
+}
+
+static inline uint32_t crc32c_shift(uint32_t table[4][256], uint32_t crc) {
+    return table[0][crc & 0xFF] ^ table[1][(crc >> 8) & 0xFF] ^
+           table[2][(crc >> 16) & 0xFF] ^ table[3][crc >> 24];
+}
+#endif
+
+static void crc32c_init_table(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int k = 0; k < 8; k++) {
+            crc = (crc >> 1) ^ (CRC32C_POLY & (0U - (crc & 1)));
+        }
+        crc32c_table[0][i] = crc;
+    }
+    for (uint32_t i = 0; i < 256; i++) {
+        for (int t = 1; t < 8; t++) {
+            uint32_t prev = crc32c_table[t - 1][i];
+            crc32c_table[t][i] = (prev >> 8) ^ crc32c_table[0][prev & 0xFF];
+        }
+    }
+}
+
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t* data, size_t len) {
+    while (len > 0 && ((uintptr_t)data & 7) != 0) {
+        crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *data++) & 0xFF];
+        len--;
+    }
+    while (len >= 8) {
+        uint64_t word;
+        memcpy(&word, data, 8);
+        uint32_t lo = (uint32_t)word ^ crc;
+        uint32_t hi = (uint32_t)(word >> 32);
+        crc = crc32c_table[7][lo & 0xFF] ^
+              crc32c_table[6][(lo >> 8) & 0xFF] ^
+              crc32c_table[5][(lo >> 16) & 0xFF] ^
+              crc32c_table[4][lo >> 24] ^
+              crc32c_table[3][hi & 0xFF] ^
+              crc32c_table[2][(hi >> 8) & 0xFF] ^
+              crc32c_table[1][(hi >> 16) & 0xFF] ^
+              crc32c_table[0][hi >> 24];
+        data += 8;
+        len -= 8;
+    }
+    while (len > 0) {
+        crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *data++) & 0xFF];
+        len--;
+    }
+    return crc;
+}
+
+#if defined(CRC32C_HAVE_SSE42)
+/* Runs three streams over the next 3 * block bytes and folds them into
+ * crc. */
+CRC32C_TARGET_SSE42
+static inline uint32_t crc32c_sse42_blocks(uint32_t crc, const uint8_t* data, size_t block,
+                                           uint32_t shift[4][256]) {
+    uint64_t crc0 = crc;
+    uint64_t crc1 = 0;
+    uint64_t crc2 = 0;
+    for (const uint8_t* end = data + block; data < end; data += 8) {
+        uint64_t word0, word1, word2;
+        memcpy(&word0, data, 8);
+        memcpy(&word1, data + block, 8);
+        memcpy(&word2, data + 2 * block, 8);
+        crc0 = _mm_crc32_u64(crc0, word0);
+        crc1 = _mm_crc32_u64(crc1, word1);
+        crc2 = _mm_crc32_u64(crc2, word2);
+    }
+    crc = crc32c_shift(shift, (uint32_t)crc0) ^ (uint32_t)crc1;
+    return crc32c_shift(shift, crc) ^ (uint32_t)crc2;
+}
+
+CRC32C_TARGET_SSE42
+static uint32_t crc32c_sse42(uint32_t crc, const uint8_t* data, size_t len) {
+    /* Kept out of the way of short records, which are the common case. */
+    if (len >= 3 * CRC32C_SHORT) {
+        while (len >= 3 * CRC32C_LONG) {
+            crc = crc32c_sse42_blocks(crc, data, CRC32C_LONG, crc32c_long);
+            data += 3 * CRC32C_LONG;
+            len -= 3 * CRC32C_LONG;
+        }
+        while (len >= 3 * CRC32C_SHORT) {
+            crc = crc32c_sse42_blocks(crc, data, CRC32C_SHORT, crc32c_short);
+            data += 3 * CRC32C_SHORT;
+            len -= 3 * CRC32C_SHORT;
+        }
+    }
+
+    uint64_t crc64 = crc;
+    while (len >= 8) {
+        uint64_t word;
+        memcpy(&word, data, 8);
+        crc64 = _mm_crc32_u64(crc64, word);
+        data += 8;
+        len -= 8;
+    }
+    uint32_t crc32 = (uint32_t)crc64;
+    while (len > 0) {
+        crc32 = _mm_crc32_u8(crc32, *data++);
+        len--;
+    }
+    return crc32;
+}
+
+static bool crc32c_cpu_has_sse42(void) {
+#if defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 1);
+    return (info[2] & (1 << 20)) != 0;
+#else
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+        return false;
+    }
+    return (ecx & bit_SSE4_2) != 0;
+#endif
+}
+#endif
+
+#if defined(CRC32C_HAVE_ARMV8)
+static inline uint32_t crc32c_armv8_blocks(uint32_t crc, const uint8_t* data, size_t block,
+                                           uint32_t shift[4][256]) {
+    uint32_t crc0 = crc;
+    uint32_t crc1 = 0;
+    uint32_t crc2 = 0;
+    for (const uint8_t* end = data + block; data < end; data += 8) {
+        uint64_t word0, word1, word2;
+        memcpy(&word0, data, 8);
+        memcpy(&word1, data + block, 8);
+        memcpy(&word2, data + 2 * block, 8);
+        crc0 = __crc32cd(crc0, word0);
+        crc1 = __crc32cd(crc1, word1);
+        crc2 = __crc32cd(crc2, word2);
+    }
+    crc = crc32c_shift(shift, crc0) ^ crc1;
+    return crc32c_shift(shift, crc) ^ crc2;
+}
+
+static uint32_t crc32c_armv8(uint32_t crc, const uint8_t* data, size_t len) {
+    /* Kept out of the way of short records, which are the common case. */
+    if (len >= 3 * CRC32C_SHORT) {
+        while (len >= 3 * CRC32C_LONG) {
+            crc = crc32c_armv8_blocks(crc, data, CRC32C_LONG, crc32c_long);
+            data += 3 * CRC32C_LONG;
+            len -= 3 * CRC32C_LONG;
+        }
+        while (len >= 3 * CRC32C_SHORT) {
+            crc = crc32c_armv8_blocks(crc, data, CRC32C_SHORT, crc32c_short);
+            data += 3 * CRC32C_SHORT;
+            len -= 3 * CRC32C_SHORT;
+        }
+    }
+    while (len >= 8) {
+        uint64_t word;
+        memcpy(&word, data, 8);
+        crc = __crc32cd(crc, word);
+        data += 8;
+        len -= 8;
+    }
+    while (len > 0) {
+        crc = __crc32cb(crc, *data++);
+        len--;
+    }
+    return crc;
+}
+#endif
+
+static uint32_t crc32c_resolve(uint32_t crc, const uint8_t* data, size_t len);
+
+/* Racing first calls may both resolve; they pick the same function and
+ * build identical tables, so the outcome does not depend on who wins. */
+static volatile Crc32cFn crc32c_impl = crc32c_resolve;
+
+static uint32_t crc32c_resolve(uint32_t crc, const uint8_t* data, size_t len) {
+    Crc32cFn fn = crc32c_sw;
+#if defined(CRC32C_HAVE_SSE42)
+    if (crc32c_cpu_has_sse42()) {
+        fn = crc32c_sse42;
+    }
+#elif defined(CRC32C_HAVE_ARMV8)
+    fn = crc32c_armv8;
+#endif
+    if (fn == crc32c_sw) {
+        crc32c_init_table();
+    } else {
+#if defined(CRC32C_HAVE_SSE42) || defined(CRC32C_HAVE_ARMV8)
+        crc32c_init_shift(crc32c_long, CRC32C_LONG);
+        crc32c_init_shift(crc32c_short, CRC32C_SHORT);
+#endif
+    }
+    crc32c_impl = fn;
+    return fn(crc, data, len);
+}
+
+/* Extends crc with len bytes. Start from 0; the pre- and post-inversion
+ * are handled here, so a running CRC can be extended across calls. */
+uint32_t storage_crc32c(uint32_t crc, const void* data, size_t len) {
+    return ~crc32c_impl(~crc, (const uint8_t*)data, len);
+}
@@ -0,0 +1,439 @@
+#include "../include/minsql_storage.h"
+#include "../include/compat.h"
+#include <stdlib.h>
+#include <string.h>
+
+extern Page* buffer_pool_get_page(BufferPool* pool, PageManager* pm, uint32_t page_id);
+extern void buffer_pool_unpin_page(BufferPool* pool, Page* page);
+extern void buffer_pool_latch_page(BufferPool* pool, Page* page);
+extern void buffer_pool_unlatch_page(BufferPool* pool, Page* page);
+extern void buffer_pool_mark_dirty(BufferPool* pool, Page* page, uint64_t lsn);
+
+extern StorageResult page_add_tuple(PageManager* pm, Page* page, const void* tuple_data,
+                                    uint16_t tuple_size, uint16_t* slot_out);
+extern StorageResult page_update_tuple(PageManager* pm, Page* page, uint16_t slot,
+                                       const void* tuple_data, uint16_t tuple_size);
+extern StorageResult page_delete_tuple(PageManager* pm, Page* page, uint16_t slot);
+extern void page_init(Page* page, uint32_t page_id);
+extern StorageResult page_manager_extend_to(PageManager* pm, uint32_t page_id);
+
+/* Parallel redo. The replay loop hands every page record to
+ * redo_dispatch, which routes it to the worker owning its page
+ * (page_id % workers). Each worker applies its records in the order they
+ * were dispatched, so records for one page are applied in LSN order,
+ * while different pages are redone concurrently.
+ *
+ * Records travel in fixed-size batches; each worker has a small pool of
+ * them, so memory stays bounded and a slow worker throttles dispatch.
+ * In a batch, each record is preceded by its end LSN in the log (a
+ * decompressed record is longer than the one logged). */
+#define REDO_BATCH_BYTES (128 * 1024)
+#define REDO_BATCHES_PER_WORKER 4
+#define REDO_MAX_WORKERS 64
+
+typedef struct RedoBatch {
+    struct RedoBatch* next;
+    size_t used;
+    uint8_t data[REDO_BATCH_BYTES];
+} RedoBatch;
+
+typedef struct Redo Redo;
+
+typedef struct {
+    Redo* redo;
+    pthread_t thread;
+    bool started;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    RedoBatch* queue_head;      /* full batches, oldest first */
+    RedoBatch* queue_tail;
+    RedoBatch* free_batches;
+    RedoBatch* filling;         /* owned by the dispatcher */
+    bool stop;
+    uint32_t last_prefetch;
+} RedoWorker;
+
+struct Redo {
+    StorageHandle* handle;
+    RedoWorker* workers;
+    size_t num_workers;
+    /* Dirty page table of the checkpoint recovery starts from, sorted by
+     * page_id, and the LSN at which it was taken. */
+    const DirtyPageEntry* dirty;
+    size_t num_dirty;
+    uint64_t checkpoint_lsn;
+    pthread_mutex_t lock;
+    StorageResult result;       /* first failure of any worker */
+};
+
+static size_t redo_record_size(const WALEntry* entry) {
+    return (sizeof(uint64_t) + sizeof(WALEntry) + entry->length + 7) & ~(size_t)7;
+}
+
+/* Redo records are row changes whose payload names a page. */
+static bool redo_is_page_record(const WALEntry* entry, WALRedoHeader* redo_header) {
+    if (entry->type != WAL_INSERT && entry->type != WAL_UPDATE && entry->type != WAL_DELETE) {
+        return false;
+    }
+    if (entry->length < sizeof(WALRedoHeader)) {
+        return false;
+    }
+    memcpy(redo_header, entry->data, sizeof(WALRedoHeader));
+    return redo_header->page_id != WAL_NO_PAGE;
+}
+
+/* Records logged before the checkpoint need redo only if their page was
+ * in its dirty page table and they are not older than the page's recLSN;
+ * anything else was already on disk, so its page need not even be read.
+ * Later records are always redone, subject to the page LSN check. */
+static bool redo_needed(const Redo* redo, const WALEntry* entry, uint32_t page_id) {
+    if (entry->lsn >= redo->checkpoint_lsn) {
+        return true;
+    }
+
+    size_t lo = 0;
+    size_t hi = redo->num_dirty;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (redo->dirty[mid].page_id < page_id) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo < redo->num_dirty && redo->dirty[lo].page_id == page_id &&
+           entry->lsn >= redo->dirty[lo].rec_lsn;
+}
+
+static int redo_compare_dirty(const void* a, const void* b) {
+    uint32_t lhs = ((const DirtyPageEntry*)a)->page_id;
+    uint32_t rhs = ((const DirtyPageEntry*)b)->page_id;
+    return (lhs > rhs) - (lhs < rhs);
+}
+
+/* Re-adds a logged tuple. It must land in the slot it was logged with;
+ * anything else means the page has diverged from the log. */
+static StorageResult redo_insert(StorageHandle* handle, Page* page, const uint8_t* image,
+                                 uint16_t length, uint16_t slot) {
+    uint16_t placed;
+    StorageResult result = page_add_tuple(handle->page_manager, page, image, length, &placed);
+    if (result == STORAGE_OK && placed != slot) {
+        result = STORAGE_CORRUPTION;
+    }
+    return result;
+}
+
+/* Redoes a MULTI insert: a run of WALTupleHeader and tuple image pairs. */
+static StorageResult redo_insert_multi(StorageHandle* handle, Page* page, const uint8_t* data,
+                                       size_t len) {
+    while (len > 0) {
+        WALTupleHeader tuple;
+        if (len < sizeof(WALTupleHeader)) {
+            return STORAGE_CORRUPTION;
+        }
+        memcpy(&tuple, data, sizeof(WALTupleHeader));
+        data += sizeof(WALTupleHeader);
+        len -= sizeof(WALTupleHeader);
+        if (tuple.length > len) {
+            return STORAGE_CORRUPTION;
+        }
+
+        StorageResult result = redo_insert(handle, page, data, tuple.length, tuple.slot);
+        if (result != STORAGE_OK) {
+            return result;
+        }
+        data += tuple.length;
+        len -= tuple.length;
+    }
+    return STORAGE_OK;
+}
+
+/* A page's header.lsn is the end of the last record applied to it, so a
+ * record ending at or before it is already reflected in the page. The
+ * first insert into a new page formats it first, since the page (or the
+ * file extension that created it) may never have reached the disk. */
+static StorageResult redo_apply(StorageHandle* handle, const WALEntry* entry, uint64_t end_lsn) {
+    WALRedoHeader redo_header;
+    memcpy(&redo_header, entry->data, sizeof(WALRedoHeader));
+    const uint8_t* image = entry->data + sizeof(WALRedoHeader);
+    uint16_t image_len = (uint16_t)(entry->length - sizeof(WALRedoHeader));
+    bool init_page = entry->type == WAL_INSERT && (redo_header.flags & WAL_REDO_INIT_PAGE);
+
+    if (init_page && page_manager_extend_to(handle->page_manager, redo_header.page_id) != STORAGE_OK) {
+        return STORAGE_IO_ERROR;
+    }
+
+    Page* page = buffer_pool_get_page(handle->buffer_pool, handle->page_manager,
+                                      redo_header.page_id);
+    if (!page) {
+        return STORAGE_IO_ERROR;
+    }
+
+    StorageResult result = STORAGE_OK;
+    buffer_pool_latch_page(handle->buffer_pool, page);
+    if (page->header.lsn < end_lsn) {
+        switch (entry->type) {
+            case WAL_INSERT:
+                if (init_page) {
+                    /* Formatting wipes the buffer pool's bookkeeping too. */
+                    bool dirty = page->dirty;
+                    uint16_t pin_count = page->pin_count;
+                    uint32_t frame_id = page->frame_id;
+                    page_init(page, redo_header.page_id);
+                    page->dirty = dirty;
+                    page->pin_count = pin_count;
+                    page->frame_id = frame_id;
+                }
+                if (redo_header.flags & WAL_REDO_MULTI) {
+                    result = redo_insert_multi(handle, page, image, image_len);
+                } else {
+                    result = redo_insert(handle, page, image, image_len, redo_header.slot);
+                }
+                break;
+            case WAL_UPDATE:
+                result = page_update_tuple(handle->page_manager, page, redo_header.slot,
+                                           image, image_len);
+                break;
+            case WAL_DELETE:
+                result = page_delete_tuple(handle->page_manager, page, redo_header.slot);
+                break;
+        }
+        if (result == STORAGE_OK) {
+            page->header.lsn = end_lsn;
+            buffer_pool_mark_dirty(handle->buffer_pool, page, entry->lsn);
+        } else {
+            result = STORAGE_CORRUPTION;
+        }
+    }
+    buffer_pool_unlatch_page(handle->buffer_pool, page);
+
+    buffer_pool_unpin_page(handle->buffer_pool, page);
+    return result;
+}
+
+static void redo_fail(Redo* redo, StorageResult result) {
+    pthread_mutex_lock(&redo->lock);
+    if (redo->result == STORAGE_OK) {
+        redo->result = result;
+    }
+    pthread_mutex_unlock(&redo->lock);
+}
+
+static void* redo_worker_main(void* arg) {
+    RedoWorker* worker = arg;
+    Redo* redo = worker->redo;
+
+    pthread_mutex_lock(&worker->lock);
+    for (;;) {
+        while (!worker->queue_head && !worker->stop) {
+            pthread_cond_wait(&worker->cond, &worker->lock);
+        }
+        RedoBatch* batch = worker->queue_head;
+        if (!batch) {
+            break;
+        }
+        worker->queue_head = batch->next;
+        if (!worker->queue_head) {
+            worker->queue_tail = NULL;
+        }
+        pthread_mutex_unlock(&worker->lock);
+
+        for (size_t offset = 0; offset < batch->used;) {
+            uint64_t end_lsn;
+            memcpy(&end_lsn, batch->data + offset, sizeof(uint64_t));
+            const WALEntry* entry = (const WALEntry*)(batch->data + offset + sizeof(uint64_t));
+            StorageResult result = redo_apply(redo->handle, entry, end_lsn);
+            if (result != STORAGE_OK) {
+                redo_fail(redo, result);
+            }
+            offset += redo_record_size(entry);
+        }
+
+        pthread_mutex_lock(&worker->lock);
+        batch->used = 0;
+        batch->next = worker->free_batches;
+        worker->free_batches = batch;
+        pthread_cond_broadcast(&worker->cond);
+    }
+    pthread_mutex_unlock(&worker->lock);
+    return NULL;
+}
+
+/* Hands the dispatcher's current batch to the worker. */
+static void redo_submit(RedoWorker* worker) {
+    RedoBatch* batch = worker->filling;
+    if (!batch || batch->used == 0) {
+        return;
+    }
+    worker->filling = NULL;
+
+    pthread_mutex_lock(&worker->lock);
+    batch->next = NULL;
+    if (worker->queue_tail) {
+        worker->queue_tail->next = batch;
+    } else {
+        worker->queue_head = batch;
+    }
+    worker->queue_tail = batch;
+    pthread_cond_broadcast(&worker->cond);
+    pthread_mutex_unlock(&worker->lock);
+}
+
+static RedoBatch* redo_take_batch(RedoWorker* worker) {
+    pthread_mutex_lock(&worker->lock);
+    while (!worker->free_batches) {
+        pthread_cond_wait(&worker->cond, &worker->lock);
+    }
+    RedoBatch* batch = worker->free_batches;
+    worker->free_batches = batch->next;
+    pthread_mutex_unlock(&worker->lock);
+    return batch;
+}
+
+static void redo_stop_workers(Redo* redo) {
+    for (size_t i = 0; i < redo->num_workers; i++) {
+        RedoWorker* worker = &redo->workers[i];
+        if (!worker->started) {
+            continue;
+        }
+        pthread_mutex_lock(&worker->lock);
+        worker->stop = true;
+        pthread_cond_broadcast(&worker->cond);
+        pthread_mutex_unlock(&worker->lock);
+        pthread_join(worker->thread, NULL);
+    }
+}
+
+static void redo_free(Redo* redo) {
+    for (size_t i = 0; i < redo->num_workers; i++) {
+        RedoWorker* worker = &redo->workers[i];
+        free(worker->filling);
+        while (worker->free_batches) {
+            RedoBatch* next = worker->free_batches->next;
+            free(worker->free_batches);
+            worker->free_batches = next;
+        }
+        pthread_mutex_destroy(&worker->lock);
+        pthread_cond_destroy(&worker->cond);
+    }
+    pthread_mutex_destroy(&redo->lock);
+    free(redo->workers);
+    free(redo);
+}
+
+/* Starts a redo pass with num_workers threads. With one worker or fewer,
+ * records are applied directly by redo_dispatch. dirty (sorted in place,
+ * and borrowed until redo_finish) is the starting checkpoint's dirty page
+ * table, taken at checkpoint_lsn; pass checkpoint_lsn 0 without one. */
+Redo* redo_begin(StorageHandle* handle, size_t num_workers, uint64_t checkpoint_lsn,
+                 DirtyPageEntry* dirty, size_t num_dirty) {
+    if (num_workers > REDO_MAX_WORKERS) {
+        num_workers = REDO_MAX_WORKERS;
+    }
+    if (num_workers <= 1) {
+        num_workers = 0;
+    }
+
+    Redo* redo = calloc(1, sizeof(Redo));
+    if (!redo) return NULL;
+    redo->handle = handle;
+    redo->result = STORAGE_OK;
+    redo->checkpoint_lsn = checkpoint_lsn;
+    redo->dirty = dirty;
+    redo->num_dirty = num_dirty;
+    if (num_dirty > 1) {
+        qsort(dirty, num_dirty, sizeof(DirtyPageEntry), redo_compare_dirty);
+    }
+    pthread_mutex_init(&redo->lock, NULL);
+
+    if (num_workers > 0) {
+        redo->workers = calloc(num_workers, sizeof(RedoWorker));
+        if (!redo->workers) {
+            pthread_mutex_destroy(&redo->lock);
+            free(redo);
+            return NULL;
+        }
+    }
+
+    /* num_workers counts initialised workers, so cleanup after a partial
+     * start touches only those. */
+    bool ok = true;
+    for (size_t i = 0; i < num_workers && ok; i++) {
+        RedoWorker* worker = &redo->workers[i];
+        redo->num_workers = i + 1;
+        worker->redo = redo;
+        worker->last_prefetch = WAL_NO_PAGE;
+        pthread_mutex_init(&worker->lock, NULL);
+        pthread_cond_init(&worker->cond, NULL);
+        for (size_t b = 0; b < REDO_BATCHES_PER_WORKER && ok; b++) {
+            RedoBatch* batch = malloc(sizeof(RedoBatch));
+            if (!batch) {
+                ok = false;
+                break;
+            }
+            batch->used = 0;
+            batch->next = worker->free_batches;
+            worker->free_batches = batch;
+        }
+        if (ok) {
+            ok = pthread_create(&worker->thread, NULL, redo_worker_main, worker) == 0;
+            worker->started = ok;
+        }
+    }
+
+    if (!ok) {
+        redo_stop_workers(redo);
+        redo_free(redo);
+        return NULL;
+    }
+    return redo;
+}
+
+/* Routes one replayed record. Records that touch no page, or that the
+ * checkpoint shows are already on disk, are ignored.
+ * The target page is prefetched so its read overlaps the worker's
+ * backlog rather than stalling it. */
+StorageResult redo_dispatch(Redo* redo, const WALEntry* entry, uint64_t end_lsn) {
+    WALRedoHeader redo_header;
+    if (!redo_is_page_record(entry, &redo_header) ||
+        !redo_needed(redo, entry, redo_header.page_id)) {
+        return STORAGE_OK;
+    }
+
+    if (redo->num_workers == 0) {
+        return redo_apply(redo->handle, entry, end_lsn);
+    }
+
+    RedoWorker* worker = &redo->workers[redo_header.page_id % redo->num_workers];
+    if (worker->last_prefetch != redo_header.page_id) {
+        storage_prefetch_pages(redo->handle, redo_header.page_id, 1);
+        worker->last_prefetch = redo_header.page_id;
+    }
+
+    size_t size = redo_record_size(entry);
+    if (worker->filling && worker->filling->used + size > REDO_BATCH_BYTES) {
+        redo_submit(worker);
+    }
+    if (!worker->filling) {
+        worker->filling = redo_take_batch(worker);
+    }
+
+    RedoBatch* batch = worker->filling;
+    memcpy(batch->data + batch->used, &end_lsn, sizeof(uint64_t));
+    memcpy(batch->data + batch->used + sizeof(uint64_t), entry, sizeof(WALEntry) + entry->length);
+    batch->used += size;
+    return STORAGE_OK;
+}
+
+/* Waits for every dispatched record to be applied and tears the workers
+ * down. Returns the first failure, if any. */
+StorageResult redo_finish(Redo* redo) {
+    for (size_t i = 0; i < redo->num_workers; i++) {
+        redo_submit(&redo->workers[i]);
+    }
+    redo_stop_workers(redo);
+
+    StorageResult result = redo->result;
+    redo_free(redo);
+    return result;
+}
@@ -5,46 +5,532 @@
 #include <string.h>
 #include <errno.h>
 
+typedef struct Redo Redo;
+
+extern Redo* redo_begin(StorageHandle* handle, size_t num_workers, uint64_t checkpoint_lsn,
+                        DirtyPageEntry* dirty, size_t num_dirty);
+extern StorageResult redo_dispatch(Redo* redo, const WALEntry* entry, uint64_t end_lsn);
+extern StorageResult redo_finish(Redo* redo);
+
+extern size_t lz_compress_bound(size_t len);
+extern size_t lz_compress(const void* src, size_t len, void* dst, size_t cap);
+extern bool lz_decompress(const void* src, size_t len, void* dst, size_t out_len);
+
+extern bool control_file_read(const char* data_dir, uint64_t* checkpoint_lsn, uint64_t* redo_lsn,
+                              DirtyPageEntry** dirty, size_t* num_dirty);
+
+/* Records are staged in a ring addressed by LSN (offset = lsn & mask),
+ * sized to a power of two no smaller than WAL_BUFFER_SIZE. The ring is
+ * split into WAL_RING_BUFFERS log buffers; finishing one wakes the
+ * writer thread so it is written while appenders fill the next. */
+#define WAL_DEFAULT_RING_BYTES (16 * WAL_BUFFER_SIZE)
+#define WAL_RING_BUFFERS 4
+#define WAL_INSERT_SLOTS 16
+#define WAL_SLOT_IDLE UINT64_MAX
+
+/* The log is a sequence of fixed-size segment files in <data_dir>/wal,
+ * named by segment number (lsn / WAL_SEGMENT_SIZE) in hex. Records never
+ * straddle two segments. Segments are preallocated when created and
+ * renamed to future numbers once a checkpoint makes them obsolete, so
+ * steady-state writes neither extend nor create files. */
+#define WAL_SEGMENT_SIZE (16 * 1024 * 1024)
+#define WAL_MAX_SPARE_SEGMENTS 4
+#define WAL_ZERO_CHUNK (1024 * 1024)
+
+/* Recovery reads segments through a window of this size, so its memory
+ * does not depend on the size of the log. It must hold the largest
+ * possible record (header + 64 KiB payload). */
+#define WAL_READ_WINDOW (256 * 1024)
+
+#define WAL_MAX_RECORD_PAYLOAD UINT16_MAX
+
+/* A new log starts at segment 1, so LSN 0 never names a record and can
+ * mean "no record" (a failed append). */
+#define WAL_FIRST_SEGMENT 1
+
+/* A writer advertises itself in an insertion slot for as long as it is
+ * reserving or copying. pos is a lower bound on the LSN it will write
+ * at, so no byte at or beyond pos can be assumed published. */
+typedef struct WALInsertSlot {
+    volatile uint64_t pos;
+    uint8_t padding[64 - sizeof(uint64_t)];
+} WALInsertSlot;
+
+/* Appends never take the lock. A writer claims an insertion slot,
+ * reserves its LSN range with a CAS on reserved_lsn, copies the record
+ * into the ring and releases the slot. The published prefix is the
+ * smallest advertised slot position (or reserved_lsn if none), so the
+ * flusher only ever writes bytes every writer below them has finished.
+ *
+ * Flushing is group commit: a committer either becomes the leader and
+ * writes + syncs the published prefix with the lock released, or waits on
+ * flushed_cond for the leader already running. */
 struct WAL {
-    int fd;
-    char* buffer;
-    size_t buffer_pos;
-    size_t buffer_capacity;
-    uint64_t next_lsn;
+    uint8_t* ring;
+    size_t ring_size;
+    size_t ring_mask;
+    size_t buffer_bytes;
+
+    volatile uint64_t reserved_lsn;   /* end of the last reservation */
+    volatile uint64_t written_lsn;    /* ring bytes before this are on disk and reusable */
+    volatile uint64_t flushed_lsn;    /* and these are durable */
+    WALInsertSlot slots[WAL_INSERT_SLOTS];
+
+    bool flushing;
+    /* Set while the writer precreates a segment, without the flushing
+     * flag, so committers keep flushing meanwhile. Anything else that
+     * creates or renames segment files waits for it to clear. */
+    bool preparing;
+    /* Sticky: once a write or sync fails, records in the lost batch can
+     * never be made durable, so every later commit fails too. */
+    bool failed;
     pthread_mutex_t lock;
-    char filepath[256];
+    pthread_cond_t flushed_cond;
+
+    /* Background writer: flushes whenever a log buffer fills and at
+     * least every writer_interval_ms, so commits usually find their
+     * records already durable and appenders rarely wait for ring space. */
+    pthread_t writer;
+    bool writer_running;
+    bool writer_stop;
+    bool writer_kick;
+    unsigned writer_interval_ms;
+    pthread_cond_t writer_cond;
+
+    /* Segment files. seg_fd/seg_no are owned by whoever holds the
+     * flushing flag; the rest change only under the lock. */
+    char dir[256];
+    int seg_fd;
+    uint64_t seg_no;
+    uint64_t oldest_seg;
+    uint64_t last_seg;      /* highest numbered file, including spares */
+
+    /* Payloads of at least compress_threshold bytes (0: never) are
+     * compressed when that makes them smaller. */
+    size_t compress_threshold;
+    volatile uint64_t compressed_records;
+    volatile uint64_t compress_input_bytes;
+    volatile uint64_t compress_output_bytes;
+    volatile uint64_t compress_ns;
+    volatile uint64_t decompress_ns;
 };
 
-static StorageResult wal_flush_internal(WAL* wal);
+static StorageResult wal_wait_durable(WAL* wal, uint64_t end_lsn);
+static void wal_lead_flush(WAL* wal);
+static void wal_prepare_next_segment(WAL* wal);
+uint64_t wal_append_record(StorageHandle* handle, const WALEntry* header,
+                           const WALFragment* fragments, size_t count, uint64_t* end_lsn);
+
+static void wal_segment_path(const WAL* wal, uint64_t seg, char* path, size_t size) {
+    snprintf(path, size, "%s/%016llx", wal->dir, (unsigned long long)seg);
+}
+
+/* Makes segment creation, renames and removals durable. */
+static void wal_sync_dir(const WAL* wal) {
+#ifndef _WIN32
+    int fd = open(wal->dir, O_RDONLY);
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+#else
+    (void)wal;
+#endif
+}
+
+/* CRC32C over the header with its crc field zeroed, then the payload.
+ * A WAL_SWITCH filler's payload is whatever was in the ring, so only its
+ * header is covered. */
+static uint32_t wal_entry_crc(const WALEntry* entry, const uint8_t* data) {
+    WALEntry header;
+    memcpy(&header, entry, sizeof(WALEntry));
+    header.crc = 0;
+
+    uint32_t crc = storage_crc32c(0, &header, sizeof(WALEntry));
+    if (header.type != WAL_SWITCH) {
+        crc = storage_crc32c(crc, data, header.length);
+    }
+    return crc;
+}
+
+/* A record is genuine only if it carries the LSN it was found at and its
+ * checksum matches. Stale bytes in a recycled segment carry older LSNs,
+ * zero fill has no valid type, and a torn write fails the CRC, so each
+ * marks the end of the log. The whole entry must already be in memory. */
+static bool wal_entry_valid(const WALEntry* entry, uint64_t lsn) {
+    uint16_t type = entry->type & WAL_TYPE_MASK;
+    uint16_t flags = entry->type & ~WAL_TYPE_MASK;
+    return entry->lsn == lsn &&
+           type >= WAL_INSERT && type <= WAL_SWITCH &&
+           (flags & ~(WAL_FLAG_CONTINUED | WAL_FLAG_CONTINUATION | WAL_FLAG_COMPRESSED)) == 0 &&
+           lsn % WAL_SEGMENT_SIZE + sizeof(WALEntry) + entry->length <= WAL_SEGMENT_SIZE &&
+           entry->crc == wal_entry_crc(entry, entry->data);
+}
+
+/* Start of the next record after one ending at lsn: the next segment if
+ * too little of this one is left for a header. */
+static uint64_t wal_next_record_lsn(uint64_t lsn) {
+    if (WAL_SEGMENT_SIZE - lsn % WAL_SEGMENT_SIZE < sizeof(WALEntry)) {
+        return lsn - lsn % WAL_SEGMENT_SIZE + WAL_SEGMENT_SIZE;
+    }
+    return lsn;
+}
+
+/* Sequential record reader over the segment files. window holds
+ * segment bytes [window_lsn, window_lsn + window_len); it is refilled
+ * from the record being read whenever that record is not wholly inside. */
+typedef struct WALReader {
+    const WAL* wal;
+    int fd;
+    uint64_t seg;
+    uint8_t* window;
+    uint64_t window_lsn;
+    size_t window_len;
+    bool error;             /* a segment was missing or unreadable */
+} WALReader;
+
+static bool wal_reader_init(WALReader* reader, const WAL* wal) {
+    reader->wal = wal;
+    reader->fd = -1;
+    reader->seg = UINT64_MAX;
+    reader->window = malloc(WAL_READ_WINDOW);
+    reader->window_lsn = 0;
+    reader->window_len = 0;
+    reader->error = false;
+    return reader->window != NULL;
+}
+
+static void wal_reader_close(WALReader* reader) {
+    if (reader->fd >= 0) {
+        close(reader->fd);
+    }
+    free(reader->window);
+}
+
+static bool wal_reader_open_segment(WALReader* reader, uint64_t seg) {
+    if (reader->fd >= 0) {
+        close(reader->fd);
+    }
+    reader->seg = seg;
+    reader->window_len = 0;
+
+    char path[300];
+    wal_segment_path(reader->wal, seg, path, sizeof(path));
+    reader->fd = open(path, O_RDONLY);
+    if (reader->fd < 0) {
+        return false;
+    }
+#if defined(__linux__) || defined(__FreeBSD__)
+    posix_fadvise(reader->fd, 0, WAL_SEGMENT_SIZE, POSIX_FADV_SEQUENTIAL);
+#endif
+    return true;
+}
+
+/* Refills the window starting at lsn, up to the end of its segment. */
+static bool wal_reader_fill(WALReader* reader, uint64_t lsn) {
+    size_t offset = lsn % WAL_SEGMENT_SIZE;
+    size_t want = WAL_SEGMENT_SIZE - offset;
+    if (want > WAL_READ_WINDOW) {
+        want = WAL_READ_WINDOW;
+    }
+
+    size_t total = 0;
+    while (total < want) {
+        ssize_t n = pread(reader->fd, reader->window + total, want - total,
+                          (off_t)(offset + total));
+        if (n < 0) {
+            reader->window_len = 0;
+            return false;
+        }
+        if (n == 0) {
+            break;
+        }
+        total += (size_t)n;
+    }
+    reader->window_lsn = lsn;
+    reader->window_len = total;
+    return true;
+}
+
+static bool wal_reader_has(const WALReader* reader, uint64_t lsn, size_t len) {
+    return lsn >= reader->window_lsn &&
+           lsn + len <= reader->window_lsn + reader->window_len;
+}
+
+/* Returns the genuine record at lsn, valid until the next call, or NULL
+ * at the end of the log. Sets error if the segment could not be read. */
+static const WALEntry* wal_reader_read(WALReader* reader, uint64_t lsn) {
+    uint64_t seg = lsn / WAL_SEGMENT_SIZE;
+    if (seg != reader->seg && !wal_reader_open_segment(reader, seg)) {
+        reader->error = true;
+        return NULL;
+    }
+    if (reader->fd < 0) {
+        reader->error = true;
+        return NULL;
+    }
+
+    if (!wal_reader_has(reader, lsn, sizeof(WALEntry)) && !wal_reader_fill(reader, lsn)) {
+        reader->error = true;
+        return NULL;
+    }
+    if (!wal_reader_has(reader, lsn, sizeof(WALEntry))) {
+        return NULL;
+    }
+
+    const WALEntry* entry = (const WALEntry*)(reader->window + (lsn - reader->window_lsn));
+    size_t entry_size = sizeof(WALEntry) + entry->length;
+    if (!wal_reader_has(reader, lsn, entry_size)) {
+        if (!wal_reader_fill(reader, lsn)) {
+            reader->error = true;
+            return NULL;
+        }
+        entry = (const WALEntry*)reader->window;
+        if (!wal_reader_has(reader, lsn, sizeof(WALEntry) + entry->length)) {
+            return NULL;
+        }
+    }
+
+    return wal_entry_valid(entry, lsn) ? entry : NULL;
+}
+
+/* Lists the segment directory, setting oldest_seg/last_seg. Returns
+ * false if there are no segments yet. */
+static bool wal_scan_segments(WAL* wal) {
+    DIR* dir = opendir(wal->dir);
+    if (!dir) {
+        return false;
+    }
+
+    bool found = false;
+    struct dirent* ent;
+    while ((ent = readdir(dir)) != NULL) {
+        if (strlen(ent->d_name) != 16 || strspn(ent->d_name, "0123456789abcdef") != 16) {
+            continue;
+        }
+        uint64_t seg = strtoull(ent->d_name, NULL, 16);
+        if (!found || seg < wal->oldest_seg) wal->oldest_seg = seg;
+        if (!found || seg > wal->last_seg) wal->last_seg = seg;
+        found = true;
+    }
+    closedir(dir);
+    return found;
+}
+
+/* Finds the end of the log: the newest segment whose first record is
+ * genuine holds it, and scanning that segment finds the last record.
+ * Spares renamed ahead of the log fail the first-record check. */
+static uint64_t wal_find_end(WAL* wal, WALReader* reader) {
+    if (!wal_scan_segments(wal)) {
+        wal->oldest_seg = WAL_FIRST_SEGMENT;
+        wal->last_seg = WAL_FIRST_SEGMENT;
+        return WAL_FIRST_SEGMENT * WAL_SEGMENT_SIZE;
+    }
+
+    for (uint64_t seg = wal->last_seg + 1; seg-- > wal->oldest_seg;) {
+        uint64_t base = seg * WAL_SEGMENT_SIZE;
+        uint64_t lsn = base;
+        const WALEntry* entry;
+        while (lsn / WAL_SEGMENT_SIZE == seg && (entry = wal_reader_read(reader, lsn)) != NULL) {
+            lsn = wal_next_record_lsn(lsn + sizeof(WALEntry) + entry->length);
+        }
+        if (lsn != base) {
+            return lsn;
+        }
+    }
+    uint64_t seg = wal->oldest_seg > WAL_FIRST_SEGMENT ? wal->oldest_seg : WAL_FIRST_SEGMENT;
+    return seg * WAL_SEGMENT_SIZE;
+}
+
+/* Creates segment seg fully allocated and zero filled, under a temporary
+ * name until complete. Writing the zeros (not just fallocate) matters:
+ * it converts unwritten extents up front, so later fdatasyncs on the
+ * segment flush data blocks only. */
+static int wal_create_segment(WAL* wal, uint64_t seg) {
+    char path[300];
+    char tmp_path[310];
+    wal_segment_path(wal, seg, path, sizeof(path));
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+    int fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+
+#if defined(__linux__) || defined(__FreeBSD__)
+    if (posix_fallocate(fd, 0, WAL_SEGMENT_SIZE) != 0) {
+        close(fd);
+        unlink(tmp_path);
+        return -1;
+    }
+#endif
+
+    uint8_t* zeros = calloc(1, WAL_ZERO_CHUNK);
+    bool ok = zeros != NULL;
+    for (size_t offset = 0; ok && offset < WAL_SEGMENT_SIZE; offset += WAL_ZERO_CHUNK) {
+        ok = pwrite(fd, zeros, WAL_ZERO_CHUNK, (off_t)offset) == WAL_ZERO_CHUNK;
+    }
+    free(zeros);
+
+    if (!ok || fsync(fd) != 0) {
+        close(fd);
+        unlink(tmp_path);
+        return -1;
+    }
+    close(fd);
+
+    if (rename(tmp_path, path) != 0) {
+        unlink(tmp_path);
+        return -1;
+    }
+    wal_sync_dir(wal);
+    return open(path, O_RDWR);
+}
+
+/* Records that segment files up to seg exist. Called with the lock
+ * held. */
+static void wal_note_segment(WAL* wal, uint64_t seg) {
+    if (seg > wal->last_seg) {
+        wal->last_seg = seg;
+    }
+}
 
-WAL* wal_create(const char* data_dir) {
+/* Makes seg the segment being written, syncing the previous one first.
+ * Reuses an existing (recycled or precreated) file when there is one.
+ * Called only by the flush leader. */
+static bool wal_open_segment(WAL* wal, uint64_t seg) {
+    if (wal->seg_fd >= 0 && wal->seg_no == seg) {
+        return true;
+    }
+    if (wal->seg_fd >= 0) {
+        if (fdatasync(wal->seg_fd) != 0) {
+            return false;
+        }
+        close(wal->seg_fd);
+        wal->seg_fd = -1;
+    }
+
+    char path[300];
+    wal_segment_path(wal, seg, path, sizeof(path));
+    int fd = open(path, O_RDWR);
+    if (fd < 0) {
+        /* The writer may be precreating this very file. */
+        pthread_mutex_lock(&wal->lock);
+        while (wal->preparing) {
+            pthread_cond_wait(&wal->flushed_cond, &wal->lock);
+        }
+        pthread_mutex_unlock(&wal->lock);
+
+        fd = open(path, O_RDWR);
+        if (fd < 0) {
+            fd = wal_create_segment(wal, seg);
+            if (fd >= 0) {
+                pthread_mutex_lock(&wal->lock);
+                wal_note_segment(wal, seg);
+                pthread_mutex_unlock(&wal->lock);
+            }
+        }
+    }
+    if (fd < 0) {
+        return false;
+    }
+
+    wal->seg_fd = fd;
+    wal->seg_no = seg;
+    return true;
+}
+
+static void* wal_writer_main(void* arg) {
+    WAL* wal = arg;
+
+    pthread_mutex_lock(&wal->lock);
+    while (!wal->writer_stop) {
+        if (!wal->writer_kick) {
+            pthread_cond_timedwait_ms(&wal->writer_cond, &wal->lock, wal->writer_interval_ms);
+        }
+        wal->writer_kick = false;
+
+        if (!wal->flushing && !wal->failed &&
+            atomic_load_u64(&wal->flushed_lsn) < atomic_load_u64(&wal->reserved_lsn)) {
+            wal_lead_flush(wal);
+        }
+        if (!wal->flushing && !wal->failed) {
+            wal_prepare_next_segment(wal);
+        }
+    }
+    pthread_mutex_unlock(&wal->lock);
+    return NULL;
+}
+
+static void wal_kick_writer(WAL* wal) {
+    pthread_mutex_lock(&wal->lock);
+    wal->writer_kick = true;
+    pthread_cond_signal(&wal->writer_cond);
+    pthread_mutex_unlock(&wal->lock);
+}
+
+/* ring_bytes is rounded up to a power of two (0 selects the default);
+ * writer_interval_ms of 0 runs without a background writer, leaving all
+ * flushing to committers. */
+WAL* wal_create(const char* data_dir, size_t ring_bytes, unsigned writer_interval_ms,
+                size_t compression_threshold) {
     WAL* wal = malloc(sizeof(WAL));
     if (!wal) return NULL;
 
-    snprintf(wal->filepath, sizeof(wal->filepath), "%s/wal.log", data_dir);
-    
-    wal->fd = open(wal->filepath, O_RDWR | O_CREAT | O_APPEND, 0644);
-    if (wal->fd < 0) {
-        free(wal);
-        return NULL;
+    wal->compress_threshold = compression_threshold;
+    wal->compressed_records = 0;
+    wal->compress_input_bytes = 0;
+    wal->compress_output_bytes = 0;
+    wal->compress_ns = 0;
+    wal->decompress_ns = 0;
+
+    if (ring_bytes == 0) {
+        ring_bytes = WAL_DEFAULT_RING_BYTES;
     }
+    wal->ring_size = WAL_BUFFER_SIZE;
+    while (wal->ring_size < ring_bytes) {
+        wal->ring_size <<= 1;
+    }
+    wal->buffer_bytes = wal->ring_size / WAL_RING_BUFFERS;
+
+    snprintf(wal->dir, sizeof(wal->dir), "%s/wal", data_dir);
+    mkdir(wal->dir, 0755);
+    wal->seg_fd = -1;
+    wal->seg_no = 0;
 
-    wal->buffer = malloc(WAL_BUFFER_SIZE);
-    if (!wal->buffer) {
-        close(wal->fd);
+    WALReader reader;
+    bool reader_ok = wal_reader_init(&reader, wal);
+    wal->ring = malloc(wal->ring_size);
+    if (!reader_ok || !wal->ring) {
+        wal_reader_close(&reader);
+        free(wal->ring);
         free(wal);
         return NULL;
     }
+    wal->ring_mask = wal->ring_size - 1;
 
-    wal->buffer_pos = 0;
-    wal->buffer_capacity = WAL_BUFFER_SIZE;
-    wal->next_lsn = 0;
-    pthread_mutex_init(&wal->lock, NULL);
+    uint64_t end = wal_find_end(wal, &reader);
+    wal_reader_close(&reader);
 
-    off_t file_size = lseek(wal->fd, 0, SEEK_END);
-    if (file_size > 0) {
-        wal->next_lsn = file_size;
+    for (size_t i = 0; i < WAL_INSERT_SLOTS; i++) {
+        wal->slots[i].pos = WAL_SLOT_IDLE;
     }
+    wal->flushing = false;
+    wal->preparing = false;
+    wal->failed = false;
+    pthread_mutex_init(&wal->lock, NULL);
+    pthread_cond_init(&wal->flushed_cond, NULL);
+
+    wal->reserved_lsn = end;
+    wal->written_lsn = end;
+    wal->flushed_lsn = end;
+
+    wal->writer_stop = false;
+    wal->writer_kick = false;
+    wal->writer_interval_ms = writer_interval_ms;
+    pthread_cond_init(&wal->writer_cond, NULL);
+    wal->writer_running = writer_interval_ms > 0 &&
+                          pthread_create(&wal->writer, NULL, wal_writer_main, wal) == 0;
 
     return wal;
 }
@@ -52,55 +538,410 @@ WAL* wal_create(const char* data_dir) {
 void wal_destroy(WAL* wal) {
     if (!wal) return;
 
-    wal_flush_internal(wal);
+    if (wal->writer_running) {
+        pthread_mutex_lock(&wal->lock);
+        wal->writer_stop = true;
+        pthread_cond_signal(&wal->writer_cond);
+        pthread_mutex_unlock(&wal->lock);
+        pthread_join(wal->writer, NULL);
+    }
+
+    pthread_mutex_lock(&wal->lock);
+    wal_wait_durable(wal, atomic_load_u64(&wal->reserved_lsn));
+    pthread_mutex_unlock(&wal->lock);
+
+    pthread_cond_destroy(&wal->writer_cond);
+    pthread_cond_destroy(&wal->flushed_cond);
     pthread_mutex_destroy(&wal->lock);
-    free(wal->buffer);
-    close(wal->fd);
+    free(wal->ring);
+    if (wal->seg_fd >= 0) {
+        close(wal->seg_fd);
+    }
     free(wal);
 }
 
-static StorageResult wal_flush_internal(WAL* wal) {
-    if (wal->buffer_pos == 0) return STORAGE_OK;
+/* End of the contiguous run of fully copied records. Reading
+ * reserved_lsn before the slots matters: any writer whose range lies
+ * below it advertised a slot before reserving, so the scan sees it. */
+static uint64_t wal_published_lsn(WAL* wal) {
+    uint64_t upto = atomic_load_u64(&wal->reserved_lsn);
+    for (size_t i = 0; i < WAL_INSERT_SLOTS; i++) {
+        uint64_t pos = atomic_load_u64(&wal->slots[i].pos);
+        if (pos < upto) {
+            upto = pos;
+        }
+    }
+    return upto;
+}
+
+/* Writes the ring bytes [from, to) into their segments, splitting where
+ * the ring wraps or a segment ends. */
+static bool wal_write_range(WAL* wal, uint64_t from, uint64_t to) {
+    while (from < to) {
+        if (!wal_open_segment(wal, from / WAL_SEGMENT_SIZE)) {
+            return false;
+        }
+
+        size_t offset = from & wal->ring_mask;
+        size_t seg_offset = from % WAL_SEGMENT_SIZE;
+        size_t len = to - from;
+        if (len > wal->ring_size - offset) {
+            len = wal->ring_size - offset;
+        }
+        if (len > WAL_SEGMENT_SIZE - seg_offset) {
+            len = WAL_SEGMENT_SIZE - seg_offset;
+        }
+
+        ssize_t written = pwrite(wal->seg_fd, wal->ring + offset, len, (off_t)seg_offset);
+        if (written != (ssize_t)len) {
+            return false;
+        }
+        from += len;
+    }
+    return true;
+}
+
+/* Flushes the published prefix as leader. Called with the lock held and
+ * no flush in progress; the lock is released for the write and sync.
+ * Writers cannot reuse ring space below written_lsn's new value until
+ * it is stored, so the range is stable while unlocked. */
+static void wal_lead_flush(WAL* wal) {
+    uint64_t from = atomic_load_u64(&wal->written_lsn);
+    uint64_t to = wal_published_lsn(wal);
+
+    if (to <= from) {
+        /* Nothing new is published; the writers ahead are mid-copy. */
+        pthread_mutex_unlock(&wal->lock);
+        sched_yield();
+        pthread_mutex_lock(&wal->lock);
+        return;
+    }
+
+    wal->flushing = true;
+    pthread_mutex_unlock(&wal->lock);
+
+    bool ok = wal_write_range(wal, from, to) && fdatasync(wal->seg_fd) == 0;
+
+    pthread_mutex_lock(&wal->lock);
+    wal->flushing = false;
+    if (ok) {
+        atomic_store_u64(&wal->written_lsn, to);
+        atomic_store_u64(&wal->flushed_lsn, to);
+    } else {
+        wal->failed = true;
+    }
+    pthread_cond_broadcast(&wal->flushed_cond);
+}
+
+/* Blocks until everything before end_lsn is durable, leading a flush if
+ * none is running. Targets past the end of the log are clamped, since
+ * nothing beyond reserved_lsn exists to wait for. Called with the lock
+ * held. */
+static StorageResult wal_wait_durable(WAL* wal, uint64_t end_lsn) {
+    uint64_t reserved = atomic_load_u64(&wal->reserved_lsn);
+    if (end_lsn > reserved) {
+        end_lsn = reserved;
+    }
+    while (wal->flushed_lsn < end_lsn && !wal->failed) {
+        if (wal->flushing) {
+            pthread_cond_wait(&wal->flushed_cond, &wal->lock);
+        } else {
+            wal_lead_flush(wal);
+        }
+    }
+    return wal->flushed_lsn >= end_lsn ? STORAGE_OK : STORAGE_IO_ERROR;
+}
+
+/* Everything before the returned LSN is on stable storage. */
+uint64_t wal_flushed_lsn(WAL* wal) {
+    return atomic_load_u64(&wal->flushed_lsn);
+}
 
-    ssize_t written = write(wal->fd, wal->buffer, wal->buffer_pos);
-    if (written < 0) {
-        return STORAGE_IO_ERROR;
+/* Makes the record starting at lsn durable, flushing only if it is not
+ * already. Used to enforce WAL-before-data when writing back pages. */
+StorageResult wal_flush_to(WAL* wal, uint64_t lsn) {
+    if (atomic_load_u64(&wal->flushed_lsn) > lsn) {
+        return STORAGE_OK;
     }
+    pthread_mutex_lock(&wal->lock);
+    StorageResult result = wal_wait_durable(wal, lsn + 1);
+    pthread_mutex_unlock(&wal->lock);
+    return result;
+}
 
-    if (fsync(wal->fd) < 0) {
-        return STORAGE_IO_ERROR;
+/* Claims a free insertion slot, advertising pos. Threads start probing
+ * at different slots (hashed from their stack address) to spread out. */
+static WALInsertSlot* wal_claim_slot(WAL* wal) {
+    uintptr_t probe = ((uintptr_t)&probe >> 12) * 0x9E3779B1U;
+    for (;;) {
+        for (size_t i = 0; i < WAL_INSERT_SLOTS; i++) {
+            WALInsertSlot* slot = &wal->slots[(probe + i) % WAL_INSERT_SLOTS];
+            uint64_t pos = atomic_load_u64(&wal->reserved_lsn);
+            if (atomic_load_u64(&slot->pos) == WAL_SLOT_IDLE &&
+                atomic_cas_u64(&slot->pos, WAL_SLOT_IDLE, pos)) {
+                return slot;
+            }
+        }
+        sched_yield();
     }
+}
 
-    wal->buffer_pos = 0;
-    return STORAGE_OK;
+/* Copies len bytes to the ring at lsn, wrapping at the end. */
+static void wal_copy_in(WAL* wal, uint64_t lsn, const void* src, size_t len) {
+    size_t offset = lsn & wal->ring_mask;
+    size_t first = len < wal->ring_size - offset ? len : wal->ring_size - offset;
+    memcpy(wal->ring + offset, src, first);
+    memcpy(wal->ring, (const uint8_t*)src + first, len - first);
+}
+
+/* Waits until the ring has room for everything before need_lsn, flushing
+ * if nobody else is. Returns false once the log has failed. */
+static bool wal_wait_for_room(WAL* wal, uint64_t need_lsn) {
+    pthread_mutex_lock(&wal->lock);
+    while (atomic_load_u64(&wal->written_lsn) + wal->ring_size < need_lsn && !wal->failed) {
+        if (wal->flushing) {
+            pthread_cond_wait(&wal->flushed_cond, &wal->lock);
+        } else {
+            wal_lead_flush(wal);
+        }
+    }
+    bool ok = !wal->failed;
+    pthread_mutex_unlock(&wal->lock);
+    return ok;
+}
+
+/* End of a chain of records carrying total payload bytes, laid out from
+ * start. A record that does not fit in the rest of its segment starts
+ * the next one, skipping the tail. */
+static uint64_t wal_chain_end(uint64_t start, size_t total) {
+    uint64_t pos = start;
+    do {
+        size_t chunk = total < WAL_MAX_RECORD_PAYLOAD ? total : WAL_MAX_RECORD_PAYLOAD;
+        size_t size = sizeof(WALEntry) + chunk;
+        size_t seg_left = WAL_SEGMENT_SIZE - pos % WAL_SEGMENT_SIZE;
+        if (size > seg_left) {
+            pos += seg_left;
+        }
+        pos += size;
+        total -= chunk;
+    } while (total > 0);
+    return pos;
+}
+
+/* Walks the fragments of a payload in order. */
+typedef struct {
+    const WALFragment* fragments;
+    size_t index;
+    size_t offset;
+} WALFragmentCursor;
+
+/* Copies the next len payload bytes into the ring at lsn, extending the
+ * running CRC as it goes. Each byte is read once. */
+static uint32_t wal_copy_fragments(WAL* wal, uint64_t lsn, WALFragmentCursor* cursor,
+                                   size_t len, uint32_t crc) {
+    while (len > 0) {
+        const WALFragment* fragment = &cursor->fragments[cursor->index];
+        size_t n = fragment->len - cursor->offset;
+        if (n == 0) {
+            cursor->index++;
+            cursor->offset = 0;
+            continue;
+        }
+        if (n > len) {
+            n = len;
+        }
+        const uint8_t* src = (const uint8_t*)fragment->data + cursor->offset;
+        crc = storage_crc32c(crc, src, n);
+        wal_copy_in(wal, lsn, src, n);
+        lsn += n;
+        len -= n;
+        cursor->offset += n;
+    }
+    return crc;
+}
+
+/* Compresses a payload of total bytes into a new buffer holding the
+ * uncompressed length (uint32_t) and an LZ block, described by *out.
+ * Returns the buffer to free, or NULL if compression would not shrink
+ * the payload (or memory is short); the payload is then logged as is. */
+static uint8_t* wal_compress_payload(WAL* wal, const WALFragment* fragments, size_t count,
+                                     size_t total, WALFragment* out) {
+    if (total > UINT32_MAX) {
+        return NULL;
+    }
+
+    uint64_t started = monotonic_ns();
+    size_t bound = sizeof(uint32_t) + lz_compress_bound(total);
+    uint8_t* buffer = malloc(bound + (count > 1 ? total : 0));
+    if (!buffer) {
+        return NULL;
+    }
+
+    /* The compressor needs the payload in one piece. */
+    const uint8_t* src = fragments[0].data;
+    if (count > 1) {
+        uint8_t* gathered = buffer + bound;
+        size_t offset = 0;
+        for (size_t i = 0; i < count; i++) {
+            memcpy(gathered + offset, fragments[i].data, fragments[i].len);
+            offset += fragments[i].len;
+        }
+        src = gathered;
+    }
+
+    uint32_t raw_len = (uint32_t)total;
+    memcpy(buffer, &raw_len, sizeof(uint32_t));
+    size_t packed = lz_compress(src, total, buffer + sizeof(uint32_t), total - 1);
+    atomic_fetch_add_u64(&wal->compress_ns, monotonic_ns() - started);
+
+    if (packed == 0 || sizeof(uint32_t) + packed >= total) {
+        free(buffer);
+        return NULL;
+    }
+    out->data = buffer;
+    out->len = sizeof(uint32_t) + packed;
+
+    atomic_fetch_add_u64(&wal->compressed_records, 1);
+    atomic_fetch_add_u64(&wal->compress_input_bytes, total);
+    atomic_fetch_add_u64(&wal->compress_output_bytes, out->len);
+    return buffer;
 }
 
 uint64_t storage_wal_append(StorageHandle* handle, const WALEntry* entry) {
+    WALFragment fragment = { entry->data, entry->length };
+    return storage_wal_append_v(handle, entry, &fragment, 1);
+}
+
+/* Appends a record whose payload is the concatenation of fragments; the
+ * type, transaction_id and logical_time come from header, and its length
+ * is ignored. Payloads over WAL_MAX_RECORD_PAYLOAD become a chain of
+ * CONTINUED/CONTINUATION records reserved in one go, so the chain is
+ * contiguous in the log. Returns the LSN of the last record (the only
+ * one, unless chained), which is what storage_wal_commit needs to make
+ * the whole chain durable; 0 if the chain cannot fit in the ring or the
+ * log has failed. */
+uint64_t storage_wal_append_v(StorageHandle* handle, const WALEntry* header,
+                              const WALFragment* fragments, size_t count) {
+    uint64_t end_lsn;
+    return wal_append_record(handle, header, fragments, count, &end_lsn);
+}
+
+/* storage_wal_append_v that also reports where the chain ends in the
+ * log. A page changed by the record must carry that end LSN: it is what
+ * redo compares the page LSN against, and compression makes it
+ * unpredictable for the caller. */
+uint64_t wal_append_record(StorageHandle* handle, const WALEntry* header,
+                           const WALFragment* fragments, size_t count, uint64_t* end_lsn) {
     WAL* wal = handle->wal;
-    
-    pthread_mutex_lock(&wal->lock);
 
-    uint64_t lsn = wal->next_lsn;
-    
-    size_t entry_size = sizeof(WALEntry) + entry->length;
-    
-    if (wal->buffer_pos + entry_size > wal->buffer_capacity) {
-        StorageResult result = wal_flush_internal(wal);
-        if (result != STORAGE_OK) {
-            pthread_mutex_unlock(&wal->lock);
+    size_t total = 0;
+    for (size_t i = 0; i < count; i++) {
+        total += fragments[i].len;
+    }
+
+    /* Compression runs before reservation, so it does not hold up other
+     * writers' published prefix. */
+    uint16_t flags = 0;
+    uint8_t* compressed = NULL;
+    WALFragment packed;
+    if (wal->compress_threshold > 0 && total >= wal->compress_threshold &&
+        (header->type & WAL_TYPE_MASK) != WAL_SWITCH) {
+        compressed = wal_compress_payload(wal, fragments, count, total, &packed);
+        if (compressed) {
+            fragments = &packed;
+            count = 1;
+            total = packed.len;
+            flags = WAL_FLAG_COMPRESSED;
+        }
+    }
+
+    WALInsertSlot* slot = wal_claim_slot(wal);
+
+    uint64_t start;
+    uint64_t end;
+    for (;;) {
+        start = atomic_load_u64(&wal->reserved_lsn);
+        /* Re-advertise before every attempt: a stale, lower pos would cap
+         * the published prefix below what a flush must reach to free the
+         * space this writer is waiting for. */
+        atomic_store_u64(&slot->pos, start);
+
+        end = wal_chain_end(start, total);
+        if (end - start > wal->ring_size) {
+            atomic_store_u64(&slot->pos, WAL_SLOT_IDLE);
+            free(compressed);
             return 0;
         }
+
+        if (end > atomic_load_u64(&wal->written_lsn) + wal->ring_size) {
+            if (!wal_wait_for_room(wal, end)) {
+                atomic_store_u64(&slot->pos, WAL_SLOT_IDLE);
+                free(compressed);
+                return 0;
+            }
+            continue;
+        }
+        if (atomic_cas_u64(&wal->reserved_lsn, start, end)) {
+            break;
+        }
     }
 
-    WALEntry* buffered_entry = (WALEntry*)(wal->buffer + wal->buffer_pos);
-    memcpy(buffered_entry, entry, sizeof(WALEntry));
-    buffered_entry->lsn = lsn;
-    memcpy(buffered_entry->data, entry->data, entry->length);
+    /* Checksums are computed here, after reservation and outside any
+     * lock, so they run in parallel across writers. */
+    WALFragmentCursor cursor = { fragments, 0, 0 };
+    uint64_t pos = start;
+    uint64_t lsn;
+    size_t remaining = total;
+    bool first = true;
+    do {
+        size_t chunk = remaining < WAL_MAX_RECORD_PAYLOAD ? remaining : WAL_MAX_RECORD_PAYLOAD;
+        size_t seg_left = WAL_SEGMENT_SIZE - pos % WAL_SEGMENT_SIZE;
+        if (sizeof(WALEntry) + chunk > seg_left) {
+            /* The skipped tail becomes a WAL_SWITCH record, or is left
+             * bare if too short even for a header. */
+            if (seg_left >= sizeof(WALEntry)) {
+                WALEntry filler;
+                memset(&filler, 0, sizeof(WALEntry));
+                filler.lsn = pos;
+                filler.type = WAL_SWITCH;
+                filler.length = (uint16_t)(seg_left - sizeof(WALEntry));
+                filler.crc = wal_entry_crc(&filler, NULL);
+                wal_copy_in(wal, pos, &filler, sizeof(WALEntry));
+            }
+            pos += seg_left;
+        }
 
-    wal->buffer_pos += entry_size;
-    wal->next_lsn += entry_size;
+        WALEntry record;
+        memcpy(&record, header, sizeof(WALEntry));
+        record.lsn = pos;
+        record.type = (header->type & WAL_TYPE_MASK) | flags;
+        if (!first) {
+            record.type |= WAL_FLAG_CONTINUATION;
+        }
+        if (remaining > chunk) {
+            record.type |= WAL_FLAG_CONTINUED;
+        }
+        record.length = (uint16_t)chunk;
+        record.crc = 0;
 
-    pthread_mutex_unlock(&wal->lock);
+        uint32_t crc = storage_crc32c(0, &record, sizeof(WALEntry));
+        record.crc = wal_copy_fragments(wal, pos + sizeof(WALEntry), &cursor, chunk, crc);
+        wal_copy_in(wal, pos, &record, sizeof(WALEntry));
+
+        lsn = pos;
+        first = false;
+        pos += sizeof(WALEntry) + chunk;
+        remaining -= chunk;
+    } while (remaining > 0);
+
+    atomic_store_u64(&slot->pos, WAL_SLOT_IDLE);
+    free(compressed);
+
+    /* This append completed a log buffer: hand it to the writer. */
+    if (wal->writer_running && start / wal->buffer_bytes != end / wal->buffer_bytes) {
+        wal_kick_writer(wal);
+    }
+    *end_lsn = end;
     return lsn;
 }
 
@@ -108,56 +949,227 @@ StorageResult storage_wal_flush(StorageHandle* handle) {
     WAL* wal = handle->wal;
     
     pthread_mutex_lock(&wal->lock);
-    StorageResult result = wal_flush_internal(wal);
+    StorageResult result = wal_wait_durable(wal, atomic_load_u64(&wal->reserved_lsn));
     pthread_mutex_unlock(&wal->lock);
     
     return result;
 }
 
+/* Commit point for a record returned by storage_wal_append: waits until
+ * it is durable. Concurrent committers share a single sync. */
+StorageResult storage_wal_commit(StorageHandle* handle, uint64_t lsn) {
+    return wal_flush_to(handle->wal, lsn);
+}
+
+/* End of the reserved log; every record appended so far lies below it. */
+uint64_t wal_insert_lsn(WAL* wal) {
+    return atomic_load_u64(&wal->reserved_lsn);
+}
+
+void wal_stats(WAL* wal, StorageMetrics* metrics) {
+    metrics->wal_compressed_records = atomic_load_u64(&wal->compressed_records);
+    metrics->wal_compress_input_bytes = atomic_load_u64(&wal->compress_input_bytes);
+    metrics->wal_compress_output_bytes = atomic_load_u64(&wal->compress_output_bytes);
+    metrics->wal_compress_ns = atomic_load_u64(&wal->compress_ns);
+    metrics->wal_decompress_ns = atomic_load_u64(&wal->decompress_ns);
+}
+
+/* Precreates the next segment once the current one is half used, so the
+ * flush that crosses into it finds the file ready. Run by the writer
+ * thread with the lock held. The zero fill and syncs run unlocked and
+ * without the flushing flag, so commits are not held up behind them;
+ * last_seg is only published once the file is complete. */
+static void wal_prepare_next_segment(WAL* wal) {
+    uint64_t reserved = atomic_load_u64(&wal->reserved_lsn);
+    uint64_t next = reserved / WAL_SEGMENT_SIZE + 1;
+    if (next <= wal->last_seg || reserved % WAL_SEGMENT_SIZE < WAL_SEGMENT_SIZE / 2) {
+        return;
+    }
+
+    wal->preparing = true;
+    pthread_mutex_unlock(&wal->lock);
+
+    int fd = wal_create_segment(wal, next);
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    pthread_mutex_lock(&wal->lock);
+    if (fd >= 0) {
+        wal_note_segment(wal, next);
+    }
+    wal->preparing = false;
+    pthread_cond_broadcast(&wal->flushed_cond);
+}
+
+/* Retires every segment wholly before keep_lsn (normally the redo point
+ * of the last checkpoint). Up to WAL_MAX_SPARE_SEGMENTS are renamed to
+ * the next unused numbers for reuse; the rest are removed. */
+void wal_recycle_segments(WAL* wal, uint64_t keep_lsn) {
+    pthread_mutex_lock(&wal->lock);
+    while (wal->flushing || wal->preparing) {
+        pthread_cond_wait(&wal->flushed_cond, &wal->lock);
+    }
+
+    uint64_t current = atomic_load_u64(&wal->reserved_lsn) / WAL_SEGMENT_SIZE;
+    if (wal->seg_fd >= 0 && wal->seg_no < current) {
+        current = wal->seg_no;
+    }
+    uint64_t keep_seg = keep_lsn / WAL_SEGMENT_SIZE;
+    if (keep_seg > current) {
+        keep_seg = current;
+    }
+
+    char path[300];
+    char spare[300];
+    bool changed = false;
+    for (uint64_t seg = wal->oldest_seg; seg < keep_seg; seg++) {
+        wal_segment_path(wal, seg, path, sizeof(path));
+        bool recycled = false;
+        if (wal->last_seg - current < WAL_MAX_SPARE_SEGMENTS) {
+            wal_segment_path(wal, wal->last_seg + 1, spare, sizeof(spare));
+            if (rename(path, spare) == 0) {
+                wal->last_seg++;
+                recycled = true;
+            }
+        }
+        if (!recycled) {
+            unlink(path);
+        }
+        changed = true;
+    }
+    if (keep_seg > wal->oldest_seg) {
+        wal->oldest_seg = keep_seg;
+    }
+    if (changed) {
+        wal_sync_dir(wal);
+    }
+
+    pthread_mutex_unlock(&wal->lock);
+}
+
+/* Expands a compressed record into scratch, which has room for a
+ * WAL_MAX_RECORD_PAYLOAD payload. Returns NULL if the payload is larger
+ * than that, so it cannot be a page change; *result becomes
+ * STORAGE_CORRUPTION if it does not decompress. */
+static const WALEntry* wal_expand_entry(WAL* wal, const WALEntry* entry, WALEntry* scratch,
+                                        StorageResult* result) {
+    uint32_t raw_len;
+    if (entry->length < sizeof(uint32_t)) {
+        *result = STORAGE_CORRUPTION;
+        return NULL;
+    }
+    memcpy(&raw_len, entry->data, sizeof(uint32_t));
+    if (raw_len > WAL_MAX_RECORD_PAYLOAD) {
+        return NULL;
+    }
+
+    uint64_t started = monotonic_ns();
+    bool ok = lz_decompress(entry->data + sizeof(uint32_t), entry->length - sizeof(uint32_t),
+                            scratch->data, raw_len);
+    atomic_fetch_add_u64(&wal->decompress_ns, monotonic_ns() - started);
+    if (!ok) {
+        *result = STORAGE_CORRUPTION;
+        return NULL;
+    }
+
+    memcpy(scratch, entry, sizeof(WALEntry));
+    scratch->type = entry->type & WAL_TYPE_MASK;
+    scratch->length = (uint16_t)raw_len;
+    return scratch;
+}
+
+/* Replays the log from the redo point of the last checkpoint (or, with
+ * none, the oldest retained segment) up to the durable end. Records are
+ * streamed through a fixed window, so memory use is the same whatever
+ * the size of the log; page changes are redone in parallel by redo.c. */
 StorageResult storage_wal_replay(StorageHandle* handle) {
     WAL* wal = handle->wal;
-    
-    off_t file_size = lseek(wal->fd, 0, SEEK_END);
-    if (file_size <= 0) return STORAGE_OK;
 
-    lseek(wal->fd, 0, SEEK_SET);
+    uint64_t end = atomic_load_u64(&wal->flushed_lsn);
+    uint64_t lsn = wal->oldest_seg * WAL_SEGMENT_SIZE;
 
-    uint8_t* replay_buffer = malloc(file_size);
-    if (!replay_buffer) return STORAGE_OOM;
+    uint64_t checkpoint_lsn = 0;
+    uint64_t redo_lsn = 0;
+    DirtyPageEntry* dirty = NULL;
+    size_t num_dirty = 0;
+    if (control_file_read(handle->data_dir, &checkpoint_lsn, &redo_lsn, &dirty, &num_dirty)) {
+        redo_lsn = wal_next_record_lsn(redo_lsn);
+        if (redo_lsn > lsn) {
+            lsn = redo_lsn;
+        }
+    }
+    if (lsn >= end) {
+        free(dirty);
+        return STORAGE_OK;
+    }
+
+    WALReader reader;
+    if (!wal_reader_init(&reader, wal)) {
+        wal_reader_close(&reader);
+        free(dirty);
+        return STORAGE_OOM;
+    }
 
-    ssize_t bytes_read = read(wal->fd, replay_buffer, file_size);
-    if (bytes_read != file_size) {
-        free(replay_buffer);
-        return STORAGE_IO_ERROR;
+    WALEntry* scratch = malloc(sizeof(WALEntry) + WAL_MAX_RECORD_PAYLOAD);
+    Redo* redo = scratch ? redo_begin(handle, handle->recovery_workers, checkpoint_lsn,
+                                      dirty, num_dirty) : NULL;
+    if (!redo) {
+        free(scratch);
+        wal_reader_close(&reader);
+        free(dirty);
+        return STORAGE_OOM;
     }
 
-    size_t offset = 0;
-    while (offset < file_size) {
-        WALEntry* entry = (WALEntry*)(replay_buffer + offset);
-        
-        size_t entry_size = sizeof(WALEntry) + entry->length;
-        if (offset + entry_size > file_size) {
+    StorageResult result = STORAGE_OK;
+    while (lsn < end && result == STORAGE_OK) {
+        const WALEntry* entry = wal_reader_read(&reader, lsn);
+        if (!entry) {
             break;
         }
 
-        switch (entry->type) {
-            case WAL_INSERT:
-                break;
-            case WAL_UPDATE:
-                break;
-            case WAL_DELETE:
-                break;
-            case WAL_COMMIT:
-                break;
-            case WAL_ABORT:
-                break;
-            case WAL_CHECKPOINT:
-                break;
+        /* Chained records carry payloads larger than any page change, so
+         * redo has nothing to apply from them. Page changes are redone
+         * as of the end of the record as logged, compressed or not. */
+        bool chained = (entry->type & (WAL_FLAG_CONTINUED | WAL_FLAG_CONTINUATION)) != 0;
+        uint64_t end_lsn = lsn + sizeof(WALEntry) + entry->length;
+
+        if (!chained) {
+            const WALEntry* change = entry;
+            switch (entry->type & WAL_TYPE_MASK) {
+                case WAL_INSERT:
+                case WAL_UPDATE:
+                case WAL_DELETE:
+                    if (entry->type & WAL_FLAG_COMPRESSED) {
+                        change = wal_expand_entry(wal, entry, scratch, &result);
+                    }
+                    if (change) {
+                        result = redo_dispatch(redo, change, end_lsn);
+                    }
+                    break;
+                case WAL_COMMIT:
+                    break;
+                case WAL_ABORT:
+                    break;
+                case WAL_CHECKPOINT:
+                    break;
+                case WAL_SWITCH:
+                    break;
+            }
         }
 
-        offset += entry_size;
+        lsn = wal_next_record_lsn(end_lsn);
     }
 
-    free(replay_buffer);
-    return STORAGE_OK;
+    StorageResult redo_result = redo_finish(redo);
+    if (result == STORAGE_OK) {
+        result = redo_result;
+    }
+    if (result == STORAGE_OK && reader.error) {
+        result = STORAGE_IO_ERROR;
+    }
+    wal_reader_close(&reader);
+    free(scratch);
+    free(dirty);
+    return result;
 }
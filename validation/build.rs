@@ -0,0 +1,43 @@
+use std::env;
+use std::path::PathBuf;
+
+fn main() {
+    let manifest_dir = PathBuf::from(env::var("CARGO_MANIFEST_DIR").unwrap());
+    let storage_dir = manifest_dir.join("../storage");
+
+    // On Unix the engine's file I/O goes through the crash simulator in
+    // crashfs/, which is built separately so it can reach the real calls.
+    let crashfs = env::var("CARGO_CFG_TARGET_FAMILY").unwrap() == "unix";
+    let mut storage = cc::Build::new();
+    if crashfs {
+        storage
+            .flag("-include")
+            .flag(manifest_dir.join("crashfs/crashfs.h").to_str().unwrap());
+        cc::Build::new()
+            .file(manifest_dir.join("crashfs/crashfs.c"))
+            .warnings(false)
+            .compile("crashfs");
+    }
+
+    storage
+        .file(storage_dir.join("entry.c"))
+        .file(storage_dir.join("wal/wal.c"))
+        .file(storage_dir.join("wal/crc32c.c"))
+        .file(storage_dir.join("wal/redo.c"))
+        .file(storage_dir.join("wal/control.c"))
+        .file(storage_dir.join("compression/lz.c"))
+        .file(storage_dir.join("pages/page_manager.c"))
+        .file(storage_dir.join("pages/page_io.c"))
+        .file(storage_dir.join("pages/fsm.c"))
+        .file(storage_dir.join("pages/checksum.c"))
+        .file(storage_dir.join("heap/heap.c"))
+        .file(storage_dir.join("buffer/buffer_pool.c"))
+        .file(storage_dir.join("memory/arena.c"))
+        .include(storage_dir.join("include"))
+        .warnings(false)
+        .compile("minsql_storage_validation");
+
+    println!("cargo:rerun-if-changed=../storage/");
+    println!("cargo:rerun-if-changed=crashfs/");
+    println!("cargo:rustc-link-lib=pthread");
+}
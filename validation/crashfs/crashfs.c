@@ -0,0 +1,525 @@
+/* Crash simulation for the storage engine's files. Writes to files under
+ * a tracked directory keep an undo image until an fsync or fdatasync of
+ * the same file makes them durable. crashfs_crash() rolls back every
+ * write not yet synced, leaving the directory as a power failure would
+ * at worst, and turns later writes, syncs, renames and unlinks under it
+ * into no-ops, so the abandoned engine can be shut down without touching
+ * the crashed image. Metadata changes (creating, renaming, extending
+ * files) count as durable at once.
+ *
+ * Built without crashfs.h, so the calls below reach the real functions.
+ * Page files opened with O_DIRECT or written through io_uring are not
+ * covered; crash tests run with buffered, synchronous page I/O. */
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#define CRASHFS_MAX_ROOTS 64
+#define CRASHFS_MAX_FDS 65536
+
+typedef struct {
+    char path[512];
+    size_t len;
+    bool active;
+    bool crashed;
+    uint64_t syncs;
+} CrashRoot;
+
+/* A file with unsynced writes, kept open through a duplicate so it can
+ * be rolled back after the engine has closed it. */
+typedef struct {
+    dev_t dev;
+    ino_t ino;
+    int fd;
+    int root;
+} CrashFile;
+
+typedef struct {
+    uint64_t seq;
+    size_t file;
+    off_t offset;
+    size_t len;
+    off_t old_size;
+    uint8_t* old;
+} CrashUndo;
+
+static pthread_mutex_t crashfs_lock = PTHREAD_MUTEX_INITIALIZER;
+static CrashRoot crashfs_roots[CRASHFS_MAX_ROOTS];
+static int crashfs_fd_root[CRASHFS_MAX_FDS];
+static bool crashfs_ready;
+
+static CrashFile* crashfs_files;
+static size_t crashfs_num_files;
+static size_t crashfs_cap_files;
+
+static CrashUndo* crashfs_undo;
+static size_t crashfs_num_undo;
+static size_t crashfs_cap_undo;
+static uint64_t crashfs_next_seq;
+
+/* A file whose next sync (or hole punch) blocks until
+ * crashfs_release_hold(). */
+typedef enum {
+    CRASHFS_HOLD_SYNC,
+    CRASHFS_HOLD_PUNCH
+} CrashHoldKind;
+
+static pthread_cond_t crashfs_hold_cond = PTHREAD_COND_INITIALIZER;
+static struct stat crashfs_hold_file;
+static CrashHoldKind crashfs_hold_kind;
+static bool crashfs_holding;
+static bool crashfs_held;
+
+/* A file whose writes fail with EIO while set. */
+static struct stat crashfs_fail_file;
+static bool crashfs_failing;
+
+static void crashfs_init(void) {
+    if (!crashfs_ready) {
+        for (int i = 0; i < CRASHFS_MAX_FDS; i++) {
+            crashfs_fd_root[i] = -1;
+        }
+        crashfs_ready = true;
+    }
+}
+
+static void* crashfs_grow(void* array, size_t* cap, size_t elem) {
+    size_t next = *cap ? *cap * 2 : 64;
+    void* grown = realloc(array, next * elem);
+    if (!grown) {
+        fprintf(stderr, "crashfs: out of memory\n");
+        abort();
+    }
+    *cap = next;
+    return grown;
+}
+
+static int crashfs_root_of_path(const char* path) {
+    for (int i = 0; i < CRASHFS_MAX_ROOTS; i++) {
+        CrashRoot* root = &crashfs_roots[i];
+        if (root->active && strncmp(path, root->path, root->len) == 0 &&
+            (path[root->len] == '/' || path[root->len] == '\0')) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static int crashfs_root_of_fd(int fd) {
+    crashfs_init();
+    return fd >= 0 && fd < CRASHFS_MAX_FDS ? crashfs_fd_root[fd] : -1;
+}
+
+static bool crashfs_path_crashed(const char* path) {
+    int root = crashfs_root_of_path(path);
+    return root >= 0 && crashfs_roots[root].crashed;
+}
+
+static size_t crashfs_file_of(int fd, int root, const struct stat* st) {
+    for (size_t i = 0; i < crashfs_num_files; i++) {
+        if (crashfs_files[i].dev == st->st_dev && crashfs_files[i].ino == st->st_ino) {
+            return i;
+        }
+    }
+    if (crashfs_num_files == crashfs_cap_files) {
+        crashfs_files = crashfs_grow(crashfs_files, &crashfs_cap_files, sizeof(CrashFile));
+    }
+    CrashFile* file = &crashfs_files[crashfs_num_files];
+    file->dev = st->st_dev;
+    file->ino = st->st_ino;
+    file->fd = dup(fd);
+    file->root = root;
+    if (file->fd < 0) {
+        fprintf(stderr, "crashfs: dup failed: %s\n", strerror(errno));
+        abort();
+    }
+    return crashfs_num_files++;
+}
+
+/* Saves what [offset, offset + len) of fd holds now, and its size. */
+static void crashfs_save(int fd, int root, off_t offset, size_t len) {
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        return;
+    }
+
+    size_t old_len = 0;
+    if (offset < st.st_size) {
+        old_len = (size_t)(st.st_size - offset) < len ? (size_t)(st.st_size - offset) : len;
+    }
+    uint8_t* old = NULL;
+    if (old_len > 0) {
+        old = malloc(old_len);
+        if (!old || pread(fd, old, old_len, offset) != (ssize_t)old_len) {
+            fprintf(stderr, "crashfs: cannot read back %zu bytes at %lld\n", old_len,
+                    (long long)offset);
+            abort();
+        }
+    }
+
+    if (crashfs_num_undo == crashfs_cap_undo) {
+        crashfs_undo = crashfs_grow(crashfs_undo, &crashfs_cap_undo, sizeof(CrashUndo));
+    }
+    CrashUndo* undo = &crashfs_undo[crashfs_num_undo++];
+    undo->seq = crashfs_next_seq++;
+    undo->file = crashfs_file_of(fd, root, &st);
+    undo->offset = offset;
+    undo->len = old_len;
+    undo->old_size = st.st_size;
+    undo->old = old;
+}
+
+/* Drops the undo images older than before of the files that match, and
+ * closes the files left with none. Undo entries refer to files by
+ * index, so both arrays are compacted together. */
+static void crashfs_forget(bool (*match)(const CrashFile* file, const void* arg),
+                           const void* arg, uint64_t before) {
+    size_t* remap = calloc(crashfs_num_files + 1, sizeof(size_t));
+    size_t kept_undo = 0;
+    for (size_t i = 0; i < crashfs_num_undo; i++) {
+        CrashUndo undo = crashfs_undo[i];
+        if (undo.seq < before && match(&crashfs_files[undo.file], arg)) {
+            free(undo.old);
+        } else {
+            remap[undo.file] = 1;
+            crashfs_undo[kept_undo++] = undo;
+        }
+    }
+    crashfs_num_undo = kept_undo;
+
+    size_t kept_files = 0;
+    for (size_t i = 0; i < crashfs_num_files; i++) {
+        if (!remap[i] && match(&crashfs_files[i], arg)) {
+            close(crashfs_files[i].fd);
+            remap[i] = SIZE_MAX;
+        } else {
+            remap[i] = kept_files;
+            crashfs_files[kept_files++] = crashfs_files[i];
+        }
+    }
+    crashfs_num_files = kept_files;
+
+    for (size_t i = 0; i < crashfs_num_undo; i++) {
+        crashfs_undo[i].file = remap[crashfs_undo[i].file];
+    }
+    free(remap);
+}
+
+static bool crashfs_match_inode(const CrashFile* file, const void* arg) {
+    const struct stat* st = arg;
+    return file->dev == st->st_dev && file->ino == st->st_ino;
+}
+
+static bool crashfs_match_root(const CrashFile* file, const void* arg) {
+    return file->root == *(const int*)arg;
+}
+
+static bool crashfs_same_file(int fd, const struct stat* file) {
+    struct stat st;
+    return fstat(fd, &st) == 0 && st.st_dev == file->st_dev && st.st_ino == file->st_ino;
+}
+
+/* Blocks, with crashfs_lock held, while fd is the file of a hold of
+ * this kind. */
+static void crashfs_wait_hold(int fd, CrashHoldKind kind) {
+    if (!crashfs_holding || crashfs_hold_kind != kind ||
+        !crashfs_same_file(fd, &crashfs_hold_file)) {
+        return;
+    }
+    crashfs_held = true;
+    pthread_cond_broadcast(&crashfs_hold_cond);
+    while (crashfs_holding) {
+        pthread_cond_wait(&crashfs_hold_cond, &crashfs_lock);
+    }
+}
+
+int crashfs_open(const char* path, int flags, ...) {
+    mode_t mode = 0;
+    if (flags & O_CREAT) {
+        va_list args;
+        va_start(args, flags);
+        mode = (mode_t)va_arg(args, int);
+        va_end(args);
+    }
+
+    pthread_mutex_lock(&crashfs_lock);
+    crashfs_init();
+    int root = crashfs_root_of_path(path);
+    if (root >= 0 && crashfs_roots[root].crashed) {
+        flags &= ~O_TRUNC;
+    }
+    int fd = open(path, flags, mode);
+    if (fd >= 0 && fd < CRASHFS_MAX_FDS) {
+        crashfs_fd_root[fd] = root;
+    }
+    pthread_mutex_unlock(&crashfs_lock);
+    return fd;
+}
+
+int crashfs_close(int fd) {
+    pthread_mutex_lock(&crashfs_lock);
+    crashfs_init();
+    if (fd >= 0 && fd < CRASHFS_MAX_FDS) {
+        crashfs_fd_root[fd] = -1;
+    }
+    pthread_mutex_unlock(&crashfs_lock);
+    return close(fd);
+}
+
+ssize_t crashfs_pwrite(int fd, const void* buf, size_t count, off_t offset) {
+    pthread_mutex_lock(&crashfs_lock);
+    if (crashfs_failing && crashfs_same_file(fd, &crashfs_fail_file)) {
+        pthread_mutex_unlock(&crashfs_lock);
+        errno = EIO;
+        return -1;
+    }
+    int root = crashfs_root_of_fd(fd);
+    if (root >= 0 && crashfs_roots[root].crashed) {
+        pthread_mutex_unlock(&crashfs_lock);
+        return (ssize_t)count;
+    }
+    if (root >= 0) {
+        crashfs_save(fd, root, offset, count);
+    }
+    ssize_t done = pwrite(fd, buf, count, offset);
+    pthread_mutex_unlock(&crashfs_lock);
+    return done;
+}
+
+/* The real sync runs unlocked, as a slow disk would let other writes
+ * proceed; only writes issued before it started become durable. */
+static int crashfs_sync(int fd, bool data_only) {
+    pthread_mutex_lock(&crashfs_lock);
+    int root = crashfs_root_of_fd(fd);
+    bool crashed = root >= 0 && crashfs_roots[root].crashed;
+    if (!crashed) {
+        crashfs_wait_hold(fd, CRASHFS_HOLD_SYNC);
+    }
+    uint64_t before = crashfs_next_seq;
+    pthread_mutex_unlock(&crashfs_lock);
+    if (crashed) {
+        return 0;
+    }
+
+    int result = data_only ? fdatasync(fd) : fsync(fd);
+    struct stat st;
+    if (result == 0 && root >= 0 && fstat(fd, &st) == 0) {
+        pthread_mutex_lock(&crashfs_lock);
+        crashfs_forget(crashfs_match_inode, &st, before);
+        crashfs_roots[root].syncs++;
+        pthread_mutex_unlock(&crashfs_lock);
+    }
+    return result;
+}
+
+int crashfs_fsync(int fd) {
+    return crashfs_sync(fd, false);
+}
+
+int crashfs_fdatasync(int fd) {
+    return crashfs_sync(fd, true);
+}
+
+int crashfs_posix_fallocate(int fd, off_t offset, off_t len) {
+    pthread_mutex_lock(&crashfs_lock);
+    int root = crashfs_root_of_fd(fd);
+    int result = 0;
+    if (root < 0 || !crashfs_roots[root].crashed) {
+        result = posix_fallocate(fd, offset, len);
+    }
+    pthread_mutex_unlock(&crashfs_lock);
+    return result;
+}
+
+/* Punching a hole changes data, so it is undone like a write. */
+int crashfs_fallocate(int fd, int mode, off_t offset, off_t len) {
+#if defined(__linux__)
+    pthread_mutex_lock(&crashfs_lock);
+    int root = crashfs_root_of_fd(fd);
+    int result = 0;
+    if (root < 0 || !crashfs_roots[root].crashed) {
+        crashfs_wait_hold(fd, CRASHFS_HOLD_PUNCH);
+        if (root >= 0) {
+            crashfs_save(fd, root, offset, (size_t)len);
+        }
+        result = fallocate(fd, mode, offset, len);
+    }
+    pthread_mutex_unlock(&crashfs_lock);
+    return result;
+#else
+    (void)fd;
+    (void)mode;
+    (void)offset;
+    (void)len;
+    errno = EOPNOTSUPP;
+    return -1;
+#endif
+}
+
+int crashfs_rename(const char* from, const char* to) {
+    pthread_mutex_lock(&crashfs_lock);
+    int result = 0;
+    if (!crashfs_path_crashed(from) && !crashfs_path_crashed(to)) {
+        result = rename(from, to);
+    }
+    pthread_mutex_unlock(&crashfs_lock);
+    return result;
+}
+
+int crashfs_unlink(const char* path) {
+    pthread_mutex_lock(&crashfs_lock);
+    int result = 0;
+    if (!crashfs_path_crashed(path)) {
+        result = unlink(path);
+    }
+    pthread_mutex_unlock(&crashfs_lock);
+    return result;
+}
+
+/* Starts recording writes to files under dir. Files opened before this
+ * are not tracked. */
+int crashfs_track(const char* dir) {
+    pthread_mutex_lock(&crashfs_lock);
+    crashfs_init();
+    int result = -1;
+    for (int i = 0; i < CRASHFS_MAX_ROOTS; i++) {
+        CrashRoot* root = &crashfs_roots[i];
+        if (!root->active && strlen(dir) < sizeof(root->path)) {
+            strcpy(root->path, dir);
+            root->len = strlen(dir);
+            root->active = true;
+            root->crashed = false;
+            root->syncs = 0;
+            result = 0;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&crashfs_lock);
+    return result;
+}
+
+static int crashfs_hold(const char* path, CrashHoldKind kind) {
+    pthread_mutex_lock(&crashfs_lock);
+    int result = stat(path, &crashfs_hold_file);
+    if (result == 0) {
+        crashfs_hold_kind = kind;
+        crashfs_holding = true;
+        crashfs_held = false;
+    }
+    pthread_mutex_unlock(&crashfs_lock);
+    return result;
+}
+
+/* Makes the next sync of path block until crashfs_release_hold(), so a
+ * test can act inside a window that a sync opens. */
+int crashfs_hold_sync(const char* path) {
+    return crashfs_hold(path, CRASHFS_HOLD_SYNC);
+}
+
+/* As crashfs_hold_sync(), for the next hole punched in path. The hold
+ * is taken before the punch reaches the file. */
+int crashfs_hold_punch(const char* path) {
+    return crashfs_hold(path, CRASHFS_HOLD_PUNCH);
+}
+
+/* Waits until a call is blocked by a hold. */
+void crashfs_wait_held(void) {
+    pthread_mutex_lock(&crashfs_lock);
+    while (!crashfs_held) {
+        pthread_cond_wait(&crashfs_hold_cond, &crashfs_lock);
+    }
+    pthread_mutex_unlock(&crashfs_lock);
+}
+
+void crashfs_release_hold(void) {
+    pthread_mutex_lock(&crashfs_lock);
+    crashfs_holding = false;
+    crashfs_held = false;
+    pthread_cond_broadcast(&crashfs_hold_cond);
+    pthread_mutex_unlock(&crashfs_lock);
+}
+
+/* Makes writes to path fail with EIO, or succeed again. Applies whether
+ * or not path is under a tracked directory. */
+int crashfs_fail_writes(const char* path, int fail) {
+    pthread_mutex_lock(&crashfs_lock);
+    int result = 0;
+    if (fail) {
+        result = stat(path, &crashfs_fail_file);
+    }
+    crashfs_failing = fail && result == 0;
+    pthread_mutex_unlock(&crashfs_lock);
+    return result;
+}
+
+/* The number of syncs of files under dir since it was tracked, or -1 if
+ * it is not tracked. */
+long crashfs_syncs(const char* dir) {
+    pthread_mutex_lock(&crashfs_lock);
+    int root = crashfs_root_of_path(dir);
+    long syncs = root >= 0 ? (long)crashfs_roots[root].syncs : -1;
+    pthread_mutex_unlock(&crashfs_lock);
+    return syncs;
+}
+
+/* Rolls back every unsynced write under dir, newest first, and freezes
+ * it. Returns the number of writes undone. */
+long crashfs_crash(const char* dir) {
+    pthread_mutex_lock(&crashfs_lock);
+    int root = crashfs_root_of_path(dir);
+    long undone = -1;
+    if (root >= 0) {
+        undone = 0;
+        for (size_t i = crashfs_num_undo; i-- > 0;) {
+            CrashUndo* undo = &crashfs_undo[i];
+            CrashFile* file = &crashfs_files[undo->file];
+            if (file->root != root) {
+                continue;
+            }
+            if (undo->len > 0) {
+                pwrite(file->fd, undo->old, undo->len, undo->offset);
+            }
+            struct stat st;
+            if (fstat(file->fd, &st) == 0 && st.st_size > undo->old_size) {
+                if (ftruncate(file->fd, undo->old_size) != 0) {
+                    fprintf(stderr, "crashfs: truncate failed: %s\n", strerror(errno));
+                }
+            }
+            undone++;
+        }
+        crashfs_forget(crashfs_match_root, &root, UINT64_MAX);
+        crashfs_roots[root].crashed = true;
+    }
+    pthread_mutex_unlock(&crashfs_lock);
+    return undone;
+}
+
+/* Stops tracking dir, keeping its files as they are. Call it once the
+ * crashed engine is shut down, before restarting on the directory. */
+void crashfs_untrack(const char* dir) {
+    pthread_mutex_lock(&crashfs_lock);
+    int root = crashfs_root_of_path(dir);
+    if (root >= 0) {
+        crashfs_forget(crashfs_match_root, &root, UINT64_MAX);
+        for (int fd = 0; fd < CRASHFS_MAX_FDS; fd++) {
+            if (crashfs_fd_root[fd] == root) {
+                crashfs_fd_root[fd] = -1;
+            }
+        }
+        crashfs_roots[root].active = false;
+    }
+    pthread_mutex_unlock(&crashfs_lock);
+}
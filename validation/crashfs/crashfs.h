@@ -0,0 +1,36 @@
+/* Force-included into the storage sources built for validation, so their
+ * file writes, syncs and renames go through crashfs.c. The system headers
+ * come first; their include guards keep the macros below out of them. */
+#ifndef MINSQL_CRASHFS_H
+#define MINSQL_CRASHFS_H
+
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+int crashfs_open(const char* path, int flags, ...);
+int crashfs_close(int fd);
+ssize_t crashfs_pwrite(int fd, const void* buf, size_t count, off_t offset);
+int crashfs_fsync(int fd);
+int crashfs_fdatasync(int fd);
+int crashfs_posix_fallocate(int fd, off_t offset, off_t len);
+int crashfs_fallocate(int fd, int mode, off_t offset, off_t len);
+int crashfs_rename(const char* from, const char* to);
+int crashfs_unlink(const char* path);
+
+#define open crashfs_open
+#define close crashfs_close
+#define pwrite crashfs_pwrite
+#define fsync crashfs_fsync
+#define fdatasync crashfs_fdatasync
+#define posix_fallocate crashfs_posix_fallocate
+#define fallocate crashfs_fallocate
+#define rename crashfs_rename
+#define unlink crashfs_unlink
+
+#endif
@@ -0,0 +1,253 @@
+#[cfg(test)]
+mod tests {
+    use crate::storage::*;
+    use std::sync::mpsc;
+    use std::time::Duration;
+
+    fn fill_pages(dir: &TempDir, options: &StorageOptions, pages: u32) -> Vec<u64> {
+        let storage = Storage::open(dir.path(), options);
+        let mut row_ids = Vec::new();
+        let mut next = 0;
+        while row_ids.last().map_or(0, |&id| row_page(id) + 1) < pages {
+            row_ids.extend(storage.insert_rows(&make_rows(next, 100, 200)).unwrap());
+            next += 100;
+        }
+        row_ids
+    }
+
+    // A failed synchronous prefetch must release its frame exactly once;
+    // a frame freed twice is later handed to two pages at once.
+    #[test]
+    fn test_prefetch_corrupt_page_sync_io() {
+        let dir = TempDir::new("prefetch-corrupt");
+        let options = StorageOptions {
+            io_queue_depth: 0,
+            ..small_pool_options(64)
+        };
+        fill_pages(&dir, &options, 100);
+        flip_bit(&dir.file("pages.dat"), 3 * PAGE_SIZE as u64 + 4000);
+
+        let storage = Storage::open(dir.path(), &options);
+        for _ in 0..16 {
+            storage.prefetch(3, 1);
+        }
+        assert!(storage.pin(3).is_none());
+
+        let pinned: Vec<_> = (10..70).map(|id| storage.pin(id).unwrap()).collect();
+        for (page, id) in pinned.iter().zip(10..70) {
+            assert_eq!(page.page_id(), id);
+        }
+    }
+
+    // Two scans taking turns are each followed on their own, so both get
+    // read ahead rather than breaking each other's run.
+    #[test]
+    fn test_readahead_interleaved_scans() {
+        let dir = TempDir::new("readahead-streams");
+        let options = small_pool_options(256);
+        fill_pages(&dir, &options, 200);
+
+        let storage = Storage::open(dir.path(), &options);
+        for id in 0..64 {
+            drop(storage.pin(id).unwrap());
+            drop(storage.pin(100 + id).unwrap());
+        }
+        let metrics = storage.metrics();
+        assert!(
+            metrics.buffer_misses < 16,
+            "{} misses",
+            metrics.buffer_misses
+        );
+        assert!(
+            metrics.prefetch_hits > 100,
+            "{} prefetch hits",
+            metrics.prefetch_hits
+        );
+    }
+
+    // A dirty 2Q victim whose write-back fails stays in the pool and
+    // evictable; once writes succeed again, every frame can be reused.
+    #[cfg(unix)]
+    #[test]
+    fn test_2q_failed_write_back() {
+        let dir = TempDir::new("2q-write-back");
+        let options = crash_options(StorageOptions {
+            replacement_policy: ReplacementPolicy::TwoQ,
+            ..small_pool_options(8)
+        });
+        fill_pages(&dir, &options, 40);
+
+        let storage = Storage::open(dir.path(), &options);
+        for id in (0..24).step_by(3) {
+            storage.pin(id).unwrap().mark_dirty();
+        }
+        fail_writes(&dir.file("pages.dat"), true);
+        for id in (1..24).step_by(3) {
+            assert!(storage.pin(id).is_none());
+        }
+        fail_writes(&dir.file("pages.dat"), false);
+
+        for id in (1..40).step_by(3).chain((2..40).step_by(3)) {
+            assert_eq!(storage.pin(id).map(|page| page.page_id()), Some(id));
+        }
+    }
+
+    // Hits and misses for one pin of page_id.
+    fn pin_outcome(storage: &Storage, page_id: u32) -> (u64, u64) {
+        let before = storage.metrics();
+        drop(storage.pin(page_id).unwrap());
+        let after = storage.metrics();
+        (
+            after.buffer_hits - before.buffer_hits,
+            after.buffer_misses - before.buffer_misses,
+        )
+    }
+
+    // A page evicted from 2Q's probationary queue and asked for again
+    // while still remembered as a ghost moves to the main queue, where a
+    // later scan cannot evict it; a page touched twice while still in
+    // probation is scanned out like any other. Pages are visited with a
+    // stride so read-ahead stays out of the way.
+    #[test]
+    fn test_2q_ghost_promotion() {
+        let dir = TempDir::new("2q-ghosts");
+        let options = StorageOptions {
+            replacement_policy: ReplacementPolicy::TwoQ,
+            ..small_pool_options(16)
+        };
+        fill_pages(&dir, &options, 160);
+
+        let storage = Storage::open(dir.path(), &options);
+        pin_outcome(&storage, 0);
+        pin_outcome(&storage, 1);
+        assert_eq!(pin_outcome(&storage, 1), (1, 0));
+        // Fills the pool and evicts 0 and 1 from probation.
+        for id in (3..=48).step_by(3) {
+            pin_outcome(&storage, id);
+        }
+        assert_eq!(pin_outcome(&storage, 0), (0, 1));
+
+        for id in (50..=150).step_by(3) {
+            pin_outcome(&storage, id);
+        }
+        assert_eq!(pin_outcome(&storage, 0), (1, 0));
+        assert_eq!(pin_outcome(&storage, 1), (0, 1));
+    }
+
+    // Threads pinning pages across partitions, with far more pages than
+    // frames, must always get the page they asked for, intact.
+    #[test]
+    fn test_partitioned_pool_concurrent_pins() {
+        for policy in [ReplacementPolicy::Clock, ReplacementPolicy::TwoQ] {
+            let dir = TempDir::new("partitioned-pins");
+            let options = StorageOptions {
+                buffer_pool_frames: 48,
+                buffer_pool_partitions: 4,
+                replacement_policy: policy,
+                ..StorageOptions::default()
+            };
+            let row_ids = fill_pages(&dir, &options, 200);
+            let mut first_row = vec![usize::MAX; 200];
+            for (i, &row_id) in row_ids.iter().enumerate() {
+                let page = row_page(row_id) as usize;
+                if page < 200 && row_slot(row_id) == 0 {
+                    first_row[page] = i;
+                }
+            }
+
+            let storage = Storage::open(dir.path(), &options);
+            std::thread::scope(|scope| {
+                for t in 0..8u32 {
+                    let (storage, first_row) = (&storage, &first_row);
+                    scope.spawn(move || {
+                        for i in 0..2000u32 {
+                            let id = (t * 37 + i * 13) % 200;
+                            let page = storage.pin(id).unwrap();
+                            assert_eq!(page.page_id(), id);
+                            let row = make_row(first_row[id as usize], 200);
+                            assert_eq!(page.tuple(0), Some(row));
+                        }
+                    });
+                }
+            });
+            let metrics = storage.metrics();
+            assert!(metrics.buffer_misses > 200);
+        }
+    }
+
+    // Runs stall on another thread while the first WAL sync is held, then
+    // reports whether pinning page_id, which must be in the pool, still
+    // completes. A thread that waits for the log with the partition latch
+    // held blocks every other pin there.
+    fn pin_during_wal_stall(
+        storage: &Storage,
+        dir: &TempDir,
+        page_id: u32,
+        stall: impl Fn() + Send + Sync,
+    ) -> bool {
+        let hold = hold_sync(&dir.file("wal").join(format!("{:016x}", 1)));
+        let (pinned, pin_done) = mpsc::channel();
+        std::thread::scope(|scope| {
+            scope.spawn(|| stall());
+            hold.wait();
+            std::thread::sleep(Duration::from_millis(100));
+            scope.spawn(move || {
+                drop(storage.pin(page_id).unwrap());
+                pinned.send(()).unwrap();
+            });
+            let completed = pin_done.recv_timeout(Duration::from_secs(2)).is_ok();
+            drop(hold);
+            completed
+        })
+    }
+
+    // A flush waiting for the WAL before writing its page must not hold
+    // the partition latch.
+    #[cfg(unix)]
+    #[test]
+    fn test_flush_page_wal_wait_unlatched() {
+        let dir = TempDir::new("flush-unlatched");
+        let options = StorageOptions {
+            wal_writer_interval_ms: 0,
+            ..crash_options(small_pool_options(16))
+        };
+        let storage = Storage::open(dir.path(), &options);
+        let row_ids = storage.insert_rows(&make_rows(0, 100, 200)).unwrap();
+        let last = row_page(*row_ids.last().unwrap());
+        let resident = storage.pin(0).unwrap();
+
+        let completed = pin_during_wal_stall(&storage, &dir, 0, || {
+            std::thread::scope(|scope| {
+                scope.spawn(|| storage.insert_rows(&make_rows(100, 1, 200)).unwrap());
+                std::thread::sleep(Duration::from_millis(50));
+                assert_eq!(storage.flush_page(last), STORAGE_OK);
+            });
+        });
+        drop(resident);
+        assert!(completed, "pin waited for a flush's WAL sync");
+    }
+
+    // Eviction writes a dirty victim back, flushing the WAL first if the
+    // victim's last change is not yet durable. Neither may hold the
+    // partition latch.
+    #[cfg(unix)]
+    #[test]
+    fn test_eviction_write_back_unlatched() {
+        let dir = TempDir::new("evict-unlatched");
+        let options = StorageOptions {
+            wal_writer_interval_ms: 0,
+            ..crash_options(small_pool_options(16))
+        };
+        let storage = Storage::open(dir.path(), &options);
+        storage.insert_rows(&make_rows(0, 100, 200)).unwrap();
+        let resident = storage.pin(0).unwrap();
+
+        // One batch spans more pages than the pool holds, so it evicts
+        // pages it has changed but not yet committed.
+        let completed = pin_during_wal_stall(&storage, &dir, 0, || {
+            storage.insert_rows(&make_rows(100, 800, 200)).unwrap();
+        });
+        drop(resident);
+        assert!(completed, "pin waited for an eviction's WAL sync");
+    }
+}
@@ -1,27 +1,529 @@
 #[cfg(test)]
 mod tests {
+    use crate::storage::*;
+    use std::ops::Range;
+    use std::path::Path;
+    use std::sync::atomic::{AtomicBool, Ordering};
+    use std::sync::Mutex;
+
+    // Inserts rows batch * 20.. of each batch, 20 to a batch, and returns
+    // their row IDs.
+    fn insert_batches(storage: &Storage, batches: Range<usize>, len: usize) -> Vec<u64> {
+        let mut row_ids = Vec::new();
+        for batch in batches {
+            let rows = make_rows(batch * 20, 20, len);
+            row_ids.extend(storage.insert_rows(&rows).unwrap());
+        }
+        row_ids
+    }
+
+    fn assert_rows(storage: &Storage, row_ids: &[u64], len: usize) {
+        for (i, &row_id) in row_ids.iter().enumerate() {
+            assert_eq!(
+                storage.read_row(row_id),
+                Some(make_row(i, len)),
+                "row {} at page {} slot {}",
+                i,
+                row_page(row_id),
+                row_slot(row_id)
+            );
+        }
+    }
+
+    // Pages evicted while a checkpoint snapshots the dirty page table are
+    // written back but not synced, and are left out of the table; a crash
+    // after the checkpoint must not lose them. The FSM flush between the
+    // write-back and the snapshot is held open to evict pages inside it.
+    #[cfg(unix)]
+    #[test]
+    fn test_checkpoint_eviction_window() {
+        const LEN: usize = 300;
+        let dir = TempDir::new("checkpoint-window");
+        let options = crash_options(small_pool_options(4));
+        track_crashes(dir.path());
+        let storage = Storage::open(dir.path(), &options);
+
+        let mut row_ids = insert_batches(&storage, 0..10, LEN);
+
+        let hold = hold_sync(&dir.file("fsm.dat"));
+        std::thread::scope(|scope| {
+            let checkpoint = scope.spawn(|| storage.checkpoint());
+            hold.wait();
+            row_ids.extend(insert_batches(&storage, 10..20, LEN));
+            drop(hold);
+            assert_eq!(checkpoint.join().unwrap(), STORAGE_OK);
+        });
+
+        storage.crash(dir.path());
+        let storage = Storage::recover(dir.path(), &options);
+        assert_rows(&storage, &row_ids, LEN);
+    }
+
+    // Checkpoints copy pages that inserts are changing; a copy taken in
+    // the middle of adding a tuple would be redone on top of itself and
+    // fail recovery. Each round crashes right after a checkpoint taken
+    // under load and checks the rows committed before it.
+    #[cfg(unix)]
+    #[test]
+    fn test_checkpoint_during_inserts() {
+        const LEN: usize = 12;
+        for _ in 0..20 {
+            let dir = TempDir::new("checkpoint-inserts");
+            let options = crash_options(small_pool_options(64));
+            track_crashes(dir.path());
+            let storage = Storage::open(dir.path(), &options);
+
+            let committed = Mutex::new(Vec::new());
+            let stop = AtomicBool::new(false);
+            let row_ids = std::thread::scope(|scope| {
+                scope.spawn(|| {
+                    for batch in 0.. {
+                        if stop.load(Ordering::Acquire) {
+                            break;
+                        }
+                        // Inserts fail once the files are frozen.
+                        let rows = make_rows(batch * 200, 200, LEN);
+                        match storage.insert_rows(&rows) {
+                            Ok(ids) => committed.lock().unwrap().extend(ids),
+                            Err(_) => break,
+                        }
+                    }
+                });
+                for _ in 0..5 {
+                    assert_eq!(storage.checkpoint(), STORAGE_OK);
+                }
+                let row_ids = committed.lock().unwrap().clone();
+                crash_files(dir.path());
+                stop.store(true, Ordering::Release);
+                row_ids
+            });
+            drop(storage);
+            untrack_crashes(dir.path());
+
+            let storage = Storage::recover(dir.path(), &options);
+            assert_rows(&storage, &row_ids, LEN);
+        }
+    }
+
+    // Once the log cannot be written, an insert that runs out of log
+    // space fails, and the page whose record was refused goes back to
+    // what it held before: here a freshly extended page, which must be
+    // left empty rather than holding dead line pointers.
+    #[cfg(unix)]
+    #[test]
+    fn test_insert_log_failure() {
+        const LEN: usize = 500;
+        let dir = TempDir::new("insert-log-failure");
+        let options = crash_options(StorageOptions {
+            wal_buffer_bytes: 64 * 1024,
+            wal_writer_interval_ms: 0,
+            wal_compression_threshold: 0,
+            ..StorageOptions::default()
+        });
+        track_crashes(dir.path());
+        let storage = Storage::open(dir.path(), &options);
+        let row_ids = storage.insert_rows(&make_rows(0, 30, LEN)).unwrap();
+
+        let segment = dir.file("wal").join(format!("{:016x}", 1));
+        fail_writes(&segment, true);
+        assert!(storage.insert_rows(&make_rows(30, 400, LEN)).is_err());
+        fail_writes(&segment, false);
+
+        let last = (0..)
+            .take_while(|&id| storage.pin(id).is_some())
+            .last()
+            .unwrap();
+        assert!(last > row_page(*row_ids.last().unwrap()));
+        let page = storage.pin(last).unwrap();
+        assert_eq!(read_u16(page.bytes(), 8) as usize, PAGE_DATA_OFFSET);
+        assert_eq!(read_u16(page.bytes(), 10) as usize, PAGE_SIZE);
+        assert_eq!(read_u16(page.bytes(), 14), 0);
+        drop(page);
+
+        storage.crash(dir.path());
+        let storage = Storage::recover(dir.path(), &options);
+        assert_rows(&storage, &row_ids, LEN);
+    }
+
+    // Committers on several threads reserve log space concurrently while
+    // the log crosses into segments the background writer precreates.
+    // Every committed row must survive a crash.
+    #[cfg(unix)]
+    #[test]
+    fn test_concurrent_inserts_across_segments() {
+        const LEN: usize = 2000;
+        const THREADS: usize = 4;
+        let dir = TempDir::new("wal-segments");
+        let options = crash_options(StorageOptions {
+            wal_compression_threshold: 0,
+            ..StorageOptions::default()
+        });
+        track_crashes(dir.path());
+        let storage = Storage::open(dir.path(), &options);
+
+        let row_ids: Vec<Vec<u64>> = std::thread::scope(|scope| {
+            let inserters: Vec<_> = (0..THREADS)
+                .map(|t| {
+                    let storage = &storage;
+                    scope.spawn(move || insert_batches(storage, t * 1000..t * 1000 + 250, LEN))
+                })
+                .collect();
+            inserters.into_iter().map(|h| h.join().unwrap()).collect()
+        });
+        assert!(dir.path().join("wal").read_dir().unwrap().count() >= 3);
+
+        storage.crash(dir.path());
+        let storage = Storage::recover(dir.path(), &options);
+        for (t, ids) in row_ids.iter().enumerate() {
+            for (i, &row_id) in ids.iter().enumerate() {
+                assert_eq!(storage.read_row(row_id), Some(make_row(t * 20000 + i, LEN)));
+            }
+        }
+    }
+
+    // Records of every size, compressed or not, replay to the rows that
+    // were logged.
+    #[cfg(unix)]
     #[test]
     fn test_wal_append() {
-        assert!(true);
+        let dir = TempDir::new("wal-append");
+        let options = crash_options(StorageOptions {
+            wal_compression_threshold: 256,
+            ..StorageOptions::default()
+        });
+        track_crashes(dir.path());
+        let storage = Storage::open(dir.path(), &options);
+
+        let lens: Vec<usize> = (0..200).map(|i| 8 + i * 37 % 3000).collect();
+        let mut row_ids = Vec::new();
+        for (i, &len) in lens.iter().enumerate() {
+            row_ids.extend(storage.insert_rows(&[make_row(i, len)]).unwrap());
+        }
+        let batch = make_rows(200, 50, 100);
+        row_ids.extend(storage.insert_rows(&batch).unwrap());
+        assert!(storage.metrics().wal_compressed_records > 0);
+
+        storage.crash(dir.path());
+        let storage = Storage::recover(dir.path(), &options);
+        for (i, &row_id) in row_ids.iter().enumerate() {
+            let len = lens.get(i).copied().unwrap_or(100);
+            assert_eq!(
+                storage.read_row(row_id),
+                Some(make_row(i, len)),
+                "row {}",
+                i
+            );
+        }
     }
 
+    // A commit returns only once its record is durable: rows survive a
+    // crash with no checkpoint and no page ever written.
+    #[cfg(unix)]
     #[test]
     fn test_wal_flush() {
-        assert!(true);
+        const LEN: usize = 100;
+        let dir = TempDir::new("wal-flush");
+        let options = crash_options(StorageOptions::default());
+        track_crashes(dir.path());
+        let storage = Storage::open(dir.path(), &options);
+
+        let row_ids = insert_batches(&storage, 0..50, LEN);
+        assert!(storage.crash(dir.path()) > 0);
+        let storage = Storage::recover(dir.path(), &options);
+        assert_rows(&storage, &row_ids, LEN);
+    }
+
+    // Commits that arrive while a sync is under way wait for it and then
+    // share the next one, rather than syncing the log one by one. The
+    // first commit's sync is held until the others are queued behind it.
+    #[cfg(unix)]
+    #[test]
+    fn test_group_commit() {
+        const LEN: usize = 100;
+        const COMMITTERS: usize = 8;
+        let dir = TempDir::new("group-commit");
+        let options = crash_options(StorageOptions {
+            wal_writer_interval_ms: 0,
+            ..StorageOptions::default()
+        });
+        track_crashes(dir.path());
+        let storage = Storage::open(dir.path(), &options);
+        let mut row_ids = insert_batches(&storage, 0..1, LEN);
+
+        let hold = hold_sync(&dir.file("wal").join(format!("{:016x}", 1)));
+        let syncs = std::thread::scope(|scope| {
+            let insert = |i: usize| {
+                let storage = &storage;
+                scope.spawn(move || storage.insert_rows(&[make_row(20 + i, LEN)]).unwrap()[0])
+            };
+            let mut committers = vec![insert(0)];
+            hold.wait();
+            committers.extend((1..COMMITTERS).map(insert));
+            std::thread::sleep(std::time::Duration::from_millis(200));
+            let syncs = sync_count(dir.path());
+            drop(hold);
+            row_ids.extend(committers.into_iter().map(|h| h.join().unwrap()));
+            sync_count(dir.path()) - syncs
+        });
+        assert!(syncs <= 2, "{} syncs for {} commits", syncs, COMMITTERS);
+
+        storage.crash(dir.path());
+        let storage = Storage::recover(dir.path(), &options);
+        assert_rows(&storage, &row_ids, LEN);
+    }
+
+    // Writers reserve log space concurrently and fill it in parallel.
+    // Every record must land whole, with a valid CRC, and each writer's
+    // records in the order it appended them, across segment boundaries.
+    #[test]
+    fn test_concurrent_reservation_order() {
+        const THREADS: u32 = 8;
+        const RECORDS: u32 = 2500;
+        let dir = TempDir::new("wal-reservations");
+        let options = StorageOptions {
+            wal_compression_threshold: 0,
+            ..StorageOptions::default()
+        };
+        let storage = Storage::open(dir.path(), &options);
+
+        std::thread::scope(|scope| {
+            for t in 0..THREADS {
+                let storage = &storage;
+                scope.spawn(move || {
+                    for i in 0..RECORDS {
+                        let len = 16 + (t * 7919 + i * 104729) as usize % 2000;
+                        let fill = random_bytes((t * RECORDS + i) as u64, len);
+                        let lsn = storage.wal_append(WAL_COMMIT, t, &[&i.to_le_bytes(), &fill]);
+                        assert_ne!(lsn, 0);
+                    }
+                });
+            }
+        });
+        assert_eq!(storage.wal_flush(), STORAGE_OK);
+
+        let records = read_wal(dir.path());
+        let mut next = vec![0u32; THREADS as usize];
+        for record in records
+            .iter()
+            .filter(|r| r.kind == WAL_COMMIT && r.payload.len() >= 16)
+        {
+            let (t, i) = (record.transaction_id, read_u32(&record.payload, 0));
+            assert_eq!(i, next[t as usize], "writer {} out of order", t);
+            let len = 16 + (t * 7919 + i * 104729) as usize % 2000;
+            assert_eq!(
+                record.payload[4..],
+                random_bytes((t * RECORDS + i) as u64, len)
+            );
+            next[t as usize] += 1;
+        }
+        assert!(next.iter().all(|&n| n == RECORDS), "{:?}", next);
+        assert!(records.last().unwrap().lsn >= 2 * WAL_SEGMENT_SIZE);
+    }
+
+    // Appends records of the given payloads until the log has crossed
+    // into a third segment, and returns the payloads logged.
+    fn append_across_segments(storage: &Storage, payload: impl Fn(u64) -> Vec<u8>) -> Vec<Vec<u8>> {
+        let mut payloads = Vec::new();
+        loop {
+            let data = payload(payloads.len() as u64);
+            let lsn = storage.wal_append(WAL_COMMIT, 1, &[&data]);
+            assert_ne!(lsn, 0);
+            payloads.push(data);
+            if lsn >= 3 * WAL_SEGMENT_SIZE {
+                return payloads;
+            }
+        }
+    }
+
+    // Reads back the records append_across_segments logged, checks their
+    // payloads, and returns how many of the chains span two segments.
+    fn check_chains(dir: &Path, payloads: &[Vec<u8>], compressed: bool) -> usize {
+        let records: Vec<WalRecord> = read_wal(dir)
+            .into_iter()
+            .filter(|r| r.kind == WAL_COMMIT && r.transaction_id == 1)
+            .collect();
+        assert_eq!(records.len(), payloads.len());
+        for (record, payload) in records.iter().zip(payloads) {
+            assert!(record.pieces > 1);
+            assert_eq!(record.compressed, compressed);
+            assert!(record.payload == *payload, "chain at {}", record.lsn);
+        }
+        records
+            .iter()
+            .filter(|r| r.lsn / WAL_SEGMENT_SIZE != r.last_lsn / WAL_SEGMENT_SIZE)
+            .count()
+    }
+
+    // Payloads too large for one record are logged as chains, which may
+    // be split between segments. The log must read back whole, and replay
+    // must carry on past such chains to the rows logged after them.
+    #[cfg(unix)]
+    #[test]
+    fn test_continuation_across_segments() {
+        const LEN: usize = 500;
+        let dir = TempDir::new("wal-chains");
+        let options = crash_options(StorageOptions {
+            wal_compression_threshold: 0,
+            ..StorageOptions::default()
+        });
+        track_crashes(dir.path());
+        let storage = Storage::open(dir.path(), &options);
+
+        let mut row_ids = insert_batches(&storage, 0..5, LEN);
+        let payloads = append_across_segments(&storage, |i| random_bytes(i, 150_000));
+        row_ids.extend(insert_batches(&storage, 5..10, LEN));
+        assert!(check_chains(dir.path(), &payloads, false) > 0);
+
+        storage.crash(dir.path());
+        let storage = Storage::recover(dir.path(), &options);
+        assert_rows(&storage, &row_ids, LEN);
+    }
+
+    // As above, with payloads that compress but still need a chain once
+    // compressed.
+    #[cfg(unix)]
+    #[test]
+    fn test_compressed_chain_across_segments() {
+        const LEN: usize = 500;
+        let dir = TempDir::new("wal-compressed-chains");
+        let options = crash_options(StorageOptions {
+            wal_compression_threshold: 1024,
+            ..StorageOptions::default()
+        });
+        track_crashes(dir.path());
+        let storage = Storage::open(dir.path(), &options);
+
+        let mut row_ids = insert_batches(&storage, 0..5, LEN);
+        let payloads = append_across_segments(&storage, |i| {
+            let mut payload = random_bytes(i, 100_000);
+            payload.resize(200_000, 0);
+            payload
+        });
+        row_ids.extend(insert_batches(&storage, 5..10, LEN));
+        assert!(check_chains(dir.path(), &payloads, true) > 0);
+        assert!(storage.metrics().wal_compressed_records >= payloads.len() as u64);
+
+        storage.crash(dir.path());
+        let storage = Storage::recover(dir.path(), &options);
+        assert_rows(&storage, &row_ids, LEN);
     }
 
+    // Parallel redo partitions records by page; the pages it rebuilds
+    // must match those of a single worker.
+    #[cfg(unix)]
     #[test]
     fn test_wal_replay() {
-        assert!(true);
+        const LEN: usize = 150;
+        let dir = TempDir::new("wal-replay");
+        let options = crash_options(small_pool_options(16));
+        track_crashes(dir.path());
+        let storage = Storage::open(dir.path(), &options);
+
+        let mut row_ids = insert_batches(&storage, 0..40, LEN);
+        assert_eq!(storage.checkpoint(), STORAGE_OK);
+        row_ids.extend(insert_batches(&storage, 40..100, LEN));
+        storage.crash(dir.path());
+
+        let pages = |workers: usize| {
+            let copy = TempDir::new("wal-replay-copy");
+            copy_dir(dir.path(), copy.path());
+            let options = StorageOptions {
+                recovery_workers: workers,
+                ..options
+            };
+            let storage = Storage::recover(copy.path(), &options);
+            assert_rows(&storage, &row_ids, LEN);
+            let last = row_page(*row_ids.last().unwrap());
+            (0..=last)
+                .map(|id| storage.pin(id).unwrap().bytes()[PAGE_DATA_OFFSET..].to_vec())
+                .collect::<Vec<_>>()
+        };
+        assert!(pages(1) == pages(4));
     }
 
+    // A checkpoint's control file bounds replay; if it is damaged,
+    // recovery replays every retained segment instead.
+    #[cfg(unix)]
     #[test]
     fn test_checkpoint_creation() {
-        assert!(true);
+        const LEN: usize = 200;
+        let dir = TempDir::new("checkpoint-creation");
+        let options = crash_options(small_pool_options(16));
+        track_crashes(dir.path());
+        let storage = Storage::open(dir.path(), &options);
+
+        let mut row_ids = insert_batches(&storage, 0..30, LEN);
+        assert_eq!(storage.checkpoint(), STORAGE_OK);
+        row_ids.extend(insert_batches(&storage, 30..60, LEN));
+        storage.crash(dir.path());
+
+        let intact = TempDir::new("checkpoint-creation-intact");
+        copy_dir(dir.path(), intact.path());
+        let storage = Storage::recover(intact.path(), &options);
+        assert_rows(&storage, &row_ids, LEN);
+        drop(storage);
+
+        flip_bit(&dir.file("control"), 20);
+        let storage = Storage::recover(dir.path(), &options);
+        assert_rows(&storage, &row_ids, LEN);
     }
 
+    // Recovery can itself be interrupted: a crash after replay, before any
+    // checkpoint, must recover to the same rows.
+    #[cfg(unix)]
     #[test]
     fn test_recovery_idempotence() {
-        assert!(true);
+        const LEN: usize = 120;
+        let dir = TempDir::new("recovery-idempotence");
+        let options = crash_options(small_pool_options(8));
+        track_crashes(dir.path());
+        let storage = Storage::open(dir.path(), &options);
+
+        let mut row_ids = insert_batches(&storage, 0..20, LEN);
+        assert_eq!(storage.checkpoint(), STORAGE_OK);
+        row_ids.extend(insert_batches(&storage, 20..60, LEN));
+        storage.crash(dir.path());
+
+        for _ in 0..3 {
+            track_crashes(dir.path());
+            let storage = Storage::recover(dir.path(), &options);
+            assert_rows(&storage, &row_ids, LEN);
+            storage.crash(dir.path());
+        }
+        let storage = Storage::recover(dir.path(), &options);
+        row_ids.extend(insert_batches(&storage, 60..70, LEN));
+        assert_rows(&storage, &row_ids, LEN);
+    }
+
+    // A record that fails its CRC ends the log: replay keeps everything
+    // before it, and the log carries on from there.
+    #[cfg(unix)]
+    #[test]
+    fn test_wal_torn_tail() {
+        const LEN: usize = 1000;
+        let dir = TempDir::new("wal-torn-tail");
+        let options = crash_options(StorageOptions {
+            wal_compression_threshold: 0,
+            ..StorageOptions::default()
+        });
+        track_crashes(dir.path());
+        let storage = Storage::open(dir.path(), &options);
+
+        let mut row_ids = insert_batches(&storage, 0..10, LEN);
+        let torn = storage.insert_rows(&[make_row(200, LEN)]).unwrap()[0];
+        storage.crash(dir.path());
+
+        let (segment, offset) = find_in_files(&dir.file("wal"), &make_row(200, LEN)).unwrap();
+        flip_bit(&segment, offset + LEN as u64 / 2);
+
+        track_crashes(dir.path());
+        let storage = Storage::recover(dir.path(), &options);
+        assert_rows(&storage, &row_ids, LEN);
+        assert_eq!(storage.read_row(torn), None);
+
+        row_ids.extend(insert_batches(&storage, 10..20, LEN));
+        storage.crash(dir.path());
+        let storage = Storage::recover(dir.path(), &options);
+        assert_rows(&storage, &row_ids, LEN);
     }
 }
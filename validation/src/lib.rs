@@ -1,5 +1,8 @@
+pub mod buffer_pool;
 pub mod crash_recovery;
 pub mod determinism;
 pub mod language;
 pub mod optimizer;
+pub mod pages;
 pub mod sharding;
+pub mod storage;
@@ -0,0 +1,141 @@
+#[cfg(test)]
+mod tests {
+    use crate::storage::*;
+
+    const COMPRESSED_MARKER: u32 = u32::MAX;
+
+    fn insert_pages(storage: &Storage, pages: u32, len: usize) -> Vec<u64> {
+        let mut row_ids: Vec<u64> = Vec::new();
+        while row_ids.last().map_or(0, |&id| row_page(id) + 1) < pages {
+            let rows = make_rows(row_ids.len(), 50, len);
+            row_ids.extend(storage.insert_rows(&rows).unwrap());
+        }
+        row_ids
+    }
+
+    // Compressed images expand back to the pages that were written, and
+    // damage inside one is caught like damage to a raw page.
+    #[test]
+    fn test_compressed_pages_round_trip() {
+        const LEN: usize = 200;
+        let dir = TempDir::new("compressed-pages");
+        let options = StorageOptions {
+            page_compression: true,
+            ..StorageOptions::default()
+        };
+        let storage = Storage::open(dir.path(), &options);
+        let row_ids = insert_pages(&storage, 40, LEN);
+        assert_eq!(storage.checkpoint(), STORAGE_OK);
+        assert!(storage.metrics().page_compressed_writes > 0);
+        drop(storage);
+
+        let storage = Storage::open(dir.path(), &options);
+        for (i, &row_id) in row_ids.iter().enumerate() {
+            assert_eq!(
+                storage.read_row(row_id),
+                Some(make_row(i, LEN)),
+                "row {}",
+                i
+            );
+        }
+        assert!(storage.metrics().page_decompress_ns > 0);
+        drop(storage);
+
+        let pages = std::fs::read(dir.file("pages.dat")).unwrap();
+        let victim = (0..40)
+            .find(|&id| read_u32(&pages, id * PAGE_SIZE) == COMPRESSED_MARKER)
+            .unwrap();
+        flip_bit(&dir.file("pages.dat"), (victim * PAGE_SIZE + 64) as u64);
+        let storage = Storage::open(dir.path(), &options);
+        assert!(storage.pin(victim as u32).is_none());
+    }
+
+    // page_checksum never yields 0, so a page whose checksum field was
+    // cleared is damaged; only a page that is all zeros passes with it.
+    #[test]
+    fn test_zero_checksum() {
+        let dir = TempDir::new("zero-checksum");
+        let options = StorageOptions::default();
+        let storage = Storage::open(dir.path(), &options);
+        insert_pages(&storage, 8, 300);
+        assert_eq!(storage.checkpoint(), STORAGE_OK);
+        drop(storage);
+
+        let path = dir.file("pages.dat");
+        write_at(&path, 2 * PAGE_SIZE as u64 + 4, &[0; 4]);
+        write_at(&path, 3 * PAGE_SIZE as u64, &[0; PAGE_SIZE]);
+        let storage = Storage::open(dir.path(), &options);
+        assert!(storage.pin(2).is_none());
+        assert!(storage.pin(3).is_some());
+        assert!(storage.pin(4).is_some());
+    }
+
+    // A compressed write-back punches out the tail of the page's slot.
+    // A raw image of the same page written in the meantime must not lose
+    // its tail to that punch: here a flush of page 0 runs while the
+    // checkpoint's punch for it is held back, and the page must still
+    // read after a crash.
+    #[cfg(unix)]
+    #[test]
+    fn test_compressed_write_back_race() {
+        const LEN: usize = 100;
+        let dir = TempDir::new("punch-race");
+        let options = crash_options(StorageOptions {
+            page_compression: true,
+            ..StorageOptions::default()
+        });
+        track_crashes(dir.path());
+        let storage = Storage::open(dir.path(), &options);
+        let mut row_ids = storage.insert_rows(&make_rows(0, 5, LEN)).unwrap();
+        let mut rows = make_rows(0, 5, LEN);
+
+        let noise: Vec<Vec<u8>> = (0..60).map(|i| random_bytes(i, LEN)).collect();
+        let hold = hold_punch(&dir.file("pages.dat"));
+        std::thread::scope(|scope| {
+            let checkpoint = scope.spawn(|| storage.checkpoint());
+            hold.wait();
+            let flush = scope.spawn(|| {
+                let row_ids = storage.insert_rows(&noise).unwrap();
+                assert_eq!(storage.flush_page(0), STORAGE_OK);
+                row_ids
+            });
+            std::thread::sleep(std::time::Duration::from_millis(200));
+            drop(hold);
+            row_ids.extend(flush.join().unwrap());
+            assert_eq!(checkpoint.join().unwrap(), STORAGE_OK);
+        });
+        rows.extend(noise);
+        assert!(row_ids.iter().all(|&row_id| row_page(row_id) == 0));
+
+        storage.crash(dir.path());
+        let storage = Storage::recover(dir.path(), &options);
+        for (row, &row_id) in rows.iter().zip(&row_ids) {
+            assert_eq!(storage.read_row(row_id).as_ref(), Some(row));
+        }
+    }
+
+    // The free space map is saved by checkpoints; after a restart, inserts
+    // still find the room left on existing pages instead of extending.
+    #[test]
+    fn test_free_space_map_persists() {
+        let dir = TempDir::new("fsm-persists");
+        let options = StorageOptions::default();
+        let storage = Storage::open(dir.path(), &options);
+        // Two of these fill a page to within about 2 KiB.
+        let row_ids = storage.insert_rows(&make_rows(0, 20, 3000)).unwrap();
+        let pages = row_page(*row_ids.last().unwrap()) + 1;
+        assert_eq!(pages, 10);
+        assert_eq!(storage.checkpoint(), STORAGE_OK);
+        drop(storage);
+
+        let storage = Storage::open(dir.path(), &options);
+        let row_ids = storage.insert_rows(&make_rows(20, 10, 1000)).unwrap();
+        for &row_id in &row_ids {
+            assert!(
+                row_page(row_id) < pages,
+                "row went to new page {}",
+                row_page(row_id)
+            );
+        }
+    }
+}
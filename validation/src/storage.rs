@@ -0,0 +1,652 @@
+// Bindings to the C storage engine, built by build.rs, and helpers for
+// tests that drive it and inspect its files. Layouts must match
+// storage/include/minsql_storage.h.
+use std::ffi::{c_void, CString};
+use std::fs;
+use std::os::raw::c_char;
+use std::path::{Path, PathBuf};
+use std::sync::atomic::{AtomicUsize, Ordering};
+
+pub const PAGE_SIZE: usize = 8192;
+pub const PAGE_DATA_OFFSET: usize = 32;
+pub const LINE_POINTER_SIZE: usize = 6;
+
+pub const STORAGE_OK: i32 = 0;
+pub const STORAGE_IO_ERROR: i32 = 3;
+pub const STORAGE_CORRUPTION: i32 = 4;
+
+pub const WAL_SEGMENT_SIZE: u64 = 16 * 1024 * 1024;
+pub const WAL_ENTRY_SIZE: usize = 32;
+pub const WAL_INSERT: u16 = 1;
+pub const WAL_COMMIT: u16 = 4;
+pub const WAL_SWITCH: u16 = 7;
+pub const WAL_TYPE_MASK: u16 = 0x00FF;
+pub const WAL_FLAG_CONTINUED: u16 = 0x8000;
+pub const WAL_FLAG_CONTINUATION: u16 = 0x4000;
+pub const WAL_FLAG_COMPRESSED: u16 = 0x2000;
+
+#[repr(C)]
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum ReplacementPolicy {
+    Clock = 0,
+    TwoQ = 1,
+}
+
+#[repr(C)]
+#[derive(Debug, Clone, Copy)]
+pub struct StorageOptions {
+    pub buffer_pool_bytes: usize,
+    pub buffer_pool_frames: usize,
+    pub buffer_pool_partitions: usize,
+    pub replacement_policy: ReplacementPolicy,
+    pub huge_pages: bool,
+    pub arena_bytes: usize,
+    pub io_queue_depth: usize,
+    pub direct_io: bool,
+    pub wal_buffer_bytes: usize,
+    pub wal_writer_interval_ms: usize,
+    pub recovery_workers: usize,
+    pub wal_compression_threshold: usize,
+    pub page_compression: bool,
+}
+
+impl Default for StorageOptions {
+    fn default() -> Self {
+        let mut options = std::mem::MaybeUninit::<StorageOptions>::uninit();
+        unsafe {
+            storage_default_options(options.as_mut_ptr());
+            options.assume_init()
+        }
+    }
+}
+
+#[repr(C)]
+#[derive(Debug, Clone, Copy, Default)]
+pub struct StorageMetrics {
+    pub buffer_hits: u64,
+    pub buffer_misses: u64,
+    pub prefetch_issued: u64,
+    pub prefetch_hits: u64,
+    pub prefetch_unused: u64,
+    pub wal_compressed_records: u64,
+    pub wal_compress_input_bytes: u64,
+    pub wal_compress_output_bytes: u64,
+    pub wal_compress_ns: u64,
+    pub wal_decompress_ns: u64,
+    pub page_compressed_writes: u64,
+    pub page_compress_input_bytes: u64,
+    pub page_compress_output_bytes: u64,
+    pub page_compress_ns: u64,
+    pub page_decompress_ns: u64,
+}
+
+#[repr(C)]
+struct WalEntryHeader {
+    lsn: u64,
+    transaction_id: u32,
+    logical_time: u64,
+    kind: u16,
+    length: u16,
+    crc: u32,
+}
+
+#[repr(C)]
+struct WalFragment {
+    data: *const u8,
+    len: usize,
+}
+
+extern "C" {
+    fn storage_default_options(options: *mut StorageOptions);
+    fn storage_init_ex(data_dir: *const c_char, options: *const StorageOptions) -> *mut c_void;
+    fn storage_shutdown(handle: *mut c_void);
+    fn storage_get_page(handle: *mut c_void, page_id: u32) -> *mut u8;
+    fn storage_release_page(handle: *mut c_void, page: *mut u8);
+    fn storage_put_page(handle: *mut c_void, page: *mut u8) -> i32;
+    fn storage_flush_page(handle: *mut c_void, page: *mut u8) -> i32;
+    fn storage_prefetch_pages(handle: *mut c_void, first_page: u32, count: usize) -> usize;
+    fn storage_get_metrics(handle: *mut c_void, metrics: *mut StorageMetrics);
+    fn storage_checkpoint(handle: *mut c_void) -> i32;
+    fn storage_recover(handle: *mut c_void) -> i32;
+    fn storage_wal_append_v(
+        handle: *mut c_void,
+        header: *const WalEntryHeader,
+        fragments: *const WalFragment,
+        count: usize,
+    ) -> u64;
+    fn storage_wal_commit(handle: *mut c_void, lsn: u64) -> i32;
+    fn storage_wal_flush(handle: *mut c_void) -> i32;
+    fn storage_crc32c(crc: u32, data: *const u8, len: usize) -> u32;
+    fn lz_decompress(src: *const u8, len: usize, dst: *mut u8, out_len: usize) -> bool;
+    fn storage_insert_rows_batch(
+        handle: *mut c_void,
+        table_name: *const c_char,
+        data: *const u8,
+        row_lens: *const usize,
+        count: usize,
+        row_ids_out: *mut u64,
+    ) -> i32;
+}
+
+// The crash simulator linked under the engine by build.rs (Unix only).
+#[cfg(unix)]
+extern "C" {
+    fn crashfs_track(dir: *const c_char) -> i32;
+    fn crashfs_crash(dir: *const c_char) -> std::os::raw::c_long;
+    fn crashfs_untrack(dir: *const c_char);
+    fn crashfs_hold_sync(path: *const c_char) -> i32;
+    fn crashfs_hold_punch(path: *const c_char) -> i32;
+    fn crashfs_wait_held();
+    fn crashfs_release_hold();
+    fn crashfs_fail_writes(path: *const c_char, fail: i32) -> i32;
+    fn crashfs_syncs(dir: *const c_char) -> std::os::raw::c_long;
+}
+
+fn c_path(path: &Path) -> CString {
+    CString::new(path.to_str().unwrap()).unwrap()
+}
+
+// Records writes under dir from now on, so a later Storage::crash can
+// discard those that were never synced. Call it before opening the
+// engine, which must use synchronous, buffered page I/O.
+#[cfg(unix)]
+pub fn track_crashes(dir: &Path) {
+    assert_eq!(unsafe { crashfs_track(c_path(dir).as_ptr()) }, 0);
+}
+
+// Blocks the next sync of path until the returned guard is dropped;
+// wait() returns once a sync is blocked.
+#[cfg(unix)]
+pub fn hold_sync(path: &Path) -> Hold {
+    assert_eq!(unsafe { crashfs_hold_sync(c_path(path).as_ptr()) }, 0);
+    Hold
+}
+
+// As hold_sync, for the next hole punched in path.
+#[cfg(unix)]
+pub fn hold_punch(path: &Path) -> Hold {
+    assert_eq!(unsafe { crashfs_hold_punch(c_path(path).as_ptr()) }, 0);
+    Hold
+}
+
+#[cfg(unix)]
+pub struct Hold;
+
+#[cfg(unix)]
+impl Hold {
+    pub fn wait(&self) {
+        unsafe { crashfs_wait_held() };
+    }
+}
+
+#[cfg(unix)]
+impl Drop for Hold {
+    fn drop(&mut self) {
+        unsafe { crashfs_release_hold() };
+    }
+}
+
+// Makes writes to path fail with EIO until called again with false.
+#[cfg(unix)]
+pub fn fail_writes(path: &Path, fail: bool) {
+    assert_eq!(
+        unsafe { crashfs_fail_writes(c_path(path).as_ptr(), fail as i32) },
+        0
+    );
+}
+
+// The number of fsync and fdatasync calls under dir since it was tracked.
+#[cfg(unix)]
+pub fn sync_count(dir: &Path) -> i64 {
+    let syncs = unsafe { crashfs_syncs(c_path(dir).as_ptr()) };
+    assert!(syncs >= 0, "{:?} is not tracked", dir);
+    syncs as i64
+}
+
+// Rolls back every unsynced write under dir and ignores later I/O there,
+// while the engine keeps running. Returns the number of writes lost.
+#[cfg(unix)]
+pub fn crash_files(dir: &Path) -> i64 {
+    let undone = unsafe { crashfs_crash(c_path(dir).as_ptr()) };
+    assert!(undone >= 0, "{:?} is not tracked", dir);
+    undone as i64
+}
+
+// Stops tracking dir; call it once the crashed engine is shut down.
+#[cfg(unix)]
+pub fn untrack_crashes(dir: &Path) {
+    unsafe { crashfs_untrack(c_path(dir).as_ptr()) };
+}
+
+pub fn crash_options(options: StorageOptions) -> StorageOptions {
+    StorageOptions {
+        io_queue_depth: 0,
+        direct_io: false,
+        ..options
+    }
+}
+
+pub fn row_page(row_id: u64) -> u32 {
+    (row_id >> 16) as u32
+}
+
+pub fn row_slot(row_id: u64) -> u16 {
+    row_id as u16
+}
+
+// A fresh directory under the system temp dir, removed on drop.
+pub struct TempDir(PathBuf);
+
+impl TempDir {
+    pub fn new(name: &str) -> Self {
+        static NEXT: AtomicUsize = AtomicUsize::new(0);
+        let path = std::env::temp_dir().join(format!(
+            "minsql-validation-{}-{}-{}",
+            name,
+            std::process::id(),
+            NEXT.fetch_add(1, Ordering::Relaxed)
+        ));
+        let _ = fs::remove_dir_all(&path);
+        fs::create_dir_all(&path).unwrap();
+        TempDir(path)
+    }
+
+    pub fn path(&self) -> &Path {
+        &self.0
+    }
+
+    pub fn file(&self, name: &str) -> PathBuf {
+        self.0.join(name)
+    }
+}
+
+impl Drop for TempDir {
+    fn drop(&mut self) {
+        let _ = fs::remove_dir_all(&self.0);
+    }
+}
+
+pub struct Storage {
+    handle: *mut c_void,
+}
+
+unsafe impl Send for Storage {}
+unsafe impl Sync for Storage {}
+
+impl Storage {
+    pub fn open(dir: &Path, options: &StorageOptions) -> Storage {
+        let handle = unsafe { storage_init_ex(c_path(dir).as_ptr(), options) };
+        assert!(!handle.is_null(), "storage_init_ex failed for {:?}", dir);
+        Storage { handle }
+    }
+
+    // Opens the directory and runs crash recovery, as a restart would.
+    pub fn recover(dir: &Path, options: &StorageOptions) -> Storage {
+        let storage = Storage::open(dir, options);
+        assert_eq!(unsafe { storage_recover(storage.handle) }, STORAGE_OK);
+        storage
+    }
+
+    pub fn insert_rows(&self, rows: &[Vec<u8>]) -> Result<Vec<u64>, i32> {
+        let table = CString::new("t").unwrap();
+        let data: Vec<u8> = rows.concat();
+        let lens: Vec<usize> = rows.iter().map(|row| row.len()).collect();
+        let mut row_ids = vec![0u64; rows.len()];
+        let result = unsafe {
+            storage_insert_rows_batch(
+                self.handle,
+                table.as_ptr(),
+                data.as_ptr(),
+                lens.as_ptr(),
+                rows.len(),
+                row_ids.as_mut_ptr(),
+            )
+        };
+        if result != STORAGE_OK {
+            return Err(result);
+        }
+        Ok(row_ids)
+    }
+
+    // Appends one WAL record of the given type whose payload is the
+    // fragments joined, and returns its LSN (0 if it could not be logged).
+    pub fn wal_append(&self, kind: u16, transaction_id: u32, fragments: &[&[u8]]) -> u64 {
+        let header = WalEntryHeader {
+            lsn: 0,
+            transaction_id,
+            logical_time: 0,
+            kind,
+            length: 0,
+            crc: 0,
+        };
+        let fragments: Vec<WalFragment> = fragments
+            .iter()
+            .map(|fragment| WalFragment {
+                data: fragment.as_ptr(),
+                len: fragment.len(),
+            })
+            .collect();
+        unsafe { storage_wal_append_v(self.handle, &header, fragments.as_ptr(), fragments.len()) }
+    }
+
+    // Waits until the record at lsn is durable.
+    pub fn wal_commit(&self, lsn: u64) -> i32 {
+        unsafe { storage_wal_commit(self.handle, lsn) }
+    }
+
+    pub fn wal_flush(&self) -> i32 {
+        unsafe { storage_wal_flush(self.handle) }
+    }
+
+    // Writes page_id back through the buffer pool, as a checkpoint would.
+    pub fn flush_page(&self, page_id: u32) -> i32 {
+        let page = self.pin(page_id).expect("page to flush is unreadable");
+        unsafe { storage_flush_page(self.handle, page.page) }
+    }
+
+    pub fn checkpoint(&self) -> i32 {
+        unsafe { storage_checkpoint(self.handle) }
+    }
+
+    pub fn metrics(&self) -> StorageMetrics {
+        let mut metrics = StorageMetrics::default();
+        unsafe { storage_get_metrics(self.handle, &mut metrics) };
+        metrics
+    }
+
+    pub fn prefetch(&self, first_page: u32, count: usize) -> usize {
+        unsafe { storage_prefetch_pages(self.handle, first_page, count) }
+    }
+
+    // Pins page_id and returns it, or None if it could not be read.
+    pub fn pin(&self, page_id: u32) -> Option<PinnedPage<'_>> {
+        let page = unsafe { storage_get_page(self.handle, page_id) };
+        if page.is_null() {
+            return None;
+        }
+        Some(PinnedPage {
+            storage: self,
+            page,
+        })
+    }
+
+    // The tuple at row_id, or None if the page cannot be read or the
+    // slot holds no live tuple.
+    pub fn read_row(&self, row_id: u64) -> Option<Vec<u8>> {
+        self.pin(row_page(row_id))?.tuple(row_slot(row_id))
+    }
+
+    // Simulates a power failure under dir, which must be tracked: every
+    // write not yet synced is rolled back, then the engine is shut down
+    // with its I/O discarded. Returns the number of writes lost.
+    #[cfg(unix)]
+    pub fn crash(self, dir: &Path) -> i64 {
+        let undone = crash_files(dir);
+        drop(self);
+        untrack_crashes(dir);
+        undone
+    }
+}
+
+impl Drop for Storage {
+    fn drop(&mut self) {
+        if !self.handle.is_null() {
+            unsafe { storage_shutdown(self.handle) };
+        }
+    }
+}
+
+pub struct PinnedPage<'a> {
+    storage: &'a Storage,
+    page: *mut u8,
+}
+
+impl PinnedPage<'_> {
+    pub fn bytes(&self) -> &[u8] {
+        unsafe { std::slice::from_raw_parts(self.page, PAGE_SIZE) }
+    }
+
+    pub fn page_id(&self) -> u32 {
+        read_u32(self.bytes(), 0)
+    }
+
+    pub fn lsn(&self) -> u64 {
+        read_u64(self.bytes(), 16)
+    }
+
+    pub fn tuple(&self, slot: u16) -> Option<Vec<u8>> {
+        page_tuple(self.bytes(), slot)
+    }
+
+    // Marks the page dirty without changing it.
+    pub fn mark_dirty(&self) {
+        assert_eq!(
+            unsafe { storage_put_page(self.storage.handle, self.page) },
+            STORAGE_OK
+        );
+    }
+}
+
+impl Drop for PinnedPage<'_> {
+    fn drop(&mut self) {
+        unsafe { storage_release_page(self.storage.handle, self.page) };
+    }
+}
+
+pub fn read_u16(bytes: &[u8], offset: usize) -> u16 {
+    u16::from_le_bytes(bytes[offset..offset + 2].try_into().unwrap())
+}
+
+pub fn read_u32(bytes: &[u8], offset: usize) -> u32 {
+    u32::from_le_bytes(bytes[offset..offset + 4].try_into().unwrap())
+}
+
+pub fn read_u64(bytes: &[u8], offset: usize) -> u64 {
+    u64::from_le_bytes(bytes[offset..offset + 8].try_into().unwrap())
+}
+
+// Decodes a live tuple from a slotted page image.
+pub fn page_tuple(page: &[u8], slot: u16) -> Option<Vec<u8>> {
+    let lower = read_u16(page, 8) as usize;
+    let num_slots = (lower - PAGE_DATA_OFFSET) / LINE_POINTER_SIZE;
+    if slot as usize >= num_slots {
+        return None;
+    }
+    let lp = PAGE_DATA_OFFSET + slot as usize * LINE_POINTER_SIZE;
+    let offset = read_u16(page, lp) as usize;
+    let length = read_u16(page, lp + 2) as usize;
+    if read_u16(page, lp + 4) != 0 {
+        return None;
+    }
+    Some(page[offset..offset + length].to_vec())
+}
+
+// Deterministic row contents: row i of the given length.
+pub fn make_row(i: usize, len: usize) -> Vec<u8> {
+    let mut row: Vec<u8> = (0..len).map(|k| (i * 31 + k * 7) as u8).collect();
+    row[..8].copy_from_slice(&(i as u64).to_le_bytes());
+    row
+}
+
+pub fn make_rows(first: usize, count: usize, len: usize) -> Vec<Vec<u8>> {
+    (first..first + count).map(|i| make_row(i, len)).collect()
+}
+
+// Bytes that do not compress, the same for the same seed.
+pub fn random_bytes(seed: u64, len: usize) -> Vec<u8> {
+    let mut state = seed.wrapping_mul(0x9E37_79B9_7F4A_7C15) | 1;
+    (0..len)
+        .map(|_| {
+            state ^= state << 13;
+            state ^= state >> 7;
+            state ^= state << 17;
+            (state >> 24) as u8
+        })
+        .collect()
+}
+
+// Flips one bit of a file in place.
+pub fn flip_bit(path: &Path, offset: u64) {
+    let mut bytes = fs::read(path).unwrap();
+    bytes[offset as usize] ^= 0x10;
+    fs::write(path, bytes).unwrap();
+}
+
+// Overwrites bytes of a file in place.
+pub fn write_at(path: &Path, offset: u64, data: &[u8]) {
+    let mut bytes = fs::read(path).unwrap();
+    bytes[offset as usize..offset as usize + data.len()].copy_from_slice(data);
+    fs::write(path, bytes).unwrap();
+}
+
+// Copies a data directory, so one crashed state can be recovered more
+// than one way.
+pub fn copy_dir(from: &Path, to: &Path) {
+    fs::create_dir_all(to).unwrap();
+    for entry in fs::read_dir(from).unwrap() {
+        let path = entry.unwrap().path();
+        let target = to.join(path.file_name().unwrap());
+        if path.is_dir() {
+            copy_dir(&path, &target);
+        } else {
+            fs::copy(&path, &target).unwrap();
+        }
+    }
+}
+
+// The file under dir, and the offset in it, where needle first appears.
+pub fn find_in_files(dir: &Path, needle: &[u8]) -> Option<(PathBuf, u64)> {
+    for entry in fs::read_dir(dir).unwrap() {
+        let path = entry.unwrap().path();
+        let bytes = fs::read(&path).unwrap();
+        if let Some(at) = bytes.windows(needle.len()).position(|w| w == needle) {
+            return Some((path, at as u64));
+        }
+    }
+    None
+}
+
+pub fn small_pool_options(frames: usize) -> StorageOptions {
+    StorageOptions {
+        buffer_pool_frames: frames,
+        buffer_pool_partitions: 1,
+        ..StorageOptions::default()
+    }
+}
+
+// A WAL record as read back from the segment files: chains joined and
+// compressed payloads expanded.
+#[derive(Debug, Clone)]
+pub struct WalRecord {
+    pub lsn: u64,
+    pub last_lsn: u64,
+    pub transaction_id: u32,
+    pub kind: u16,
+    pub pieces: usize,
+    pub compressed: bool,
+    pub payload: Vec<u8>,
+}
+
+// Reads every valid record in the segments under dir/wal, in LSN order,
+// checking each record's CRC. Each segment is read up to its first
+// invalid record. Panics on a chain that is cut short or does not
+// decompress.
+pub fn read_wal(dir: &Path) -> Vec<WalRecord> {
+    let mut segments: Vec<(u64, PathBuf)> = fs::read_dir(dir.join("wal"))
+        .unwrap()
+        .filter_map(|entry| {
+            let path = entry.unwrap().path();
+            let name = path.file_name()?.to_str()?;
+            let seg = u64::from_str_radix(name, 16).ok()?;
+            Some((seg, path))
+        })
+        .collect();
+    segments.sort();
+
+    let mut records = Vec::new();
+    let mut chain: Option<WalRecord> = None;
+    for (seg, path) in segments {
+        let bytes = fs::read(&path).unwrap();
+        let base = seg * WAL_SEGMENT_SIZE;
+        let mut offset = 0usize;
+        while offset + WAL_ENTRY_SIZE <= bytes.len() {
+            let header = &bytes[offset..offset + WAL_ENTRY_SIZE];
+            let length = read_u16(header, 26) as usize;
+            if read_u64(header, 0) != base + offset as u64
+                || offset + WAL_ENTRY_SIZE + length > bytes.len()
+            {
+                break;
+            }
+            let mut zeroed = header.to_vec();
+            zeroed[28..32].fill(0);
+            let payload = &bytes[offset + WAL_ENTRY_SIZE..offset + WAL_ENTRY_SIZE + length];
+            let crc = unsafe {
+                let crc = storage_crc32c(0, zeroed.as_ptr(), zeroed.len());
+                storage_crc32c(crc, payload.as_ptr(), payload.len())
+            };
+            if crc != read_u32(header, 28) {
+                break;
+            }
+
+            let lsn = base + offset as u64;
+            let kind = read_u16(header, 24);
+            offset += WAL_ENTRY_SIZE + length;
+            if kind & WAL_TYPE_MASK == WAL_SWITCH {
+                continue;
+            }
+            let mut record = match chain.take() {
+                Some(record) => {
+                    assert!(
+                        kind & WAL_FLAG_CONTINUATION != 0,
+                        "chain at {} cut short",
+                        record.lsn
+                    );
+                    record
+                }
+                None => {
+                    assert!(
+                        kind & WAL_FLAG_CONTINUATION == 0,
+                        "stray continuation at {}",
+                        lsn
+                    );
+                    WalRecord {
+                        lsn,
+                        last_lsn: lsn,
+                        transaction_id: read_u32(header, 8),
+                        kind: kind & WAL_TYPE_MASK,
+                        pieces: 0,
+                        compressed: kind & WAL_FLAG_COMPRESSED != 0,
+                        payload: Vec::new(),
+                    }
+                }
+            };
+            record.last_lsn = lsn;
+            record.pieces += 1;
+            record.payload.extend_from_slice(payload);
+            if kind & WAL_FLAG_CONTINUED != 0 {
+                chain = Some(record);
+                continue;
+            }
+            if record.compressed {
+                record.payload = decompress(&record.payload);
+            }
+            records.push(record);
+        }
+    }
+    records
+}
+
+fn decompress(packed: &[u8]) -> Vec<u8> {
+    let len = read_u32(packed, 0) as usize;
+    let mut out = vec![0u8; len];
+    let ok = unsafe {
+        lz_decompress(
+            packed[4..].as_ptr(),
+            packed.len() - 4,
+            out.as_mut_ptr(),
+            len,
+        )
+    };
+    assert!(ok, "compressed WAL payload does not decompress");
+    out
+}